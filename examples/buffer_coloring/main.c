@@ -0,0 +1,211 @@
+/*
+ *------------------------------------------------------------------
+ * Copyright (c) 2017 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *------------------------------------------------------------------
+ */
+
+/*
+ * Buffer coloring microbenchmark
+ *
+ * Master and slave connection are created in one process. Slave transmits
+ * bursts of 32 packets writing only packet header, master receives them
+ * reading only packet header. Run once with buffers at power of two stride
+ * and once with buffer coloring, reports time and L1 data cache misses
+ * (if perf events are available) per packet.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <libmemif.h>
+
+#define APP_NAME "buffer_coloring"
+#define SOCKET_FILENAME "/tmp/memif_buffer_coloring.sock"
+
+#define BURST 32
+#define HEADER_SIZE 64
+#define LOG2_RING_SIZE 8
+#define ITERATIONS 200000
+
+static int connected;
+
+static int
+on_connect (memif_conn_handle_t conn, void *private_ctx)
+{
+  connected++;
+  return 0;
+}
+
+static int
+on_disconnect (memif_conn_handle_t conn, void *private_ctx)
+{
+  connected--;
+  return 0;
+}
+
+static int
+on_interrupt (memif_conn_handle_t conn, void *private_ctx, uint16_t qid)
+{
+  return 0;
+}
+
+/* count L1 data cache read misses of this thread, -1 if not available */
+static int
+perf_l1d_open ()
+{
+  struct perf_event_attr pe;
+
+  memset (&pe, 0, sizeof (pe));
+  pe.type = PERF_TYPE_HW_CACHE;
+  pe.size = sizeof (pe);
+  pe.config = PERF_COUNT_HW_CACHE_L1D |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  pe.disabled = 1;
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+
+  return syscall (__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static int
+run (uint8_t coloring)
+{
+  memif_conn_handle_t master = NULL, slave = NULL;
+  memif_conn_args_t args;
+  memif_buffer_t tx_bufs[BURST], rx_bufs[BURST];
+  struct timespec start, end;
+  uint64_t misses = 0, sum = 0, pkts = 0;
+  uint16_t n, rx;
+  int err, i, j, fd;
+  double ns;
+
+  memset (&args, 0, sizeof (args));
+  args.socket_filename = (uint8_t *) SOCKET_FILENAME;
+  args.num_s2m_rings = 1;
+  args.num_m2s_rings = 1;
+  args.log2_ring_size = LOG2_RING_SIZE;
+  args.buffer_size = 2048;
+
+  args.is_master = 1;
+  strncpy ((char *) args.interface_name, "master", 32);
+  if ((err = memif_create (&master, &args, on_connect, on_disconnect,
+			   on_interrupt, NULL)) != MEMIF_ERR_SUCCESS)
+    {
+      printf ("memif_create: %s\n", memif_strerror (err));
+      return -1;
+    }
+
+  /* slave allocates shared memory */
+  args.is_master = 0;
+  args.buffer_coloring = coloring;
+  strncpy ((char *) args.interface_name, "slave", 32);
+  if ((err = memif_create (&slave, &args, on_connect, on_disconnect,
+			   on_interrupt, NULL)) != MEMIF_ERR_SUCCESS)
+    {
+      printf ("memif_create: %s\n", memif_strerror (err));
+      return -1;
+    }
+
+  for (i = 0; (i < 50) && (connected < 2); i++)
+    memif_poll_event (100);
+  if (connected < 2)
+    {
+      printf ("connection failed\n");
+      return -1;
+    }
+
+  /* no interrupts, measure packet processing only */
+  memif_set_rx_mode (master, MEMIF_RX_MODE_POLLING, 0);
+
+  fd = perf_l1d_open ();
+  if (fd >= 0)
+    {
+      ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < ITERATIONS; i++)
+    {
+      memif_buffer_alloc (slave, 0, tx_bufs, BURST, &n, HEADER_SIZE);
+      for (j = 0; j < n; j++)
+	{
+	  memset (tx_bufs[j].data, j, HEADER_SIZE);
+	  tx_bufs[j].data_len = HEADER_SIZE;
+	}
+      memif_tx_burst (slave, 0, tx_bufs, n, &n);
+
+      memif_rx_burst (master, 0, rx_bufs, BURST, &rx);
+      for (j = 0; j < rx; j++)
+	sum += ((uint64_t *) rx_bufs[j].data)[0] +
+	  ((uint64_t *) rx_bufs[j].data)[7];
+      memif_buffer_free (master, 0, rx_bufs, rx, &rx);
+      pkts += rx;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if (fd >= 0)
+    {
+      ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read (fd, &misses, sizeof (misses)) != sizeof (misses))
+	misses = 0;
+      close (fd);
+    }
+
+  ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  printf ("%-10s %10.2f", coloring ? "colored" : "plain", ns / pkts);
+  if (fd >= 0)
+    printf (" %16.3f", (double) misses / pkts);
+  else
+    printf (" %16s", "n/a");
+  printf ("   (checksum %" PRIx64 ")\n", sum);
+
+  memif_delete (&slave);
+  for (i = 0; (i < 10) && connected; i++)
+    memif_poll_event (10);
+  memif_delete (&master);
+
+  return 0;
+}
+
+int
+main ()
+{
+  int err;
+
+  if ((err = memif_init (NULL, APP_NAME)) != MEMIF_ERR_SUCCESS)
+    {
+      printf ("memif_init: %s\n", memif_strerror (err));
+      return -1;
+    }
+
+  printf ("%d packets in bursts of %d, %d B header, ring size %d\n",
+	  ITERATIONS * BURST, BURST, HEADER_SIZE, 1 << LOG2_RING_SIZE);
+  printf ("%-10s %10s %16s\n", "layout", "ns/packet", "L1D misses/pkt");
+
+  if ((run (0) < 0) || (run (1) < 0))
+    return -1;
+
+  memif_cleanup ();
+  return 0;
+}
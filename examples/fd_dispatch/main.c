@@ -0,0 +1,256 @@
+/*
+ *------------------------------------------------------------------
+ * Copyright (c) 2017 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *------------------------------------------------------------------
+ */
+
+/*
+ * Event dispatch microbenchmark
+ *
+ * Masters are created in this process, slaves in forked child process which
+ * creates as many slaves as it reads from pipe. Number of interfaces grows
+ * in steps, after each step interrupt event of most recently connected
+ * master is dispatched by memif_control_fd_handler and time per event is
+ * reported. Cost should not depend on number of interfaces.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <libmemif.h>
+
+#define APP_NAME "fd_dispatch"
+#define SOCKET_FILENAME "/tmp/memif_fd_dispatch.sock"
+
+#define MAX_PAIRS 1024
+#define ITERATIONS 1000000
+
+static int epfd;
+static int connected;
+static int last_int_fd = -1;
+static uint64_t interrupts;
+
+static int
+on_connect (memif_conn_handle_t conn, void *private_ctx)
+{
+  connected++;
+  return 0;
+}
+
+static int
+on_disconnect (memif_conn_handle_t conn, void *private_ctx)
+{
+  connected--;
+  return 0;
+}
+
+static int
+on_interrupt (memif_conn_handle_t conn, void *private_ctx, uint16_t qid)
+{
+  interrupts++;
+  return 0;
+}
+
+/* application event polling, remembers last registered interrupt fd */
+static int
+control_fd_update (int fd, uint8_t events)
+{
+  struct epoll_event evt;
+
+  if (events & MEMIF_FD_EVENT_DEL)
+    return epoll_ctl (epfd, EPOLL_CTL_DEL, fd, NULL);
+
+  memset (&evt, 0, sizeof (evt));
+  evt.data.fd = fd;
+  if (events & MEMIF_FD_EVENT_READ)
+    evt.events |= EPOLLIN;
+  if (events & MEMIF_FD_EVENT_WRITE)
+    evt.events |= EPOLLOUT;
+
+  if (events & MEMIF_FD_EVENT_MOD)
+    return epoll_ctl (epfd, EPOLL_CTL_MOD, fd, &evt);
+
+  /* interrupt eventfds are registered for read only */
+  if (events == MEMIF_FD_EVENT_READ)
+    last_int_fd = fd;
+  return epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &evt);
+}
+
+static void
+poll_events (int timeout)
+{
+  struct epoll_event evt[64];
+  uint8_t events;
+  int i, n;
+
+  n = epoll_wait (epfd, evt, 64, timeout);
+  for (i = 0; i < n; i++)
+    {
+      events = 0;
+      if (evt[i].events & EPOLLIN)
+	events |= MEMIF_FD_EVENT_READ;
+      if (evt[i].events & EPOLLOUT)
+	events |= MEMIF_FD_EVENT_WRITE;
+      if (evt[i].events & EPOLLERR)
+	events |= MEMIF_FD_EVENT_ERROR;
+      memif_control_fd_handler (evt[i].data.fd, events);
+    }
+}
+
+static void
+init_args (memif_conn_args_t * args, uint8_t is_master, uint32_t id)
+{
+  memset (args, 0, sizeof (*args));
+  args->socket_filename = (uint8_t *) SOCKET_FILENAME;
+  args->interface_id = id;
+  args->is_master = is_master;
+  args->num_s2m_rings = 1;
+  args->num_m2s_rings = 1;
+  args->log2_ring_size = 4;
+  args->buffer_size = 128;
+  snprintf ((char *) args->interface_name, 32, "%s%u",
+	    is_master ? "master" : "slave", id);
+}
+
+/* child process, creates slaves up to number read from pipe */
+static int
+run_slaves (int pipe_fd)
+{
+  static memif_conn_handle_t slaves[MAX_PAIRS];
+  memif_conn_args_t args;
+  uint32_t n, count = 0;
+  ssize_t r;
+
+  if (memif_init (NULL, APP_NAME "_slave") != MEMIF_ERR_SUCCESS)
+    return -1;
+  fcntl (pipe_fd, F_SETFL, O_NONBLOCK);
+
+  while (1)
+    {
+      r = read (pipe_fd, &n, sizeof (n));
+      if (r == 0)
+	break;
+      for (; (r == sizeof (n)) && (count < n) && (count < MAX_PAIRS);
+	   count++)
+	{
+	  init_args (&args, 0, count);
+	  if (memif_create (&slaves[count], &args, on_connect, on_disconnect,
+			    on_interrupt, NULL) != MEMIF_ERR_SUCCESS)
+	    return -1;
+	}
+      memif_poll_events (100, 64, NULL);
+    }
+
+  while (count)
+    memif_delete (&slaves[--count]);
+  memif_cleanup ();
+  return 0;
+}
+
+int
+main ()
+{
+  static memif_conn_handle_t masters[MAX_PAIRS];
+  memif_conn_args_t args;
+  struct timespec start, end, deadline;
+  struct rlimit rl;
+  int err, i, pairs = 0, step, pipe_fd[2];
+  uint32_t n;
+  pid_t pid;
+  double ns;
+
+  /* every interface uses about 5 fds */
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0)
+    {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit (RLIMIT_NOFILE, &rl);
+    }
+
+  if (pipe (pipe_fd) < 0)
+    return -1;
+  if ((pid = fork ()) == 0)
+    {
+      close (pipe_fd[1]);
+      return run_slaves (pipe_fd[0]);
+    }
+  close (pipe_fd[0]);
+
+  epfd = epoll_create (1);
+  if ((err = memif_init (control_fd_update, APP_NAME)) != MEMIF_ERR_SUCCESS)
+    {
+      printf ("memif_init: %s\n", memif_strerror (err));
+      return -1;
+    }
+
+  printf ("%10s %14s\n", "interfaces", "ns/interrupt");
+
+  for (step = 1; step <= MAX_PAIRS; step *= 4)
+    {
+      for (; pairs < step; pairs++)
+	{
+	  init_args (&args, 1, pairs);
+	  if ((err = memif_create (&masters[pairs], &args, on_connect,
+				   on_disconnect, on_interrupt,
+				   NULL)) != MEMIF_ERR_SUCCESS)
+	    {
+	      printf ("memif_create: %s\n", memif_strerror (err));
+	      goto done;
+	    }
+	}
+      n = pairs;
+      if (write (pipe_fd[1], &n, sizeof (n)) != sizeof (n))
+	goto done;
+
+      clock_gettime (CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += 30;
+      while (connected < pairs)
+	{
+	  poll_events (100);
+	  clock_gettime (CLOCK_MONOTONIC, &end);
+	  if (end.tv_sec > deadline.tv_sec)
+	    {
+	      printf ("connection failed (%d of %d)\n", connected, pairs);
+	      goto done;
+	    }
+	}
+
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      for (i = 0; i < ITERATIONS; i++)
+	memif_control_fd_handler (last_int_fd, MEMIF_FD_EVENT_READ);
+      clock_gettime (CLOCK_MONOTONIC, &end);
+
+      ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+      printf ("%10d %14.2f\n", pairs, ns / ITERATIONS);
+    }
+
+done:
+  /* child deletes slaves on pipe close */
+  close (pipe_fd[1]);
+  for (i = 0; (i < 50) && connected; i++)
+    poll_events (10);
+  waitpid (pid, NULL, 0);
+  for (i = 0; i < pairs; i++)
+    memif_delete (&masters[i]);
+
+  memif_cleanup ();
+  return 0;
+}
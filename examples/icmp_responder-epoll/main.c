@@ -167,6 +167,13 @@ print_memif_details ()
 	  printf ("\t\tring size: %u\n", md.tx_queues[e].ring_size);
 	  printf ("\t\tbuffer size: %u\n", md.tx_queues[e].buffer_size);
 	}
+      printf ("\tregions:\n");
+      for (e = 0; e < md.regions_num; e++)
+	{
+	  printf ("\t\tregion index: %u\n", md.regions[e].index);
+	  printf ("\t\tsize: %lu\n", md.regions[e].size);
+	  printf ("\t\tpage size: %lu\n", 1UL << md.regions[e].log2_page_size);
+	}
       printf ("\tlink: ");
       if (md.link_up_down)
 	printf ("up\n");
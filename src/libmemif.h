@@ -26,6 +26,7 @@
 #define MEMIF_DEFAULT_APP_NAME "libmemif-app"
 
 #include <inttypes.h>
+#include <sys/uio.h>
 
 #include <memif.h>
 
@@ -89,6 +90,8 @@ typedef enum
 #define MEMIF_FD_EVENT_DEL   (1 << 3)
 /** update events */
 #define MEMIF_FD_EVENT_MOD   (1 << 4)
+/** maximum number of events received by single memif_poll_events call */
+#define MEMIF_MAX_POLL_EVENTS 256
 /** @} */
 
 /** *brief Memif connection handle
@@ -137,13 +140,58 @@ typedef int (memif_interrupt_t) (memif_conn_handle_t conn, void *private_ctx,
  * @{
  */
 
+/** Maximum number of buffer size classes. */
+#define MEMIF_MAX_BUFFER_CLASSES 4
+
+/** \brief Memif buffer size class
+    @param size - buffer size
+    @param share - percentage of ring slots backed by buffers of this size,
+      last class gets remaining slots
+*/
+typedef struct
+{
+  uint16_t size;
+  uint8_t share;
+} memif_buffer_class_t;
+
 /** \brief Memif connection arguments
     @param socket_filename - socket filename
     @param secret - otional parameter used as interface autenthication
     @param num_s2m_rings - number of slave to master rings
     @param num_m2s_rings - number of master to slave rings
     @param buffer_size - size of buffer in shared memory
-    @param log2_ring_size - logarithm base 2 of ring size
+    @param buffer_classes - optional buffer size classes (ascending size),
+      replace buffer_size, applies only to slave, which allocates shared memory,
+      memif_buffer_alloc picks smallest free buffer fitting requested size
+    @param headroom - bytes reserved in front of every buffer, transmitted data
+      can be moved up to headroom bytes backwards to prepend headers in place
+    @param tailroom - bytes reserved behind every buffer, data of single buffer
+      packets can exceed buffer_len by up to tailroom bytes to append trailers,
+      headroom and tailroom apply only to slave, which allocates shared memory,
+      peer is informed about them
+    @param buffer_coloring - pad buffer slots to odd number of cachelines, so
+      headers of consecutive buffers map to different cache sets (applies only
+      to slave, which allocates shared memory)
+    @param log2_ring_size - logarithm base 2 of ring size (max 24), rings
+      larger than 2^14 entries use 32-bit ring indices and are limited by
+      max_log2_ring_size advertised by peer
+    @param log2_page_size - logarithm base 2 of hugepage size backing shared memory
+      (21 = 2MB, 30 = 1GB), 0 = default page size, if hugepages are not available
+      default page size is used (see memif_region_details_t)
+    @param rx_poll_budget - number of consecutive empty polls after which queue
+      in MEMIF_RX_MODE_ADAPTIVE switches to interrupts
+    @param s2m_numa_node - optional array of num_s2m_rings NUMA nodes (-1 = any)
+    @param m2s_numa_node - optional array of num_m2s_rings NUMA nodes (-1 = any)
+      ring and buffers of each queue are placed on preferred node and faulted in,
+      applies only to slave, which allocates shared memory
+    @param prefault_regions - fault in whole shared memory during connection setup,
+      so pages are present before on_connect callback and data path
+      does not take page faults
+    @param lock_regions - lock shared memory in RAM (mlock), connection fails if
+      memory can not be locked (see RLIMIT_MEMLOCK)
+    @param keep_regions - keep shared memory, rings and interrupt eventfds across
+      disconnect and reuse them on reconnect if peer negotiates same layout,
+      applies only to slave, which allocates shared memory
     @param is_master - 0 == master, 1 == slave
     @param interface_id - id used to identify peer connection
     @param interface_name - interface name
@@ -158,7 +206,18 @@ typedef struct
   uint8_t num_s2m_rings;	/*!< default = 1 */
   uint8_t num_m2s_rings;	/*!< default = 1 */
   uint16_t buffer_size;		/*!< default = 2048 */
+  memif_buffer_class_t buffer_classes[MEMIF_MAX_BUFFER_CLASSES];	/*!< default = none */
+  uint16_t headroom;		/*!< default = 0 */
+  uint16_t tailroom;		/*!< default = 0 */
+  uint8_t buffer_coloring;	/*!< default = 0 */
   memif_log2_ring_size_t log2_ring_size;	/*!< default = 10 (1024) */
+  uint8_t log2_page_size;	/*!< default = 0 (no hugepages) */
+  uint32_t rx_poll_budget;	/*!< default = 1024 */
+  int16_t *s2m_numa_node;	/*!< default = NULL (no preference) */
+  int16_t *m2s_numa_node;	/*!< default = NULL (no preference) */
+  uint8_t prefault_regions;	/*!< default = 0 */
+  uint8_t lock_regions;		/*!< default = 0 */
+  uint8_t keep_regions;		/*!< default = 0 */
   uint8_t is_master;
 
   memif_interface_id_t interface_id;
@@ -171,9 +230,28 @@ typedef struct
 typedef enum
 {
   MEMIF_RX_MODE_INTERRUPT = 0,	/*!< interrupt mode */
-  MEMIF_RX_MODE_POLLING		/*!< polling mode */
+  MEMIF_RX_MODE_POLLING,	/*!< polling mode */
+  MEMIF_RX_MODE_ADAPTIVE	/*!< polling mode, interrupt mode when idle */
 } memif_rx_mode_t;
 
+/** \brief Memif transmit interrupt coalescing
+    @param max_packets - interrupt peer after this many packets (0 or 1 = every burst)
+    @param max_usecs - interrupt peer at latest this many microseconds after
+      first suppressed burst, required if max_packets > 1 or adaptive is set
+    @param ring_threshold - interrupt peer when ring occupancy reaches this
+      percentage of ring size (0 = disabled)
+    @param adaptive - tune packet limit (up to max_packets) from peer receive cadence,
+      limit grows while peer consumes packets without being interrupted and
+      shrinks when peer waits for interrupts
+*/
+typedef struct
+{
+  uint16_t max_packets;
+  uint32_t max_usecs;
+  uint8_t ring_threshold;
+  uint8_t adaptive;
+} memif_tx_coalesce_t;
+
 /** \brief Memif buffer
     @param desc_index - ring descriptor index
     @param buffer_len - shared meory buffer length
@@ -182,11 +260,26 @@ typedef enum
 */
 typedef struct
 {
-  uint16_t desc_index;
+  uint32_t desc_index;
   uint32_t buffer_len;
   uint32_t data_len;
   void *data;
 } memif_buffer_t;
+
+/** \brief Memif packet
+    @param desc_index - ring descriptor index of first segment
+    @param num_segs - number of segments (ring descriptors) packet occupies
+    @param data_len - packet length (sum of segment lengths)
+    @param segs - segments, iov_base points to shared memory buffer,
+      iov_len is segment data length
+*/
+typedef struct
+{
+  uint32_t desc_index;
+  uint16_t num_segs;
+  uint32_t data_len;
+  struct iovec *segs;
+} memif_packet_t;
 /** @} */
 
 /**
@@ -199,15 +292,40 @@ typedef struct
     @param qid - queue id
     @param ring_size - size of ring buffer in sharem memory
     @param buffer_size - buffer size on sharem memory
+    @param numa_node - NUMA node queue buffers are allocated on (-1 = unknown)
+    @param int_sent - number of interrupts sent to peer (tx queues)
+    @param int_suppressed - number of bursts sent without interrupt (tx queues)
+    @param headroom - bytes available in front of buffer data
+    @param tailroom - bytes available behind buffer
+    @param spare_buffers - free buffers of regions added by memif_region_add
+      (rx queues)
 */
 typedef struct
 {
   uint8_t qid;
   uint32_t ring_size;
   uint16_t buffer_size;
+  int16_t numa_node;
+  uint64_t int_sent;
+  uint64_t int_suppressed;
+  uint16_t headroom;
+  uint16_t tailroom;
+  uint32_t spare_buffers;
   /* add ring information */
 } memif_queue_details_t;
 
+/** \brief Memif region details
+    @param index - region index
+    @param size - region size
+    @param log2_page_size - logarithm base 2 of page size backing region
+*/
+typedef struct
+{
+  uint8_t index;
+  uint64_t size;
+  uint8_t log2_page_size;
+} memif_region_details_t;
+
 /** \brief Memif details
     @param if_name - interface name
     @param inst_name - application name
@@ -222,7 +340,14 @@ typedef struct
     @param tx_queues_num - number of transmit queues
     @param rx_queues - struct containing receive queue details
     @param tx_queues - struct containing transmit queue details
+    @param regions_num - number of shared memory regions
+    @param regions - struct containing region details
     @param link_up_down - 1 = up (connected), 2 = down (disconnected)
+    @param shm_reused - 1 = shared memory of previous connection was reused
+    @param setup_usecs - duration of last connection setup in microseconds
+      (from hello/init message to connected)
+    @param prefault_usecs - part of setup_usecs spent faulting in and locking
+      shared memory
 */
 typedef struct
 {
@@ -240,9 +365,44 @@ typedef struct
   uint8_t tx_queues_num;
   memif_queue_details_t *rx_queues;
   memif_queue_details_t *tx_queues;
+  uint16_t regions_num;
+  memif_region_details_t *regions;
 
   uint8_t link_up_down;		/* 1 = up, 0 = down */
+  uint8_t shm_reused;
+  uint32_t setup_usecs;
+  uint32_t prefault_usecs;
 } memif_details_t;
+
+/** \brief Memif library statistics
+    @param poll_calls - number of epoll_pwait calls made by memif_poll_event
+      and memif_poll_events
+    @param poll_events - number of events returned by these calls,
+      poll_events / poll_calls is average number of events per syscall
+    @param poll_max_events - largest number of events returned by single call
+    @param connect_calls - number of connect attempts made by slaves
+    @param connect_errors - number of failed connect attempts
+    @param connect_syscalls - number of syscalls made to schedule and make
+      connect attempts (timerfd, socket, connect, fcntl, close)
+    @param connects - number of successful connect attempts
+    @param connect_wait_usecs - total time slaves spent disconnected before
+      successful connect attempt, connect_wait_usecs / connects is average
+      reconnect latency
+    @param connect_max_wait_usecs - longest time single slave spent
+      disconnected before successful connect attempt
+*/
+typedef struct
+{
+  uint64_t poll_calls;
+  uint64_t poll_events;
+  uint32_t poll_max_events;
+  uint64_t connect_calls;
+  uint64_t connect_errors;
+  uint64_t connect_syscalls;
+  uint64_t connects;
+  uint64_t connect_wait_usecs;
+  uint32_t connect_max_wait_usecs;
+} memif_stats_t;
 /** @} */
 
 /**
@@ -266,11 +426,67 @@ int memif_get_queue_efd (memif_conn_handle_t conn, uint16_t qid, int *fd);
     @param rx_mode - receive mode
     @param qid - queue id
 
+    In MEMIF_RX_MODE_ADAPTIVE queue starts in polling mode (peer doesn't
+    interrupt). After rx_poll_budget consecutive empty memif_rx_burst calls
+    interrupts are unmasked, first received packet masks them again.
+    Use memif_rx_wait to sleep while interrupts are unmasked.
+
     \return memif_err_t
 */
 int memif_set_rx_mode (memif_conn_handle_t conn, memif_rx_mode_t rx_mode,
 		       uint16_t qid);
 
+/** \brief Memif wait for packets
+    @param conn - memif connection handle
+    @param qid - queue id
+    @param timeout - timeout in milliseconds, -1 = infinite
+
+    Returns immediately if packets are pending or queue is in polling mode,
+    otherwise blocks on queue interrupt. Intended for MEMIF_RX_MODE_ADAPTIVE:
+    call memif_rx_burst in loop and memif_rx_wait when it returns no packets.
+
+    \return memif_err_t
+*/
+int memif_rx_wait (memif_conn_handle_t conn, uint16_t qid, int timeout);
+
+/** \brief Memif set transmit interrupt coalescing
+    @param conn - memif connection handle
+    @param qid - transmit queue id
+    @param cfg - coalescing configuration
+
+    Configures when memif_tx_burst interrupts peer. If max_usecs is set,
+    timer file descriptor is passed to user with memif_control_fd_update_t,
+    events on this fd are handled by memif_control_fd_handler, which may run
+    on other thread than memif_tx_burst. Configuration is reset on disconnect.
+
+    \return memif_err_t
+*/
+int memif_set_tx_coalesce (memif_conn_handle_t conn, uint16_t qid,
+			   memif_tx_coalesce_t * cfg);
+
+/** \brief Memif add region to connected interface
+    @param conn - memif connection handle (slave)
+    @param qid - receive queue id
+    @param num_buffers - number of buffers in new region
+
+    Grows buffer capacity without reconnect. New shared memory region is
+    sent to master, once master acknowledges it, its buffers are spares
+    of receive queue. While application holds more than half of ring slots,
+    memif_rx_burst exchanges ring buffers of oldest held packets for spare
+    buffers and releases their ring slots, so master can keep transmitting
+    into spare buffers. Held buffers stay valid, they can be freed by
+    memif_buffer_free, but not forwarded. When all spare buffers are back
+    and pressure drops, memory of unused regions is returned to kernel
+    (mapping stays and is faulted in again on demand).
+    Queue has to be received with memif_rx_burst (not memif_rx_burst_pkt).
+    Not available with buffer size classes, headroom or tailroom, or
+    if master does not support multiple regions (MEMIF_ERR_MAXREG).
+
+    \return memif_err_t
+*/
+int memif_region_add (memif_conn_handle_t conn, uint16_t qid,
+		      uint32_t num_buffers);
+
 /** \brief Memif strerror
     @param err_code - error code
 
@@ -301,7 +517,7 @@ int memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
     user application, all file descriptors and event types will be passed in
     this callback to user application
 
-    Initialize internal libmemif structures. Create timerfd (used to periodically request connection by
+    Initialize internal libmemif structures. Create timerfd (used to request connection by
     disconnected memifs in slave mode, with no additional API call). This fd is passed to user with memif_control_fd_update_t
     timer is inactive at this state. It activates with if there is at least one memif in slave mode.
 
@@ -329,8 +545,10 @@ int memif_cleanup ();
     Creates memory interface.
      
     SLAVE-MODE - 
-        Start timer that will send events to timerfd. If this fd is passed to memif_control_fd_handler
-        every disconnected memif in slave mode will send connection request.
+        Schedule connection request and arm timerfd for it. If this fd is passed to memif_control_fd_handler
+        every disconnected memif in slave mode which is due will send connection request.
+        Failed request is retried after random delay, which doubles with every attempt
+        (from 16 ms up to about 4 s) and starts over once connected.
         On success new fd is passed to user with memif_control_fd_update_t.
 
     MASTER-MODE - 
@@ -355,7 +573,7 @@ int memif_create (memif_conn_handle_t * conn, memif_conn_args_t * args,
  
     FD-TYPE - 
         TIMERFD - 
-            Every disconnected memif in slave mode will request connection.
+            Every disconnected memif in slave mode due for connection request will request connection.
         LISTENER or CONTROL - 
             Handle socket messaging (internal connection establishment).
         INTERRUPT - 
@@ -391,6 +609,22 @@ int memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
 			memif_buffer_t * bufs, uint16_t count,
 			uint16_t * count_out, uint16_t size);
 
+/** \brief Memif single buffer alloc
+    @param conn - memif conenction handle
+    @param qid - number indentifying queue
+    @param bufs - memif buffers
+    @param count - number of memif buffers to allocate
+    @param count_out - returns number of allocated buffers
+
+    Allocates one ring buffer per memif buffer (no chaining). Same as
+    memif_buffer_alloc with size 0, without per descriptor size checks.
+
+    \return memif_err_t
+*/
+int memif_buffer_alloc_single (memif_conn_handle_t conn, uint16_t qid,
+			       memif_buffer_t * bufs, uint16_t count,
+			       uint16_t * count_out);
+
 /** \brief Memif buffer free
     @param conn - memif conenction handle
     @param qid - number indentifying queue
@@ -398,6 +632,9 @@ int memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
     @param count - number of memif buffers to free
     @param count_out - returns number of freed buffers
 
+    Buffers can be freed in any order. Ring slots are returned to peer
+    once all buffers received before them are freed.
+
     \return memif_err_t
 */
 int memif_buffer_free (memif_conn_handle_t conn, uint16_t qid,
@@ -411,11 +648,34 @@ int memif_buffer_free (memif_conn_handle_t conn, uint16_t qid,
     @param count - number of memif buffers to transmit
     @param tx - returns number of transmitted buffers
 
+    If queue has headroom (see memif_queue_details_t), data pointer of buffer
+    can be moved up to headroom bytes backwards to prepend headers, data_len
+    of single buffer packet can exceed buffer_len by up to tailroom bytes.
+
     \return memif_err_t
 */
 int memif_tx_burst (memif_conn_handle_t conn, uint16_t qid,
 		    memif_buffer_t * bufs, uint16_t count, uint16_t * tx);
 
+/** \brief Memif transmit burst with copy
+    @param conn - memif conenction handle
+    @param qid - number indentifying queue
+    @param pkts - packets in application memory, one iovec per packet
+    @param count - number of packets to transmit
+    @param tx - returns number of transmitted packets
+
+    Allocates ring slots, copies packets to shared memory and transmits
+    them in single call. Packets larger than buffer size are chained.
+    Large packets are copied with non-temporal stores, bypassing cache.
+    Transmit queue must have no buffers allocated by memif_buffer_alloc
+    pending.
+
+    \return memif_err_t
+*/
+int memif_tx_burst_copy (memif_conn_handle_t conn, uint16_t qid,
+			 const struct iovec *pkts, uint16_t count,
+			 uint16_t * tx);
+
 /** \brief Memif receive buffer burst
     @param conn - memif conenction handle
     @param qid - number indentifying queue
@@ -423,11 +683,109 @@ int memif_tx_burst (memif_conn_handle_t conn, uint16_t qid,
     @param count - number of memif buffers to receive
     @param rx - returns number of received buffers
 
+    Chained packet is returned as single buffer pointing to first segment,
+    use memif_rx_burst_pkt to access segments of chained packets.
+
     \return memif_err_t
 */
 int memif_rx_burst (memif_conn_handle_t conn, uint16_t qid,
 		    memif_buffer_t * bufs, uint16_t count, uint16_t * rx);
 
+/** \brief Memif forward buffer burst (zero-copy)
+    @param conn - memif conenction handle
+    @param rx_qid - number indentifying receive queue
+    @param tx_qid - number indentifying transmit queue
+    @param bufs - memif buffers received by memif_rx_burst on rx_qid
+    @param count - number of memif buffers to forward
+    @param fwd - returns number of forwarded buffers
+
+    Transmits received buffers without copying packet data. Descriptors of
+    received buffers are handed over to transmit ring and receive ring is
+    refilled with free buffers taken from transmit ring. Forwarded buffers
+    are released from receive queue, there is no need to call memif_buffer_free.
+    Transmit queue must have no buffers allocated by memif_buffer_alloc
+    pending.
+
+    Descriptors can only point to shared memory both peers have mapped, so
+    rx and tx queue have to belong to the same connection.
+
+    Data pointer and data_len of received buffers can be changed within
+    headroom and tailroom of rx queue (e.g. to push encapsulation header),
+    descriptors are transmitted accordingly.
+
+    \return memif_err_t
+*/
+int memif_forward_burst (memif_conn_handle_t conn, uint16_t rx_qid,
+			 uint16_t tx_qid, memif_buffer_t * bufs,
+			 uint16_t count, uint16_t * fwd);
+
+/** \brief Memif packet alloc
+    @param conn - memif conenction handle
+    @param qid - number indentifying queue
+    @param pkts - memif packets
+    @param count - number of packets to allocate
+    @param segs - segment array shared by allocated packets
+    @param max_segs - size of segment array
+    @param count_out - returns number of allocated packets
+    @param size - packet size, packet is chained across as many ring
+      descriptors as needed, 0 = single buffer
+
+    Segment iov_len is set to buffer length. Application writes packet data
+    to segments and sets iov_len of each segment to data length before
+    calling memif_tx_burst_pkt.
+
+    \return memif_err_t
+*/
+int memif_packet_alloc (memif_conn_handle_t conn, uint16_t qid,
+			memif_packet_t * pkts, uint16_t count,
+			struct iovec *segs, uint16_t max_segs,
+			uint16_t * count_out, uint32_t size);
+
+/** \brief Memif transmit packet burst
+    @param conn - memif conenction handle
+    @param qid - number indentifying queue
+    @param pkts - memif packets allocated by memif_packet_alloc
+    @param count - number of packets to transmit
+    @param tx - returns number of transmitted packets
+
+    \return memif_err_t
+*/
+int memif_tx_burst_pkt (memif_conn_handle_t conn, uint16_t qid,
+			memif_packet_t * pkts, uint16_t count, uint16_t * tx);
+
+/** \brief Memif receive packet burst
+    @param conn - memif conenction handle
+    @param qid - number indentifying queue
+    @param pkts - memif packets
+    @param count - number of packets to receive
+    @param segs - segment array shared by received packets
+    @param max_segs - size of segment array
+    @param rx_pkts - returns number of received packets
+    @param rx_segs - returns number of received segments (ring descriptors)
+
+    Only whole packets are received, each packet points to its segments
+    in segs array.
+
+    \return memif_err_t
+*/
+int memif_rx_burst_pkt (memif_conn_handle_t conn, uint16_t qid,
+			memif_packet_t * pkts, uint16_t count,
+			struct iovec *segs, uint16_t max_segs,
+			uint16_t * rx_pkts, uint16_t * rx_segs);
+
+/** \brief Memif packet free
+    @param conn - memif conenction handle
+    @param qid - number indentifying queue
+    @param pkts - memif packets received by memif_rx_burst_pkt
+    @param count - number of packets to free
+    @param count_out - returns number of freed packets
+
+    \return memif_err_t
+*/
+int memif_packet_free (memif_conn_handle_t conn, uint16_t qid,
+		       memif_packet_t * pkts, uint16_t count,
+		       uint16_t * count_out);
+
 /** \brief Memif poll event
     @param timeout - timeout in seconds
 
@@ -438,6 +796,28 @@ int memif_rx_burst (memif_conn_handle_t conn, uint16_t qid,
     \return memif_err_t
 */
 int memif_poll_event (int timeout);
+
+/** \brief Memif poll events
+    @param timeout - timeout in milliseconds
+    @param max_events - maximum number of events received by single syscall
+      (at most MEMIF_MAX_POLL_EVENTS)
+    @param num_events - returns number of dispatched events (optional)
+
+    Batched variant of memif_poll_event. All events received by one
+    epoll_pwait call are dispatched before return, if handling of some event
+    fails remaining events are still handled and first error is returned.
+
+    \return memif_err_t
+*/
+int memif_poll_events (int timeout, uint16_t max_events,
+		       uint16_t * num_events);
+
+/** \brief Memif get statistics
+    @param stats - returns library statistics
+
+    \return memif_err_t
+*/
+int memif_get_stats (memif_stats_t * stats);
 /** @} */
 
 #endif /* _LIBMEMIF_H_ */
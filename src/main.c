@@ -43,7 +43,11 @@
 #include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* memif protocol msg, ring and descriptor definitions */
 #include <memif.h>
@@ -351,6 +355,51 @@ get_list_elt (memif_list_elt_t ** e, memif_list_elt_t * list, uint16_t len,
   return -1;
 }
 
+int
+memif_fd_table_set (int fd, uint8_t type, uint16_t qid, void *data_struct)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  memif_fd_entry_t *tmp;
+  uint32_t len;
+
+  /* invalid fd has no events to dispatch, same as in memif_fd_table_get */
+  if (fd < 0)
+    return 0;
+
+  if ((uint32_t) fd >= lm->fd_table_len)
+    {
+      len = (lm->fd_table_len) ? lm->fd_table_len : 64;
+      while (len <= (uint32_t) fd)
+	len *= 2;
+      tmp = realloc (lm->fd_table, sizeof (memif_fd_entry_t) * len);
+      if (tmp == NULL)
+	return -1;
+      memset (&tmp[lm->fd_table_len], 0,
+	      sizeof (memif_fd_entry_t) * (len - lm->fd_table_len));
+      lm->fd_table = tmp;
+      lm->fd_table_len = len;
+    }
+
+  lm->fd_table[fd].type = type;
+  lm->fd_table[fd].qid = qid;
+  lm->fd_table[fd].data_struct = data_struct;
+  lm->fd_table[fd].gen++;
+  return 0;
+}
+
+void
+memif_fd_table_del (int fd)
+{
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((fd < 0) || ((uint32_t) fd >= lm->fd_table_len))
+    return;
+  lm->fd_table[fd].type = MEMIF_FD_TYPE_NONE;
+  lm->fd_table[fd].qid = 0;
+  lm->fd_table[fd].data_struct = NULL;
+  lm->fd_table[fd].gen++;
+}
+
 /* does not free memory, only marks element as free */
 int
 free_list_elt (memif_list_elt_t * list, uint16_t len, int key)
@@ -389,6 +438,107 @@ free_list_elt_ctx (memif_list_elt_t * list, uint16_t len,
   return -1;
 }
 
+static uint32_t
+memif_socket_hash (uint32_t id, uint32_t size)
+{
+  id *= 0x9e3779b1;
+  return (id ^ (id >> 16)) & (size - 1);
+}
+
+int
+memif_socket_interface_add (memif_socket_t * ms, memif_connection_t * c)
+{
+  memif_list_elt_t *tmp;
+  uint32_t i, j, size;
+
+  /* keep hash at most half full, so probe sequences stay short */
+  if ((uint32_t) (ms->use_count + 1) * 2 > ms->interface_hash_size)
+    {
+      size = (ms->interface_hash_size) ? ms->interface_hash_size * 2 : 16;
+      tmp = calloc (size, sizeof (memif_list_elt_t));
+      if (tmp == NULL)
+	return MEMIF_ERR_NOMEM;
+      for (i = 0; i < ms->interface_hash_size; i++)
+	{
+	  if (ms->interface_hash[i].data_struct == NULL)
+	    continue;
+	  j = memif_socket_hash (ms->interface_hash[i].key, size);
+	  while (tmp[j].data_struct != NULL)
+	    j = (j + 1) & (size - 1);
+	  tmp[j] = ms->interface_hash[i];
+	}
+      free (ms->interface_hash);
+      ms->interface_hash = tmp;
+      ms->interface_hash_size = size;
+    }
+
+  size = ms->interface_hash_size;
+  i = memif_socket_hash (c->args.interface_id, size);
+  while (ms->interface_hash[i].data_struct != NULL)
+    i = (i + 1) & (size - 1);
+  ms->interface_hash[i].key = c->args.interface_id;
+  ms->interface_hash[i].data_struct = c;
+  ms->use_count++;
+
+  return MEMIF_ERR_SUCCESS;
+}
+
+void
+memif_socket_interface_del (memif_socket_t * ms, memif_connection_t * c)
+{
+  memif_list_elt_t *hash = ms->interface_hash;
+  uint32_t i, j, h, size = ms->interface_hash_size;
+
+  if (size == 0)
+    return;
+
+  i = memif_socket_hash (c->args.interface_id, size);
+  while (hash[i].data_struct != c)
+    {
+      if (hash[i].data_struct == NULL)
+	return;
+      i = (i + 1) & (size - 1);
+    }
+
+  /* move following entries of probe sequence into the gap, unless
+     their home slot lies between the gap and their position */
+  j = i;
+  while (1)
+    {
+      j = (j + 1) & (size - 1);
+      if (hash[j].data_struct == NULL)
+	break;
+      h = memif_socket_hash (hash[j].key, size);
+      if ((i < j) ? ((h <= i) || (h > j)) : ((h <= i) && (h > j)))
+	{
+	  hash[i] = hash[j];
+	  i = j;
+	}
+    }
+  hash[i].key = -1;
+  hash[i].data_struct = NULL;
+  ms->use_count--;
+}
+
+memif_connection_t *
+memif_socket_interface_get (memif_socket_t * ms, uint32_t id)
+{
+  memif_list_elt_t *hash = ms->interface_hash;
+  uint32_t i, size = ms->interface_hash_size;
+
+  if (size == 0)
+    return NULL;
+
+  i = memif_socket_hash (id, size);
+  while (hash[i].data_struct != NULL)
+    {
+      if ((uint32_t) hash[i].key == id)
+	return (memif_connection_t *) hash[i].data_struct;
+      i = (i + 1) & (size - 1);
+    }
+  return NULL;
+}
+
 static void
 memif_control_fd_update_register (memif_control_fd_update_t * cb)
 {
@@ -426,12 +576,9 @@ memif_init (memif_control_fd_update_t * on_control_fd_update, char *app_name)
       DBG ("libmemif event polling initialized");
     }
 
-  memset (&lm->ms, 0, sizeof (memif_socket_t));
-
   lm->control_list_len = 2;
   lm->interrupt_list_len = 2;
   lm->listener_list_len = 1;
-  lm->pending_list_len = 1;
 
   lm->control_list =
     malloc (sizeof (memif_list_elt_t) * lm->control_list_len);
@@ -439,8 +586,6 @@ memif_init (memif_control_fd_update_t * on_control_fd_update, char *app_name)
     malloc (sizeof (memif_list_elt_t) * lm->interrupt_list_len);
   lm->listener_list =
     malloc (sizeof (memif_list_elt_t) * lm->listener_list_len);
-  lm->pending_list =
-    malloc (sizeof (memif_list_elt_t) * lm->pending_list_len);
 
   int i;
   for (i = 0; i < lm->control_list_len; i++)
@@ -458,15 +603,21 @@ memif_init (memif_control_fd_update_t * on_control_fd_update, char *app_name)
       lm->listener_list[i].key = -1;
       lm->listener_list[i].data_struct = NULL;
     }
-  for (i = 0; i < lm->pending_list_len; i++)
-    {
-      lm->pending_list[i].key = -1;
-      lm->pending_list[i].data_struct = NULL;
-    }
 
-  lm->disconn_slaves = 0;
+  free (lm->connect_heap);
+  lm->connect_heap = NULL;
+  lm->connect_heap_len = lm->connect_heap_size = 0;
+  lm->timer_usecs = 0;
+  lm->rand_seed = getpid () ^ time (NULL);
 
-  lm->timerfd = timerfd_create (CLOCK_REALTIME, TFD_NONBLOCK);
+  free (lm->fd_table);
+  lm->fd_table = NULL;
+  lm->fd_table_len = 0;
+
+  sigemptyset (&lm->poll_sigmask);
+  memset (&lm->stats, 0, sizeof (lm->stats));
+
+  lm->timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
   if (lm->timerfd < 0)
     {
       err = errno;
@@ -474,12 +625,6 @@ memif_init (memif_control_fd_update_t * on_control_fd_update, char *app_name)
       return memif_syscall_error_handler (err);
     }
 
-  lm->arm.it_value.tv_sec = 2;
-  lm->arm.it_value.tv_nsec = 0;
-  lm->arm.it_interval.tv_sec = 2;
-  lm->arm.it_interval.tv_nsec = 0;
-  memset (&lm->disarm, 0, sizeof (lm->disarm));
-
   if (lm->control_fd_update (lm->timerfd, MEMIF_FD_EVENT_READ) < 0)
     {
       DBG ("callback type memif_control_fd_update_t error!");
@@ -489,17 +634,35 @@ memif_init (memif_control_fd_update_t * on_control_fd_update, char *app_name)
   return 0;
 }
 
-static inline memif_ring_t *
+/* rings are page aligned if they are placed on NUMA nodes,
+   so that each ring can be bound to its node */
+static inline memif_region_size_t
+memif_get_ring_stride (memif_connection_t * conn)
+{
+  memif_region_size_t ring_size =
+    memif_ring_bytes (conn->run_args.log2_ring_size);
+  memif_region_size_t page_size;
+
+  if ((conn->args.s2m_numa_node == NULL) &&
+      (conn->args.m2s_numa_node == NULL))
+    return ring_size;
+
+  page_size = (conn->args.log2_page_size) ?
+    (1ULL << conn->args.log2_page_size) :
+    (memif_region_size_t) sysconf (_SC_PAGESIZE);
+  return (ring_size + page_size - 1) & ~(page_size - 1);
+}
+
+static_fn memif_ring_t *
 memif_get_ring (memif_connection_t * conn, memif_ring_type_t type,
 		uint16_t ring_num)
 {
   if (&conn->regions[0] == NULL)
     return NULL;
   void *p = conn->regions[0].shm;
-  int ring_size =
-    sizeof (memif_ring_t) +
-    sizeof (memif_desc_t) * (1 << conn->run_args.log2_ring_size);
-  p += (ring_num + type * conn->run_args.num_s2m_rings) * ring_size;
+  p += (memif_region_size_t) (ring_num +
+			       type * conn->run_args.num_s2m_rings) *
+    memif_get_ring_stride (conn);
 
   return (memif_ring_t *) p;
 }
@@ -516,825 +679,2544 @@ memif_set_rx_mode (memif_conn_handle_t c, memif_rx_mode_t rx_mode,
     num_m2s_rings;
   if (qid >= num)
     return MEMIF_ERR_QID;
-
-  conn->rx_queues[qid].ring->flags = rx_mode;
-  DBG ("rx_mode flag: %u", conn->rx_queues[qid].ring->flags);
+  if (rx_mode > MEMIF_RX_MODE_ADAPTIVE)
+    return MEMIF_ERR_INVAL_ARG;
+
+  memif_queue_t *mq = &conn->rx_queues[qid];
+  mq->rx_mode = rx_mode;
+  mq->empty_polls = 0;
+  /* adaptive mode starts polling */
+  mq->ring->flags = (rx_mode == MEMIF_RX_MODE_INTERRUPT) ? 0 :
+    MEMIF_RING_FLAG_MASK_INT;
+  DBG ("rx_mode flag: %u", mq->ring->flags);
   return MEMIF_ERR_SUCCESS;
 }
 
-int
-memif_create (memif_conn_handle_t * c, memif_conn_args_t * args,
-	      memif_connection_update_t * on_connect,
-	      memif_connection_update_t * on_disconnect,
-	      memif_interrupt_t * on_interrupt, void *private_ctx)
+/* adaptive rx mode, called on empty poll, once poll budget is exhausted
+   unmask interrupts, returns 1 if packets arrived meanwhile */
+static int
+memif_rx_adaptive_idle (memif_connection_t * c, memif_queue_t * mq)
 {
-  int err, i, index, sockfd = -1;
-  memif_list_elt_t list_elt;
-  memif_connection_t *conn = (memif_connection_t *) * c;
-  if (conn != NULL)
-    {
-      DBG ("This handle already points to existing memif.");
-      return MEMIF_ERR_CONN;
-    }
-  conn = (memif_connection_t *) malloc (sizeof (memif_connection_t));
-  if (conn == NULL)
+  memif_ring_t *ring = mq->ring;
+
+  /* interrupts already unmasked */
+  if ((ring->flags & MEMIF_RING_FLAG_MASK_INT) == 0)
+    return 0;
+  if (++mq->empty_polls < c->args.rx_poll_budget)
+    return 0;
+
+  ring->flags &= ~MEMIF_RING_FLAG_MASK_INT;
+  /* pairs with barrier in memif_tx_interrupt, peer either sees interrupts
+     unmasked or we see head it stored before reading flags */
+  MEMIF_MEORY_BARRIER ();
+  mq->cached_head = memif_ring_head (mq);
+  if (mq->cached_head == mq->last_head)
     {
-      err = memif_syscall_error_handler (errno);
-      goto error;
+      DBG ("qid %u idle, interrupts unmasked", (int) (mq - c->rx_queues));
+      return 0;
     }
-  memset (conn, 0, sizeof (memif_connection_t));
 
-  libmemif_main_t *lm = &libmemif_main;
+  /* packets arrived while unmasking, keep polling */
+  ring->flags |= MEMIF_RING_FLAG_MASK_INT;
+  mq->empty_polls = 0;
+  return 1;
+}
 
-  conn->args.interface_id = args->interface_id;
+int
+memif_rx_wait (memif_conn_handle_t conn, uint16_t qid, int timeout)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_s2m_rings : c->run_args.
+    num_m2s_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  memif_queue_t *mq = &c->rx_queues[qid];
+  struct pollfd pfd;
 
-  if (args->log2_ring_size == 0)
-    args->log2_ring_size = MEMIF_DEFAULT_LOG2_RING_SIZE;
-  if (args->buffer_size == 0)
-    args->buffer_size = MEMIF_DEFAULT_BUFFER_SIZE;
-  if (args->num_s2m_rings == 0)
-    args->num_s2m_rings = MEMIF_DEFAULT_TX_QUEUES;
-  if (args->num_m2s_rings == 0)
-    args->num_m2s_rings = MEMIF_DEFAULT_RX_QUEUES;
+  if ((mq->ring->flags & MEMIF_RING_FLAG_MASK_INT) ||
+      (memif_ring_head (mq) != mq->last_head))
+    return MEMIF_ERR_SUCCESS;
 
-  conn->args.num_s2m_rings = args->num_s2m_rings;
-  conn->args.num_m2s_rings = args->num_m2s_rings;
-  conn->args.buffer_size = args->buffer_size;
-  conn->args.log2_ring_size = args->log2_ring_size;
-  conn->args.is_master = args->is_master;
-  conn->args.mode = args->mode;
-  conn->msg_queue = NULL;
-  conn->regions = NULL;
-  conn->tx_queues = NULL;
-  conn->rx_queues = NULL;
-  conn->fd = -1;
-  conn->on_connect = on_connect;
-  conn->on_disconnect = on_disconnect;
-  conn->on_interrupt = on_interrupt;
-  conn->private_ctx = private_ctx;
-  memset (&conn->run_args, 0, sizeof (memif_conn_run_args_t));
+  /* interrupt is consumed by memif_rx_burst */
+  pfd.fd = mq->int_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if ((poll (&pfd, 1, timeout) < 0) && (errno != EINTR))
+    return memif_syscall_error_handler (errno);
 
-  uint8_t l = strlen ((char *) args->interface_name);
-  strncpy ((char *) conn->args.interface_name, (char *) args->interface_name,
-	   l);
+  return MEMIF_ERR_SUCCESS;
+}
 
-  l = strlen ((char *) args->instance_name);
-  strncpy ((char *) conn->args.instance_name, (char *) args->instance_name,
-	   l);
+/* write peer interrupt, called from transmit path and coalescing timer */
+static int
+memif_tx_int_write (memif_queue_t * mq)
+{
+  uint64_t a = 1;
 
-  /* allocate and initialize socket_filename so it can be copyed to sun_path
-     without memory leaks */
-  conn->args.socket_filename = malloc (sizeof (char *) * 108);
-  memset (conn->args.socket_filename, 0, 108 * sizeof (char *));
+  if (write (mq->int_fd, &a, sizeof (a)) < 0)
+    return MEMIF_ERR_INT_WRITE;
 
-  if (args->socket_filename)
-    {
-      if (conn->args.socket_filename == NULL)
-	{
-	  err = memif_syscall_error_handler (errno);
-	  goto error;
-	}
-      strncpy ((char *) conn->args.socket_filename,
-	       (char *) args->socket_filename,
-	       strlen ((char *) args->socket_filename));
-    }
-  else
-    {
-      uint16_t sdl = strlen (MEMIF_DEFAULT_SOCKET_DIR);
-      uint16_t sfl = strlen (MEMIF_DEFAULT_SOCKET_FILENAME);
-      if (conn->args.socket_filename == NULL)
-	{
-	  err = memif_syscall_error_handler (errno);
-	  goto error;
-	}
-      strncpy ((char *) conn->args.socket_filename,
-	       MEMIF_DEFAULT_SOCKET_DIR, sdl);
-      conn->args.socket_filename[sdl] = '/';
-      strncpy ((char *) (conn->args.socket_filename + 1 + sdl),
-	       MEMIF_DEFAULT_SOCKET_FILENAME, sfl);
-    }
+  __atomic_add_fetch (&mq->int_sent, 1, __ATOMIC_RELAXED);
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
 
-  if (args->secret)
+/* interrupt peer, in adaptive mode adjust packet limit
+   based on how peer consumed packets since last interrupt.
+   Packet limit is only accessed from transmit path. */
+static int
+memif_tx_signal (memif_queue_t * mq)
+{
+  uint32_t tail, max;
+
+  __atomic_store_n (&mq->int_pending, 0, __ATOMIC_SEQ_CST);
+
+  if (mq->coalesce.adaptive)
     {
-      l = strlen ((char *) args->secret);
-      strncpy ((char *) conn->args.secret, (char *) args->secret, l);
+      max = (mq->coalesce.max_packets) ? mq->coalesce.max_packets :
+	(1 << mq->log2_ring_size) / 2;
+      tail = memif_ring_tail (mq);
+      if (tail == mq->int_last_head)
+	/* peer consumed exactly up to last interrupt and waits for next one */
+	mq->int_batch = (mq->int_batch > 1) ? mq->int_batch / 2 : 1;
+      else
+	/* peer receives without being interrupted or is busy */
+	mq->int_batch = memif_min (mq->int_batch * 2, max);
+      mq->int_last_head = mq->last_head;
     }
 
-  if (conn->args.is_master)
+  return memif_tx_int_write (mq);
+}
+
+/* interrupt peer after packets were transmitted, unless coalesced */
+static int
+memif_tx_interrupt (memif_queue_t * mq, uint16_t packets)
+{
+  uint32_t ring_size = (1 << mq->log2_ring_size);
+  uint32_t occupancy, pending;
+  uint8_t armed = 0;
+  struct itimerspec its;
+
+  /* order head store before flags load, pairs with barrier in
+     memif_rx_adaptive_idle so wakeup can't be lost */
+  MEMIF_MEORY_BARRIER ();
+  if (mq->ring->flags & MEMIF_RING_FLAG_MASK_INT)
+    return MEMIF_ERR_SUCCESS;
+
+  /* coalescing timer runs on control thread, pending count and timer
+     state are shared with memif_tx_coalesce_timeout */
+  pending = __atomic_add_fetch (&mq->int_pending, packets, __ATOMIC_SEQ_CST);
+  if (pending < mq->int_batch)
     {
-      conn->run_args.buffer_size = conn->args.buffer_size;
-      memif_socket_t *ms;
-      memif_list_elt_t elt;
-      for (i = 0; i < lm->listener_list_len; i++)
+      /* cached tail is used, so occupancy may be overestimated */
+      occupancy = (mq->last_head - mq->last_tail) & (ring_size - 1);
+      if ((mq->coalesce.ring_threshold == 0) ||
+	  (occupancy * 100 < mq->coalesce.ring_threshold * ring_size))
 	{
-	  if ((ms =
-	       (memif_socket_t *) lm->listener_list[i].data_struct) != NULL)
-	    {
-	      if (strncmp
-		  ((char *) ms->filename, (char *) conn->args.socket_filename,
-		   strlen ((char *) ms->filename)) == 0)
-		{
-		  /* add interface to listener socket */
-		  elt.key = conn->args.interface_id;
-		  *c = elt.data_struct = conn;
-		  add_list_elt (&elt, &ms->interface_list,
-				&ms->interface_list_len);
-		  ms->use_count++;
-		  conn->listener_fd = ms->fd;
-		  break;
-		}
-	    }
-	  else
+	  mq->int_suppressed++;
+	  /* timer is marked armed before it is set, so expiry handled
+	     meanwhile can't leave it marked armed */
+	  if ((mq->int_timer_fd > 0) &&
+	      __atomic_compare_exchange_n (&mq->int_timer_armed, &armed, 1, 0,
+					   __ATOMIC_SEQ_CST,
+					   __ATOMIC_SEQ_CST))
 	    {
-	      struct stat file_stat;
-	      if (stat ((char *) conn->args.socket_filename, &file_stat) == 0)
-		{
-		  if (S_ISSOCK (file_stat.st_mode))
-		    unlink ((char *) conn->args.socket_filename);
-		  else
-		    return memif_syscall_error_handler (errno);
-		}
-	      DBG ("creating socket file");
-	      ms = malloc (sizeof (memif_socket_t));
-	      ms->filename =
-		malloc (strlen ((char *) conn->args.socket_filename) +
-			sizeof (char));
-	      memset (ms->filename, 0,
-		      strlen ((char *) conn->args.socket_filename) +
-		      sizeof (char));
-	      strncpy ((char *) ms->filename,
-		       (char *) conn->args.socket_filename,
-		       strlen ((char *) conn->args.socket_filename));
-	      ms->interface_list_len = 1;
-	      ms->interface_list =
-		malloc (sizeof (memif_list_elt_t) * ms->interface_list_len);
-	      ms->interface_list[0].key = -1;
-	      ms->interface_list[0].data_struct = NULL;
-	      struct sockaddr_un un = { 0 };
-	      int on = 1;
-
-	      ms->fd = socket (AF_UNIX, SOCK_SEQPACKET, 0);
-	      if (ms->fd < 0)
-		{
-		  err = memif_syscall_error_handler (errno);
-		  goto error;
-		}
-	      DBG ("socket %d created", ms->fd);
-	      un.sun_family = AF_UNIX;
-	      strncpy ((char *) un.sun_path, (char *) ms->filename,
-		       sizeof (un.sun_path) - 1);
-	      DBG ("sockopt");
-	      if (setsockopt
-		  (ms->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof (on)) < 0)
-		{
-		  err = memif_syscall_error_handler (errno);
-		  goto error;
-		}
-	      DBG ("bind");
-	      if (bind (ms->fd, (struct sockaddr *) &un, sizeof (un)) < 0)
+	      memset (&its, 0, sizeof (its));
+	      its.it_value.tv_sec = mq->coalesce.max_usecs / 1000000;
+	      its.it_value.tv_nsec =
+		(mq->coalesce.max_usecs % 1000000) * 1000;
+	      if (timerfd_settime (mq->int_timer_fd, 0, &its, NULL) < 0)
 		{
-		  err = memif_syscall_error_handler (errno);
-		  goto error;
+		  __atomic_store_n (&mq->int_timer_armed, 0, __ATOMIC_SEQ_CST);
+		  return memif_syscall_error_handler (errno);
 		}
-	      DBG ("listen");
-	      if (listen (ms->fd, 1) < 0)
-		{
-		  err = memif_syscall_error_handler (errno);
-		  goto error;
-		}
-	      DBG ("stat");
-	      if (stat ((char *) ms->filename, &file_stat) < 0)
-		{
-		  err = memif_syscall_error_handler (errno);
-		  goto error;
-		}
-
-	      /* add interface to listener socket */
-	      elt.key = conn->args.interface_id;
-	      *c = elt.data_struct = conn;
-	      add_list_elt (&elt, &ms->interface_list,
-			    &ms->interface_list_len);
-	      ms->use_count = 1;
-	      conn->listener_fd = ms->fd;
-
-	      /* add listener socket to libmemif main */
-	      elt.key = ms->fd;
-	      elt.data_struct = ms;
-	      add_list_elt (&elt, &lm->listener_list, &lm->listener_list_len);
-	      lm->control_fd_update (ms->fd, MEMIF_FD_EVENT_READ);
-	      break;
 	    }
+	  return MEMIF_ERR_SUCCESS;
 	}
     }
-  else
-    {
-      if (lm->disconn_slaves == 0)
-	{
-	  if (timerfd_settime (lm->timerfd, 0, &lm->arm, NULL) < 0)
-	    {
-	      err = memif_syscall_error_handler (errno);
-	      goto error;
-	    }
-	}
-
-      lm->disconn_slaves++;
 
-      list_elt.key = -1;
-      *c = list_elt.data_struct = conn;
-      if ((index =
-	   add_list_elt (&list_elt, &lm->control_list,
-			 &lm->control_list_len)) < 0)
-	{
-	  err = MEMIF_ERR_NOMEM;
-	  goto error;
-	}
-    }
+  return memif_tx_signal (mq);
+}
 
-  conn->index = index;
+/* coalescing timer expired, interrupt peer if there are packets pending */
+static int
+memif_tx_coalesce_timeout (memif_connection_t * c, memif_queue_t * mq)
+{
+  uint64_t b;
+  ssize_t r = read (mq->int_timer_fd, &b, sizeof (b));
+  if ((r == -1) && (errno != EAGAIN))
+    return memif_syscall_error_handler (errno);
 
-  return 0;
+  /* disarm before taking pending packets, transmit path either sees timer
+     disarmed and arms it again, or its packets are signaled here */
+  __atomic_store_n (&mq->int_timer_armed, 0, __ATOMIC_SEQ_CST);
+  if ((c->fd < 0) || (mq->ring->flags & MEMIF_RING_FLAG_MASK_INT))
+    return MEMIF_ERR_SUCCESS;
+  if (__atomic_exchange_n (&mq->int_pending, 0, __ATOMIC_SEQ_CST) == 0)
+    return MEMIF_ERR_SUCCESS;
 
-error:
-  if (sockfd > 0)
-    close (sockfd);
-  sockfd = -1;
-  if (conn->args.socket_filename)
-    free (conn->args.socket_filename);
-  if (conn != NULL)
-    free (conn);
-  *c = conn = NULL;
-  return err;
+  return memif_tx_int_write (mq);
 }
 
 int
-memif_control_fd_handler (int fd, uint8_t events)
+memif_set_tx_coalesce (memif_conn_handle_t conn, uint16_t qid,
+		       memif_tx_coalesce_t * cfg)
 {
-  int i, rv, sockfd = -1, err = MEMIF_ERR_SUCCESS;	/* 0 */
-  uint16_t num;
-  memif_list_elt_t *e = NULL;
-  memif_connection_t *conn;
+  memif_connection_t *c = (memif_connection_t *) conn;
+  libmemif_main_t *lm = &libmemif_main;
+  memif_list_elt_t e;
+  memif_queue_t *mq;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
+    num_s2m_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  if ((cfg == NULL) || (cfg->ring_threshold > 100))
+    return MEMIF_ERR_INVAL_ARG;
+  /* suppressed packets need time limit, otherwise tail of burst
+     never interrupts peer */
+  if (((cfg->max_packets > 1) || cfg->adaptive) && (cfg->max_usecs == 0))
+    return MEMIF_ERR_INVAL_ARG;
+  mq = &c->tx_queues[qid];
+
+  if ((cfg->max_usecs > 0) && (mq->int_timer_fd < 0))
+    {
+      if ((mq->int_timer_fd =
+	   timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+	return memif_syscall_error_handler (errno);
+      /* timer events are dispatched same way as interrupts */
+      if (memif_fd_table_set (mq->int_timer_fd, MEMIF_FD_TYPE_INT_TIMER,
+			      qid, c) < 0)
+	{
+	  close (mq->int_timer_fd);
+	  mq->int_timer_fd = -1;
+	  return MEMIF_ERR_NOMEM;
+	}
+      e.key = mq->int_timer_fd;
+      e.data_struct = c;
+      add_list_elt (&e, &lm->interrupt_list, &lm->interrupt_list_len);
+      lm->control_fd_update (mq->int_timer_fd, MEMIF_FD_EVENT_READ);
+    }
+  else if ((cfg->max_usecs == 0) && (mq->int_timer_fd > 0))
+    {
+      lm->control_fd_update (mq->int_timer_fd, MEMIF_FD_EVENT_DEL);
+      free_list_elt (lm->interrupt_list, lm->interrupt_list_len,
+		     mq->int_timer_fd);
+      memif_fd_table_del (mq->int_timer_fd);
+      close (mq->int_timer_fd);
+      mq->int_timer_fd = -1;
+    }
+
+  mq->coalesce = *cfg;
+  mq->int_batch = (cfg->adaptive) ? 1 : cfg->max_packets;
+  mq->int_last_head = mq->last_head;
+  mq->int_timer_armed = 0;
+  DBG ("tx queue %u coalescing: packets %u, usecs %u, threshold %u%%%s", qid,
+       cfg->max_packets, cfg->max_usecs, cfg->ring_threshold,
+       (cfg->adaptive) ? ", adaptive" : "");
+
+  /* don't leave packets sent under previous configuration unsignaled */
+  if (__atomic_load_n (&mq->int_pending, __ATOMIC_SEQ_CST) &&
+      !(mq->ring->flags & MEMIF_RING_FLAG_MASK_INT))
+    return memif_tx_signal (mq);
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+static void
+memif_connect_heap_swap (uint32_t a, uint32_t b)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  memif_connection_t *tmp = lm->connect_heap[a];
+
+  lm->connect_heap[a] = lm->connect_heap[b];
+  lm->connect_heap[b] = tmp;
+  lm->connect_heap[a]->connect_heap_index = a + 1;
+  lm->connect_heap[b]->connect_heap_index = b + 1;
+}
+
+/* restore heap order after connect time of element i changed */
+static void
+memif_connect_heap_fix (uint32_t i)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  memif_connection_t **heap = lm->connect_heap;
+  uint32_t m, l;
+
+  while ((i > 0) &&
+	 (heap[(i - 1) / 2]->connect_at_usecs > heap[i]->connect_at_usecs))
+    {
+      memif_connect_heap_swap (i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  while ((l = 2 * i + 1) < lm->connect_heap_len)
+    {
+      m = l;
+      if ((l + 1 < lm->connect_heap_len) &&
+	  (heap[l + 1]->connect_at_usecs < heap[l]->connect_at_usecs))
+	m = l + 1;
+      if (heap[i]->connect_at_usecs <= heap[m]->connect_at_usecs)
+	break;
+      memif_connect_heap_swap (i, m);
+      i = m;
+    }
+}
+
+static int
+memif_connect_heap_add (memif_connection_t * c)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  memif_connection_t **tmp;
+  uint32_t size;
+
+  if (c->connect_heap_index != 0)
+    {
+      memif_connect_heap_fix (c->connect_heap_index - 1);
+      return MEMIF_ERR_SUCCESS;
+    }
+
+  if (lm->connect_heap_len == lm->connect_heap_size)
+    {
+      size = (lm->connect_heap_size) ? lm->connect_heap_size * 2 : 16;
+      tmp = realloc (lm->connect_heap, sizeof (memif_connection_t *) * size);
+      if (tmp == NULL)
+	return MEMIF_ERR_NOMEM;
+      lm->connect_heap = tmp;
+      lm->connect_heap_size = size;
+    }
+
+  lm->connect_heap[lm->connect_heap_len] = c;
+  c->connect_heap_index = ++lm->connect_heap_len;
+  memif_connect_heap_fix (lm->connect_heap_len - 1);
+  return MEMIF_ERR_SUCCESS;
+}
+
+static void
+memif_connect_heap_del (memif_connection_t * c)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  uint32_t i = c->connect_heap_index - 1;
+
+  /* heap is dropped by memif_init */
+  if ((c->connect_heap_index == 0) || (i >= lm->connect_heap_len) ||
+      (lm->connect_heap[i] != c))
+    {
+      c->connect_heap_index = 0;
+      return;
+    }
+
+  c->connect_heap_index = 0;
+  lm->connect_heap_len--;
+  if (i < lm->connect_heap_len)
+    {
+      lm->connect_heap[i] = lm->connect_heap[lm->connect_heap_len];
+      lm->connect_heap[i]->connect_heap_index = i + 1;
+      memif_connect_heap_fix (i);
+    }
+}
+
+/* arm timerfd for earliest connect attempt, disarm it if there is none */
+static int
+memif_connect_timer_update ()
+{
+  libmemif_main_t *lm = &libmemif_main;
+  struct itimerspec its;
+  uint64_t at = 0;
+
+  if (lm->connect_heap_len > 0)
+    at = lm->connect_heap[0]->connect_at_usecs;
+  if (at == lm->timer_usecs)
+    return MEMIF_ERR_SUCCESS;
+
+  memset (&its, 0, sizeof (its));
+  its.it_value.tv_sec = at / 1000000;
+  its.it_value.tv_nsec = (at % 1000000) * 1000;
+  lm->stats.connect_syscalls++;
+  if (timerfd_settime (lm->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    return memif_syscall_error_handler (errno);
+  lm->timer_usecs = at;
+
+  return MEMIF_ERR_SUCCESS;
+}
+
+/* set time of next connect attempt, random delay from <backoff / 2,
+   backoff> spreads out attempts of slaves disconnected at the same time */
+static int
+memif_connect_backoff (memif_connection_t * c)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  uint32_t delay;
+
+  delay = c->connect_backoff_msec / 2;
+  delay += rand_r (&lm->rand_seed) % (c->connect_backoff_msec - delay + 1);
+  c->connect_at_usecs = memif_time_usecs () + (uint64_t) delay * 1000;
+
+  c->connect_backoff_msec *= 2;
+  if (c->connect_backoff_msec > MEMIF_CONNECT_BACKOFF_MAX_MSEC)
+    c->connect_backoff_msec = MEMIF_CONNECT_BACKOFF_MAX_MSEC;
+
+  return memif_connect_heap_add (c);
+}
+
+static int
+memif_connect_schedule (memif_connection_t * c)
+{
+  int err;
+
+  if ((err = memif_connect_backoff (c)) != MEMIF_ERR_SUCCESS)
+    return err;
+  return memif_connect_timer_update ();
+}
+
+static int
+memif_connect_cancel (memif_connection_t * c)
+{
+  memif_connect_heap_del (c);
+  return memif_connect_timer_update ();
+}
+
+/* connect slave to master socket, socket is non-blocking while connecting,
+   so full backlog of master can not block event loop */
+static int
+memif_connect_slave (memif_connection_t * c)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  struct sockaddr_un sun;
+  uint64_t wait;
+  int sockfd, err;
+
+  lm->stats.connect_syscalls++;
+  sockfd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (sockfd < 0)
+    return memif_syscall_error_handler (errno);
+
+  sun.sun_family = AF_UNIX;
+  strncpy (sun.sun_path, (char *) c->args.socket_filename,
+	   sizeof (sun.sun_path) - 1);
+
+  lm->stats.connect_calls++;
+  lm->stats.connect_syscalls++;
+  if (connect (sockfd, (struct sockaddr *) &sun,
+	       sizeof (struct sockaddr_un)) < 0)
+    {
+      err = memif_syscall_error_handler (errno);
+      lm->stats.connect_errors++;
+      lm->stats.connect_syscalls++;
+      close (sockfd);
+      return err;
+    }
+
+  /* control messages are exchanged on blocking socket */
+  lm->stats.connect_syscalls++;
+  if (fcntl (sockfd, F_SETFL, 0) < 0)
+    {
+      err = memif_syscall_error_handler (errno);
+      close (sockfd);
+      return err;
+    }
+
+  if (memif_fd_table_set (sockfd, MEMIF_FD_TYPE_CONTROL, 0, c) < 0)
+    {
+      close (sockfd);
+      return MEMIF_ERR_NOMEM;
+    }
+
+  c->fd = sockfd;
+  c->read_fn = memif_conn_fd_read_ready;
+  c->write_fn = memif_conn_fd_write_ready;
+  c->error_fn = memif_conn_fd_error;
+
+  lm->control_list[c->index].key = c->fd;
+
+  lm->control_fd_update (sockfd, MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_WRITE);
+
+  wait = memif_time_usecs () - c->disconnect_usecs;
+  lm->stats.connects++;
+  lm->stats.connect_wait_usecs += wait;
+  if (wait > lm->stats.connect_max_wait_usecs)
+    lm->stats.connect_max_wait_usecs = wait;
+  c->disconnect_usecs = 0;
+
+  return MEMIF_ERR_SUCCESS;
+}
+
+/* create listener socket and add it to libmemif main */
+static int
+memif_socket_create (uint8_t * filename, memif_socket_t ** msp)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  struct sockaddr_un un = { 0 };
+  struct stat file_stat;
+  memif_list_elt_t elt;
+  memif_socket_t *ms;
+  int on = 1, err;
+
+  if (stat ((char *) filename, &file_stat) == 0)
+    {
+      if (S_ISSOCK (file_stat.st_mode))
+	unlink ((char *) filename);
+      else
+	return MEMIF_ERR_FILE_NOT_SOCK;
+    }
+
+  ms = calloc (1, sizeof (memif_socket_t));
+  if (ms == NULL)
+    return MEMIF_ERR_NOMEM;
+  ms->filename = (uint8_t *) strdup ((char *) filename);
+  if (ms->filename == NULL)
+    {
+      free (ms);
+      return MEMIF_ERR_NOMEM;
+    }
+
+  /* non-blocking, so that accept can drain backlog in batches */
+  ms->fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (ms->fd < 0)
+    {
+      err = memif_syscall_error_handler (errno);
+      goto error;
+    }
+  DBG ("socket %d created", ms->fd);
+  un.sun_family = AF_UNIX;
+  strncpy ((char *) un.sun_path, (char *) ms->filename,
+	   sizeof (un.sun_path) - 1);
+  DBG ("sockopt");
+  if (setsockopt (ms->fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof (on)) < 0)
+    {
+      err = memif_syscall_error_handler (errno);
+      goto error;
+    }
+  DBG ("bind");
+  if (bind (ms->fd, (struct sockaddr *) &un, sizeof (un)) < 0)
+    {
+      err = memif_syscall_error_handler (errno);
+      goto error;
+    }
+  DBG ("listen");
+  if (listen (ms->fd, SOMAXCONN) < 0)
+    {
+      err = memif_syscall_error_handler (errno);
+      goto error;
+    }
+  DBG ("stat");
+  if (stat ((char *) ms->filename, &file_stat) < 0)
+    {
+      err = memif_syscall_error_handler (errno);
+      goto error;
+    }
+
+  /* add listener socket to libmemif main */
+  elt.key = ms->fd;
+  elt.data_struct = ms;
+  if (add_list_elt (&elt, &lm->listener_list, &lm->listener_list_len) < 0)
+    {
+      err = MEMIF_ERR_NOMEM;
+      goto error;
+    }
+  if (memif_fd_table_set (ms->fd, MEMIF_FD_TYPE_LISTENER, 0, ms) < 0)
+    {
+      free_list_elt (lm->listener_list, lm->listener_list_len, ms->fd);
+      err = MEMIF_ERR_NOMEM;
+      goto error;
+    }
+  lm->control_fd_update (ms->fd, MEMIF_FD_EVENT_READ);
+
+  *msp = ms;
+  return MEMIF_ERR_SUCCESS;
+
+error:
+  if (ms->fd >= 0)
+    close (ms->fd);
+  free (ms->filename);
+  free (ms);
+  return err;
+}
+
+/* close listener socket, called when last interface is removed */
+static void
+memif_socket_delete (memif_socket_t * ms)
+{
+  libmemif_main_t *lm = &libmemif_main;
+
+  lm->control_fd_update (ms->fd, MEMIF_FD_EVENT_DEL);
+  free_list_elt (lm->listener_list, lm->listener_list_len, ms->fd);
+  memif_fd_table_del (ms->fd);
+  close (ms->fd);
+  free (ms->interface_hash);
+  free (ms->filename);
+  free (ms);
+}
+
+static int memif_shm_size_valid (memif_connection_t * conn);
+
+int
+memif_create (memif_conn_handle_t * c, memif_conn_args_t * args,
+	      memif_connection_update_t * on_connect,
+	      memif_connection_update_t * on_disconnect,
+	      memif_interrupt_t * on_interrupt, void *private_ctx)
+{
+  int err, i, index, sockfd = -1;
+  memif_list_elt_t list_elt;
+  memif_connection_t *conn = (memif_connection_t *) * c;
+  if (conn != NULL)
+    {
+      DBG ("This handle already points to existing memif.");
+      return MEMIF_ERR_CONN;
+    }
+  conn = (memif_connection_t *) malloc (sizeof (memif_connection_t));
+  if (conn == NULL)
+    {
+      err = memif_syscall_error_handler (errno);
+      goto error;
+    }
+  memset (conn, 0, sizeof (memif_connection_t));
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  conn->args.interface_id = args->interface_id;
+
+  if (args->log2_ring_size == 0)
+    args->log2_ring_size = MEMIF_DEFAULT_LOG2_RING_SIZE;
+  if (args->buffer_size == 0)
+    args->buffer_size = MEMIF_DEFAULT_BUFFER_SIZE;
+  if (args->num_s2m_rings == 0)
+    args->num_s2m_rings = MEMIF_DEFAULT_TX_QUEUES;
+  if (args->num_m2s_rings == 0)
+    args->num_m2s_rings = MEMIF_DEFAULT_RX_QUEUES;
+
+  conn->args.num_s2m_rings = args->num_s2m_rings;
+  conn->args.num_m2s_rings = args->num_m2s_rings;
+  conn->args.buffer_size = args->buffer_size;
+  uint16_t share = 0, size = 0;
+  for (i = 0; i < MEMIF_MAX_BUFFER_CLASSES; i++)
+    {
+      if (args->buffer_classes[i].size == 0)
+	continue;
+      if (args->buffer_classes[i].size <= size)
+	{
+	  DBG ("buffer classes not in ascending order");
+	  err = MEMIF_ERR_INVAL_ARG;
+	  goto error;
+	}
+      size = args->buffer_classes[i].size;
+      share += args->buffer_classes[i].share;
+    }
+  if (share > 100)
+    {
+      err = MEMIF_ERR_INVAL_ARG;
+      goto error;
+    }
+  memcpy (conn->args.buffer_classes, args->buffer_classes,
+	  sizeof (conn->args.buffer_classes));
+  conn->args.buffer_coloring = args->buffer_coloring;
+  conn->args.headroom = args->headroom;
+  conn->args.tailroom = args->tailroom;
+  conn->args.log2_ring_size = args->log2_ring_size;
+  conn->args.log2_page_size = args->log2_page_size;
+  conn->args.rx_poll_budget = (args->rx_poll_budget) ?
+    args->rx_poll_budget : MEMIF_DEFAULT_RX_POLL_BUDGET;
+  conn->args.prefault_regions = args->prefault_regions;
+  conn->args.lock_regions = args->lock_regions;
+  conn->args.keep_regions = args->keep_regions;
+  conn->args.is_master = args->is_master;
+  conn->args.mode = args->mode;
+  conn->msg_queue = NULL;
+  conn->regions = NULL;
+  conn->regions_num = 0;
+  conn->tx_queues = NULL;
+  conn->rx_queues = NULL;
+  conn->fd = -1;
+  conn->on_connect = on_connect;
+  conn->on_disconnect = on_disconnect;
+  conn->on_interrupt = on_interrupt;
+  conn->private_ctx = private_ctx;
+  memset (&conn->run_args, 0, sizeof (memif_conn_run_args_t));
+
+  uint8_t l = strlen ((char *) args->interface_name);
+  strncpy ((char *) conn->args.interface_name, (char *) args->interface_name,
+	   l);
+
+  l = strlen ((char *) args->instance_name);
+  strncpy ((char *) conn->args.instance_name, (char *) args->instance_name,
+	   l);
+
+  /* allocate and initialize socket_filename so it can be copyed to sun_path
+     without memory leaks */
+  conn->args.socket_filename = malloc (sizeof (char *) * 108);
+  memset (conn->args.socket_filename, 0, 108 * sizeof (char *));
+
+  if (args->socket_filename)
+    {
+      if (conn->args.socket_filename == NULL)
+	{
+	  err = memif_syscall_error_handler (errno);
+	  goto error;
+	}
+      strncpy ((char *) conn->args.socket_filename,
+	       (char *) args->socket_filename,
+	       strlen ((char *) args->socket_filename));
+    }
+  else
+    {
+      uint16_t sdl = strlen (MEMIF_DEFAULT_SOCKET_DIR);
+      uint16_t sfl = strlen (MEMIF_DEFAULT_SOCKET_FILENAME);
+      if (conn->args.socket_filename == NULL)
+	{
+	  err = memif_syscall_error_handler (errno);
+	  goto error;
+	}
+      strncpy ((char *) conn->args.socket_filename,
+	       MEMIF_DEFAULT_SOCKET_DIR, sdl);
+      conn->args.socket_filename[sdl] = '/';
+      strncpy ((char *) (conn->args.socket_filename + 1 + sdl),
+	       MEMIF_DEFAULT_SOCKET_FILENAME, sfl);
+    }
+
+  if (args->secret)
+    {
+      l = strlen ((char *) args->secret);
+      strncpy ((char *) conn->args.secret, (char *) args->secret, l);
+    }
+
+  if (args->s2m_numa_node)
+    {
+      if ((conn->args.s2m_numa_node =
+	   malloc (sizeof (int16_t) * conn->args.num_s2m_rings)) == NULL)
+	{
+	  err = memif_syscall_error_handler (errno);
+	  goto error;
+	}
+      memcpy (conn->args.s2m_numa_node, args->s2m_numa_node,
+	      sizeof (int16_t) * conn->args.num_s2m_rings);
+    }
+  if (args->m2s_numa_node)
+    {
+      if ((conn->args.m2s_numa_node =
+	   malloc (sizeof (int16_t) * conn->args.num_m2s_rings)) == NULL)
+	{
+	  err = memif_syscall_error_handler (errno);
+	  goto error;
+	}
+      memcpy (conn->args.m2s_numa_node, args->m2s_numa_node,
+	      sizeof (int16_t) * conn->args.num_m2s_rings);
+    }
+
+  /* peer can only negotiate smaller rings, check the largest layout */
+  conn->run_args.num_s2m_rings = conn->args.num_s2m_rings;
+  conn->run_args.num_m2s_rings = conn->args.num_m2s_rings;
+  conn->run_args.log2_ring_size = conn->args.log2_ring_size;
+  conn->run_args.buffer_size = conn->args.buffer_size;
+  if (!memif_shm_size_valid (conn))
+    {
+      DBG ("shared memory size overflows");
+      err = MEMIF_ERR_MAXRING;
+      goto error;
+    }
+  memset (&conn->run_args, 0, sizeof (memif_conn_run_args_t));
+
+  if (conn->args.is_master)
+    {
+      conn->run_args.buffer_size = conn->args.buffer_size;
+      memif_socket_t *ms = NULL;
+      for (i = 0; i < lm->listener_list_len; i++)
+	{
+	  ms = (memif_socket_t *) lm->listener_list[i].data_struct;
+	  if ((ms != NULL) && (strcmp ((char *) ms->filename,
+				       (char *) conn->args.socket_filename) ==
+			       0))
+	    break;
+	  ms = NULL;
+	}
+      if (ms == NULL)
+	{
+	  DBG ("creating socket file");
+	  if ((err = memif_socket_create (conn->args.socket_filename, &ms))
+	      != MEMIF_ERR_SUCCESS)
+	    goto error;
+	}
+
+      /* add interface to listener socket */
+      if ((err = memif_socket_interface_add (ms, conn)) != MEMIF_ERR_SUCCESS)
+	{
+	  if (ms->use_count == 0)
+	    memif_socket_delete (ms);
+	  goto error;
+	}
+      conn->listener_fd = ms->fd;
+      *c = conn;
+    }
+  else
+    {
+      conn->connect_backoff_msec = MEMIF_CONNECT_BACKOFF_MIN_MSEC;
+      conn->disconnect_usecs = memif_time_usecs ();
+      if ((err = memif_connect_schedule (conn)) != MEMIF_ERR_SUCCESS)
+	{
+	  memif_connect_cancel (conn);
+	  goto error;
+	}
+
+      list_elt.key = -1;
+      *c = list_elt.data_struct = conn;
+      if ((index =
+	   add_list_elt (&list_elt, &lm->control_list,
+			 &lm->control_list_len)) < 0)
+	{
+	  memif_connect_cancel (conn);
+	  err = MEMIF_ERR_NOMEM;
+	  goto error;
+	}
+    }
+
+  conn->index = index;
+
+  return 0;
+
+error:
+  if (sockfd > 0)
+    close (sockfd);
+  sockfd = -1;
+  if (conn->args.socket_filename)
+    free (conn->args.socket_filename);
+  if (conn->args.s2m_numa_node)
+    free (conn->args.s2m_numa_node);
+  if (conn->args.m2s_numa_node)
+    free (conn->args.m2s_numa_node);
+  if (conn != NULL)
+    free (conn);
+  *c = conn = NULL;
+  return err;
+}
+
+int
+memif_control_fd_handler (int fd, uint8_t events)
+{
+  int err = MEMIF_ERR_SUCCESS;	/* 0 */
+  memif_fd_entry_t *e = NULL;
+  memif_connection_t *conn;
   libmemif_main_t *lm = &libmemif_main;
   if (fd == lm->timerfd)
     {
-      uint64_t b;
-      ssize_t size;
-      size = read (fd, &b, sizeof (b));
-      for (i = 0; i < lm->control_list_len; i++)
+      uint64_t b, now;
+      ssize_t size;
+      size = read (fd, &b, sizeof (b));
+      lm->stats.connect_syscalls++;
+      lm->timer_usecs = 0;
+      now = memif_time_usecs ();
+      /* only slaves due for connect attempt are touched, failed attempt
+         is rescheduled with longer delay, slave stays in heap until it
+         connects, so rescheduling only reorders heap and can't fail */
+      while ((lm->connect_heap_len > 0) &&
+	     (lm->connect_heap[0]->connect_at_usecs <= now))
+	{
+	  conn = lm->connect_heap[0];
+	  if (memif_connect_slave (conn) == MEMIF_ERR_SUCCESS)
+	    memif_connect_heap_del (conn);
+	  else
+	    memif_connect_backoff (conn);
+	}
+      return memif_connect_timer_update ();
+    }
+  else
+    {
+      e = memif_fd_table_get (fd);
+      if (e == NULL)
+	return MEMIF_ERR_SUCCESS;
+
+      switch (e->type)
+	{
+	case MEMIF_FD_TYPE_INT_TIMER:
+	  conn = (memif_connection_t *) e->data_struct;
+	  return memif_tx_coalesce_timeout (conn, &conn->tx_queues[e->qid]);
+
+	case MEMIF_FD_TYPE_INTERRUPT:
+	  conn = (memif_connection_t *) e->data_struct;
+	  if (conn->on_interrupt != NULL)
+	    conn->on_interrupt ((void *) conn, conn->private_ctx, e->qid);
+	  return MEMIF_ERR_SUCCESS;
+
+	case MEMIF_FD_TYPE_LISTENER:
+	  memif_conn_fd_accept_ready ((memif_socket_t *) e->data_struct);
+	  return MEMIF_ERR_SUCCESS;
+
+	case MEMIF_FD_TYPE_PENDING:
+	  /* hello is already sent, wait for init message */
+	  if (events & MEMIF_FD_EVENT_READ)
+	    memif_read_ready (fd);
+	  return MEMIF_ERR_SUCCESS;
+
+	case MEMIF_FD_TYPE_CONTROL:
+	  conn = (memif_connection_t *) e->data_struct;
+	  if (events & MEMIF_FD_EVENT_READ)
+	    {
+	      err = conn->read_fn (conn);
+	      if (err != MEMIF_ERR_SUCCESS)
+		return err;
+	    }
+	  /* read handler may have disconnected or deleted connection */
+	  if (((e = memif_fd_table_get (fd)) == NULL) ||
+	      (e->data_struct != conn))
+	    return MEMIF_ERR_SUCCESS;
+	  if (events & MEMIF_FD_EVENT_WRITE)
+	    {
+	      err = conn->write_fn (conn);
+	      if (err != MEMIF_ERR_SUCCESS)
+		return err;
+	    }
+	  if (events & MEMIF_FD_EVENT_ERROR)
+	    {
+	      err = conn->error_fn (conn);
+	      if (err != MEMIF_ERR_SUCCESS)
+		return err;
+	    }
+	  break;
+	}
+    }
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+int
+memif_poll_events (int timeout, uint16_t max_events, uint16_t * num_events)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  struct epoll_event evt[MEMIF_MAX_POLL_EVENTS];
+  uint32_t gen[MEMIF_MAX_POLL_EVENTS];
+  int en = 0, err = MEMIF_ERR_SUCCESS, rv, i;	/* 0 */
+  uint32_t events;
+
+  if (num_events)
+    *num_events = 0;
+  if (max_events == 0)
+    return MEMIF_ERR_INVAL_ARG;
+  if (max_events > MEMIF_MAX_POLL_EVENTS)
+    max_events = MEMIF_MAX_POLL_EVENTS;
+
+  en = epoll_pwait (memif_epfd, evt, max_events, timeout, &lm->poll_sigmask);
+  if (en < 0)
+    {
+      DBG ("epoll_pwait: %s", strerror (errno));
+      return -1;
+    }
+
+  lm->stats.poll_calls++;
+  lm->stats.poll_events += en;
+  if ((uint32_t) en > lm->stats.poll_max_events)
+    lm->stats.poll_max_events = en;
+
+  /* handler of one event can close fd of later event in batch and its
+     number can be reused by new fd, such events are stale and skipped,
+     events of new fd are reported by next epoll_pwait */
+  for (i = 0; i < en; i++)
+    gen[i] = memif_fd_table_gen (evt[i].data.fd);
+
+  for (i = 0; i < en; i++)
+    {
+      if (memif_fd_table_gen (evt[i].data.fd) != gen[i])
+	{
+	  DBG ("fd %d: stale event skipped", evt[i].data.fd);
+	  continue;
+	}
+      events = 0;
+      if (evt[i].events & EPOLLIN)
+	events |= MEMIF_FD_EVENT_READ;
+      if (evt[i].events & EPOLLOUT)
+	events |= MEMIF_FD_EVENT_WRITE;
+      if (evt[i].events & EPOLLERR)
+	events |= MEMIF_FD_EVENT_ERROR;
+      rv = memif_control_fd_handler (evt[i].data.fd, events);
+      if ((rv != MEMIF_ERR_SUCCESS) && (err == MEMIF_ERR_SUCCESS))
+	err = rv;
+    }
+
+  if (num_events)
+    *num_events = en;
+  return err;
+}
+
+int
+memif_poll_event (int timeout)
+{
+  return memif_poll_events (timeout, 1, NULL);
+}
+
+int
+memif_get_stats (memif_stats_t * stats)
+{
+  libmemif_main_t *lm = &libmemif_main;
+
+  if (stats == NULL)
+    return MEMIF_ERR_INVAL_ARG;
+
+  *stats = lm->stats;
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+/* return queued messages to connection message pool */
+static void
+memif_msg_queue_free (memif_connection_t * c)
+{
+  if (c->msg_queue == NULL)
+    return;
+  c->msg_queue_tail->next = c->msg_pool;
+  c->msg_pool = c->msg_queue;
+  c->msg_queue = NULL;
+}
+
+static void
+memif_msg_pool_free (memif_connection_t * c)
+{
+  memif_msg_queue_elt_t *e;
+
+  memif_msg_queue_free (c);
+  while ((e = c->msg_pool) != NULL)
+    {
+      c->msg_pool = e->next;
+      free (e);
+    }
+}
+
+/* return buffer held by ring descriptor to pool of its size */
+static void
+memif_pool_put (memif_queue_t * mq, memif_desc_t * d)
+{
+  memif_buffer_pool_t *bp = NULL;
+  uint32_t ring_size = (1 << mq->log2_ring_size);
+  int i;
+
+  for (i = 0; i < mq->num_pools; i++)
+    if (mq->pools[i].buffer_length <= d->buffer_length)
+      bp = &mq->pools[i];
+  if ((bp == NULL) || (bp->n_free >= ring_size))
+    {
+      DBG ("no pool for buffer of size %u", d->buffer_length);
+      return;
+    }
+  bp->free[bp->n_free].region = d->region;
+  bp->free[bp->n_free].offset = d->offset;
+  bp->n_free++;
+}
+
+/* attach free buffer to ring descriptor */
+static inline void
+memif_pool_get (memif_buffer_pool_t * bp, memif_desc_t * d)
+{
+  bp->n_free--;
+  d->region = bp->free[bp->n_free].region;
+  d->offset = bp->free[bp->n_free].offset;
+  d->buffer_length = bp->buffer_length;
+}
+
+/* number of free buffers in all pools */
+static inline uint32_t
+memif_pool_free_count (memif_queue_t * mq)
+{
+  uint32_t n = 0;
+  int i;
+
+  for (i = 0; i < mq->num_pools; i++)
+    n += mq->pools[i].n_free;
+  return n;
+}
+
+/* non-empty pool, pool of buffer_length sized buffers if possible */
+static memif_buffer_pool_t *
+memif_pool_select (memif_queue_t * mq, uint32_t buffer_length)
+{
+  memif_buffer_pool_t *bp = NULL;
+  int i;
+
+  for (i = 0; i < mq->num_pools; i++)
+    {
+      if (mq->pools[i].n_free == 0)
+	continue;
+      bp = &mq->pools[i];
+      if (bp->buffer_length >= buffer_length)
+	break;
+    }
+  return bp;
+}
+
+static void
+memif_queue_pools_free (memif_queue_t * mq)
+{
+  int i;
+
+  for (i = 0; i < mq->num_pools; i++)
+    free (mq->pools[i].free);
+  mq->num_pools = 0;
+}
+
+/* tx ring holding buffers of different sizes gets pool of free buffers per
+   size, ring slots hold buffers only while allocated or in flight */
+static int
+memif_queue_pools_init (memif_queue_t * mq)
+{
+  memif_ring_t *ring = mq->ring;
+  uint32_t ring_size = (1 << mq->log2_ring_size);
+  uint32_t lengths[MEMIF_MAX_BUFFER_CLASSES];
+  uint32_t buffer_length, j;
+  int k, n = 0;
+
+  memif_queue_pools_free (mq);
+  mq->buffer_size = 0;
+
+  for (j = 0; j < ring_size; j++)
+    {
+      buffer_length = ring->desc[j].buffer_length;
+      for (k = 0; k < n; k++)
+	if (lengths[k] == buffer_length)
+	  break;
+      if (k < n)
+	continue;
+      /* too many sizes, buffers stay in ring slots */
+      if (n == MEMIF_MAX_BUFFER_CLASSES)
+	return 0;
+      /* keep sizes ascending */
+      for (k = n; (k > 0) && (lengths[k - 1] > buffer_length); k--)
+	lengths[k] = lengths[k - 1];
+      lengths[k] = buffer_length;
+      n++;
+    }
+  if (n < 2)
+    {
+      /* single buffer size, enables memif_buffer_alloc_single */
+      mq->buffer_size = lengths[0];
+      return 0;
+    }
+
+  for (k = 0; k < n; k++)
+    {
+      mq->pools[k].buffer_length = lengths[k];
+      mq->pools[k].n_free = 0;
+      mq->pools[k].free = malloc (ring_size * sizeof (mq->pools[k].free[0]));
+      if (mq->pools[k].free == NULL)
+	{
+	  mq->num_pools = k;
+	  memif_queue_pools_free (mq);
+	  return -1;
+	}
+    }
+  mq->num_pools = n;
+
+  for (j = 0; j < ring_size; j++)
+    memif_pool_put (mq, &ring->desc[j]);
+
+  DBG ("%u buffer pools", n);
+  return 0;
+}
+
+/* release per connection tx queue state: coalescing timer and buffer pools */
+static void
+memif_queue_tx_release (memif_queue_t * mq)
+{
+  libmemif_main_t *lm = &libmemif_main;
+
+  if (mq->int_timer_fd > 0)
+    {
+      lm->control_fd_update (mq->int_timer_fd, MEMIF_FD_EVENT_DEL);
+      free_list_elt (lm->interrupt_list, lm->interrupt_list_len,
+		     mq->int_timer_fd);
+      memif_fd_table_del (mq->int_timer_fd);
+      close (mq->int_timer_fd);
+    }
+  mq->int_timer_fd = -1;
+  memif_queue_pools_free (mq);
+  free (mq->origin);
+  mq->origin = NULL;
+  mq->n_moved = 0;
+}
+
+/* unmap regions, close interrupt eventfds and free queues,
+   ra describes number of queues */
+static int
+memif_free_regions_and_queues (memif_connection_t * c,
+			       memif_conn_run_args_t * ra)
+{
+  uint16_t num;
+  int i;
+  memif_queue_t *mq;
+  memif_region_t *mr;
+  libmemif_main_t *lm = &libmemif_main;
+
+  if (c->tx_queues != NULL)
+    {
+      num = (c->args.is_master) ? ra->num_m2s_rings : ra->num_s2m_rings;
+      for (i = 0; i < num; i++)
+	{
+	  mq = &c->tx_queues[i];
+	  if (mq != NULL)
+	    {
+	      if (mq->int_fd > 0)
+		close (mq->int_fd);
+	      free_list_elt (lm->interrupt_list, lm->interrupt_list_len,
+			     mq->int_fd);
+	      memif_fd_table_del (mq->int_fd);
+	      mq->int_fd = -1;
+	      memif_queue_tx_release (mq);
+	    }
+	}
+      free (c->tx_queues);
+      c->tx_queues = NULL;
+    }
+
+  if (c->rx_queues != NULL)
+    {
+      num = (c->args.is_master) ? ra->num_s2m_rings : ra->num_m2s_rings;
+      for (i = 0; i < num; i++)
+	{
+	  mq = &c->rx_queues[i];
+	  if (mq != NULL)
+	    {
+	      if (mq->int_fd > 0)
+		{
+		  if (c->on_interrupt != NULL)
+		    lm->control_fd_update (mq->int_fd, MEMIF_FD_EVENT_DEL);
+		  close (mq->int_fd);
+		}
+	      free_list_elt (lm->interrupt_list, lm->interrupt_list_len,
+			     mq->int_fd);
+	      memif_fd_table_del (mq->int_fd);
+	      mq->int_fd = -1;
+	      free (mq->done);
+	      mq->done = NULL;
+	      free (mq->spare.free);
+	      mq->spare.free = NULL;
+	    }
+	}
+      free (c->rx_queues);
+      c->rx_queues = NULL;
+    }
+
+  if (c->regions != NULL)
+    {
+      for (i = 0; i < c->regions_num; i++)
+	{
+	  mr = &c->regions[i];
+	  if (mr->shm != NULL)
+	    {
+	      if (munmap (mr->shm, mr->region_size) < 0)
+		return memif_syscall_error_handler (errno);
+	      mr->shm = NULL;
+	    }
+	  if (mr->fd > 0)
+	    close (mr->fd);
+	  mr->fd = -1;
+	}
+      free (c->regions);
+      c->regions = NULL;
+      c->regions_num = 0;
+    }
+
+  return MEMIF_ERR_SUCCESS;
+}
+
+/* keep regions, rings and interrupt eventfds for next connection
+   (slave with keep_regions), release only what is bound to peer */
+static void
+memif_park_regions_and_queues (memif_connection_t * c)
+{
+  int i;
+  libmemif_main_t *lm = &libmemif_main;
+
+  for (i = 0; i < c->run_args.num_s2m_rings; i++)
+    memif_queue_tx_release (&c->tx_queues[i]);
+
+  if (c->on_interrupt != NULL)
+    for (i = 0; i < c->run_args.num_m2s_rings; i++)
+      lm->control_fd_update (c->rx_queues[i].int_fd, MEMIF_FD_EVENT_DEL);
+
+  c->shm_run_args = c->run_args;
+  c->flags |= MEMIF_CONNECTION_FLAG_SHM_KEPT;
+  DBG ("%u regions kept", c->regions_num);
+}
+
+/* send disconnect msg and close interface */
+int
+memif_disconnect_internal (memif_connection_t * c)
+{
+  if (c == NULL)
+    {
+      DBG ("no connection");
+      return MEMIF_ERR_NOCONN;
+    }
+  int err = MEMIF_ERR_SUCCESS;	/* 0 */
+  libmemif_main_t *lm = &libmemif_main;
+  memif_list_elt_t *e;
+
+  c->on_disconnect ((void *) c, c->private_ctx);
+
+  if (c->fd > 0)
+    {
+      memif_msg_send_disconnect (c->fd, "interface deleted", 0);
+      lm->control_fd_update (c->fd, MEMIF_FD_EVENT_DEL);
+      memif_fd_table_del (c->fd);
+      close (c->fd);
+    }
+  get_list_elt (&e, lm->control_list, lm->control_list_len, c->fd);
+  if (e != NULL)
+    {
+      if (c->args.is_master)
+	free_list_elt (lm->control_list, lm->control_list_len, c->fd);
+      e->key = c->fd = -1;
+    }
+
+  /* slave that was connected retries quickly, failed setup keeps
+     backing off */
+  if (c->flags & MEMIF_CONNECTION_FLAG_CONNECTED)
+    c->connect_backoff_msec = MEMIF_CONNECT_BACKOFF_MIN_MSEC;
+  c->flags &= ~(MEMIF_CONNECTION_FLAG_CONNECTED |
+		MEMIF_CONNECTION_FLAG_PIPELINE |
+		MEMIF_CONNECTION_FLAG_MULTI_REGION);
+
+  /* regions added to live connection are not kept, next connection
+     starts with formatted regions only */
+  if (!(c->args.is_master) && c->args.keep_regions && c->regions != NULL &&
+      c->tx_queues != NULL && c->rx_queues != NULL &&
+      !c->regions[c->regions_num - 1].is_spare)
+    memif_park_regions_and_queues (c);
+  else if ((err = memif_free_regions_and_queues (c, &c->run_args)) !=
+	   MEMIF_ERR_SUCCESS)
+    return err;
+
+  memset (&c->run_args, 0, sizeof (memif_conn_run_args_t));
+
+  memif_msg_queue_free (c);
+
+  if (!(c->args.is_master))
+    {
+      if (c->disconnect_usecs == 0)
+	c->disconnect_usecs = memif_time_usecs ();
+      if ((err = memif_connect_schedule (c)) != MEMIF_ERR_SUCCESS)
+	{
+	  DBG_UNIX ("timerfd_settime: arm");
+	}
+    }
+
+  return err;
+}
+
+int
+memif_delete (memif_conn_handle_t * conn)
+{
+  memif_connection_t *c = (memif_connection_t *) * conn;
+  if (c == NULL)
+    {
+      DBG ("no connection");
+      return MEMIF_ERR_NOCONN;
+    }
+  libmemif_main_t *lm = &libmemif_main;
+  memif_fd_entry_t *fe = NULL;
+  memif_socket_t *ms = NULL;
+
+  int err = MEMIF_ERR_SUCCESS;
+
+  if (c->fd > 0)
+    {
+      DBG ("DISCONNECTING");
+      err = memif_disconnect_internal (c);
+      if (err == MEMIF_ERR_NOCONN)
+	return err;
+    }
+
+  /* release shared memory kept for reconnect */
+  if (c->flags & MEMIF_CONNECTION_FLAG_SHM_KEPT)
+    {
+      c->flags &= ~MEMIF_CONNECTION_FLAG_SHM_KEPT;
+      memif_free_regions_and_queues (c, &c->shm_run_args);
+    }
+
+  free_list_elt_ctx (lm->control_list, lm->control_list_len, c);
+
+  if (c->args.is_master)
+    {
+      fe = memif_fd_table_get (c->listener_fd);
+      if ((fe != NULL) && (fe->type == MEMIF_FD_TYPE_LISTENER))
+	{
+	  ms = (memif_socket_t *) fe->data_struct;
+	  memif_socket_interface_del (ms, c);
+	  if (ms->use_count == 0)
+	    memif_socket_delete (ms);
+	  c->listener_fd = -1;
+	}
+    }
+  else
+    {
+      if ((err = memif_connect_cancel (c)) != MEMIF_ERR_SUCCESS)
+	{
+	  DBG ("timerfd_settime: disarm");
+	}
+    }
+
+  if (c->args.socket_filename)
+    free (c->args.socket_filename);
+  c->args.socket_filename = NULL;
+  if (c->args.s2m_numa_node)
+    free (c->args.s2m_numa_node);
+  c->args.s2m_numa_node = NULL;
+  if (c->args.m2s_numa_node)
+    free (c->args.m2s_numa_node);
+  c->args.m2s_numa_node = NULL;
+
+  memif_msg_pool_free (c);
+
+  free (c);
+  c = NULL;
+
+  *conn = c;
+  return err;
+}
+
+/* get page size backing shared memory file */
+static uint8_t
+memif_region_log2_page_size (int fd)
+{
+  struct stat st;
+  uint8_t log2 = 0;
+  long page_size;
+
+  /* hugetlbfs reports hugepage size as block size */
+  if (fstat (fd, &st) == 0)
+    page_size = st.st_blksize;
+  else
+    page_size = sysconf (_SC_PAGESIZE);
+
+  while ((1L << (log2 + 1)) <= page_size)
+    log2++;
+
+  return log2;
+}
+
+int
+memif_region_map (memif_connection_t * c, memif_region_t * mr)
+{
+  if (mr->fd < 0)
+    return MEMIF_ERR_NO_SHMFD;
+
+  /* region is already formatted by peer, populate instead of touching */
+  if ((mr->shm = mmap (NULL, mr->region_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | ((c->args.prefault_regions) ?
+				     MAP_POPULATE : 0), mr->fd,
+		       0)) == MAP_FAILED)
+    {
+      mr->shm = NULL;
+      return memif_syscall_error_handler (errno);
+    }
+  mr->log2_page_size = memif_region_log2_page_size (mr->fd);
+  if (c->args.lock_regions && mlock (mr->shm, mr->region_size) < 0)
+    return memif_syscall_error_handler (errno);
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+int
+memif_connect1 (memif_connection_t * c)
+{
+  libmemif_main_t *lm = &libmemif_main;
+  memif_region_t *mr;
+  memif_queue_t *mq;
+  int i, err;
+  uint16_t num;
+  struct timespec start;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < c->regions_num; i++)
+    {
+      mr = &c->regions[i];
+      if (!mr->shm)
+	{
+	  if ((err = memif_region_map (c, mr)) != MEMIF_ERR_SUCCESS)
+	    return err;
+	  c->prefault_usecs = memif_usecs_since (&start);
+	}
+    }
+
+  num =
+    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
+    num_s2m_rings;
+  for (i = 0; i < num; i++)
+    {
+      mq = &c->tx_queues[i];
+      if (mq != NULL)
+	{
+	  mq->ring = c->regions[mq->region].shm + mq->offset;
+	  if (mq->ring->cookie != MEMIF_COOKIE)
+	    {
+	      DBG ("wrong cookie on tx ring %u", i);
+	      return MEMIF_ERR_COOKIE;
+	    }
+	  mq->ring->head = mq->ring->tail = mq->last_head = mq->last_tail =
+	    mq->cached_head = mq->alloc_bufs = 0;
+	  mq->ring->head_wide = mq->ring->tail_wide = 0;
+	  if (memif_queue_pools_init (mq) < 0)
+	    return memif_syscall_error_handler (errno);
+	  if ((mq->headroom || mq->tailroom) && (mq->origin == NULL) &&
+	      ((mq->origin =
+		calloc (1 << mq->log2_ring_size,
+			sizeof (memif_buffer_origin_t))) == NULL))
+	    return memif_syscall_error_handler (errno);
+	}
+    }
+  num =
+    (c->args.is_master) ? c->run_args.num_s2m_rings : c->run_args.
+    num_m2s_rings;
+  for (i = 0; i < num; i++)
+    {
+      mq = &c->rx_queues[i];
+      if (mq != NULL)
+	{
+	  mq->ring = c->regions[mq->region].shm + mq->offset;
+	  if (mq->ring->cookie != MEMIF_COOKIE)
+	    {
+	      DBG ("wrong cookie on rx ring %u", i);
+	      return MEMIF_ERR_COOKIE;
+	    }
+	  mq->ring->head = mq->ring->tail = mq->last_head = mq->last_tail =
+	    mq->cached_head = mq->alloc_bufs = 0;
+	  mq->ring->head_wide = mq->ring->tail_wide = 0;
+	  if (mq->done != NULL)
+	    memset (mq->done, 0,
+		    ((1 << mq->log2_ring_size) + 63) / 64 * sizeof (uint64_t));
+	  mq->done_pending = 0;
+	}
+    }
+
+  /* keep polling for write until queued messages are sent */
+  lm->control_fd_update (c->fd, MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_MOD |
+			 ((c->msg_queue != NULL) ? MEMIF_FD_EVENT_WRITE : 0));
+
+  return 0;
+}
+
+/* create shared memory file backed by hugepages,
+   region size is rounded up to hugepage size */
+static int
+memif_region_create_hugetlb (memif_region_t * r, const char *name,
+			     memif_region_size_t size, uint8_t log2_page_size)
+{
+  memif_region_size_t page_size = 1ULL << log2_page_size;
+
+  if ((r->fd = memfd_create (name, MFD_HUGETLB |
+			     ((unsigned int) log2_page_size <<
+			      MFD_HUGE_SHIFT))) == -1)
+    return -1;
+
+  r->region_size = (size + page_size - 1) & ~(page_size - 1);
+
+  /* hugepages are reserved on mmap, so mmap fails if pool is exhausted */
+  if ((ftruncate (r->fd, r->region_size)) == -1 ||
+      (r->shm = mmap (NULL, r->region_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, r->fd, 0)) == MAP_FAILED)
+    {
+      r->shm = NULL;
+      close (r->fd);
+      r->fd = -1;
+      return -1;
+    }
+
+  return 0;
+}
+
+/* create shared memory file of specified size and map it */
+static int
+memif_region_create (memif_connection_t * conn, uint16_t index,
+		     memif_region_size_t size)
+{
+  memif_region_t *r = &conn->regions[index];
+  memif_region_size_t page_size;
+  char name[32];
+
+  snprintf (name, sizeof (name), "memif region %u", index);
+
+  if (conn->args.log2_page_size)
+    {
+      if (memif_region_create_hugetlb (r, name, size,
+				       conn->args.log2_page_size) == 0)
 	{
-	  if ((lm->control_list[i].key < 0)
-	      && (lm->control_list[i].data_struct != NULL))
-	    {
-	      conn = lm->control_list[i].data_struct;
-	      if (conn->args.is_master)
-		continue;
+	  r->log2_page_size = memif_region_log2_page_size (r->fd);
+	  return MEMIF_ERR_SUCCESS;	/* 0 */
+	}
+      DBG ("%s: hugepages not available (%s), using default page size",
+	   name, strerror (errno));
+    }
 
-	      struct sockaddr_un sun;
-	      sockfd = socket (AF_UNIX, SOCK_SEQPACKET, 0);
-	      if (sockfd < 0)
-		{
-		  err = memif_syscall_error_handler (errno);
-		  goto error;
-		}
+  page_size = sysconf (_SC_PAGESIZE);
+  r->region_size = (size + page_size - 1) & ~(page_size - 1);
 
-	      sun.sun_family = AF_UNIX;
+  if ((r->fd = memfd_create (name, MFD_ALLOW_SEALING)) == -1)
+    return memif_syscall_error_handler (errno);
+/*
+    if ((fcntl (r->fd, F_ADD_SEALS, F_SEAL_SHRINK)) == -1)
+        return memif_syscall_error_handler (errno);
+*/
+  if ((ftruncate (r->fd, r->region_size)) == -1)
+    return memif_syscall_error_handler (errno);
 
-	      strncpy (sun.sun_path, conn->args.socket_filename,
-		       sizeof (sun.sun_path) - 1);
+  if ((r->shm = mmap (NULL, r->region_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, r->fd, 0)) == MAP_FAILED)
+    {
+      r->shm = NULL;
+      return memif_syscall_error_handler (errno);
+    }
+  r->log2_page_size = memif_region_log2_page_size (r->fd);
 
-	      if (connect (sockfd, (struct sockaddr *) &sun,
-			   sizeof (struct sockaddr_un)) == 0)
-		{
-		  conn->fd = sockfd;
-		  conn->read_fn = memif_conn_fd_read_ready;
-		  conn->write_fn = memif_conn_fd_write_ready;
-		  conn->error_fn = memif_conn_fd_error;
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
 
-		  lm->control_list[conn->index].key = conn->fd;
+/* set preferred NUMA node of memory range (extended to page boundaries)
+   and fault it in */
+static int
+memif_numa_bind (void *addr, uint64_t size, uint8_t log2_page_size,
+		 int16_t node)
+{
+  unsigned long nodemask[MEMIF_MAX_NUMA_NODES / (8 * sizeof (unsigned long))];
+  uintptr_t page_size = 1ULL << log2_page_size;
+  uintptr_t start = (uintptr_t) addr & ~(page_size - 1);
+  uintptr_t end = ((uintptr_t) addr + size + page_size - 1) & ~(page_size - 1);
+  uintptr_t p;
+
+  if ((node < 0) || (node >= MEMIF_MAX_NUMA_NODES))
+    return MEMIF_ERR_INVAL_ARG;
+
+  memset (nodemask, 0, sizeof (nodemask));
+  nodemask[node / (8 * sizeof (unsigned long))] |=
+    1UL << (node % (8 * sizeof (unsigned long)));
+
+  /* kernel expects maxnode to be one more than number of bits in mask */
+  if (memif_mbind ((void *) start, end - start, MPOL_PREFERRED, nodemask,
+		   MEMIF_MAX_NUMA_NODES + 1, 0) < 0)
+    {
+      DBG ("mbind: %s", strerror (errno));
+      return memif_syscall_error_handler (errno);
+    }
 
-		  lm->control_fd_update (sockfd,
-					 MEMIF_FD_EVENT_READ |
-					 MEMIF_FD_EVENT_WRITE);
+  for (p = start; p < end; p += page_size)
+    *(volatile uint8_t *) p = *(volatile uint8_t *) p;
 
-		  lm->disconn_slaves--;
-		  if (lm->disconn_slaves == 0)
-		    {
-		      if (timerfd_settime (lm->timerfd, 0, &lm->disarm, NULL)
-			  < 0)
-			{
-			  err = memif_syscall_error_handler (errno);
-			  goto error;
-			}
-		    }
-		}
-	      else
-		{
-		  err = memif_syscall_error_handler (errno);
-		  goto error;
-		}
-	    }
-	}
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+/* place ring and buffers of queue q (S2M rings first, then M2S)
+   on NUMA node requested by user, placement is only a hint
+   so failure is not fatal */
+static void
+memif_numa_place_queue (memif_connection_t * conn, uint16_t q,
+			uint64_t buffer_offset, uint64_t buffers_size)
+{
+  memif_region_t *r;
+  int16_t node = -1;
+  void *ring;
+
+  if (q < conn->run_args.num_s2m_rings)
+    {
+      if (conn->args.s2m_numa_node)
+	node = conn->args.s2m_numa_node[q];
+      ring = memif_get_ring (conn, MEMIF_RING_S2M, q);
+    }
+  else
+    {
+      if (conn->args.m2s_numa_node)
+	node = conn->args.m2s_numa_node[q - conn->run_args.num_s2m_rings];
+      ring = memif_get_ring (conn, MEMIF_RING_M2S,
+			     q - conn->run_args.num_s2m_rings);
+    }
+  if (node < 0)
+    return;
+
+  r = &conn->regions[0];
+  memif_numa_bind (ring, memif_get_ring_stride (conn), r->log2_page_size,
+		   node);
+
+  if (conn->regions_num > 1)
+    {
+      r = &conn->regions[q + 1];
+      memif_numa_bind (r->shm, r->region_size, r->log2_page_size, node);
     }
   else
+    memif_numa_bind (r->shm + buffer_offset + q * buffers_size,
+		     buffers_size, r->log2_page_size, node);
+}
+
+/* fault in whole region, so data path does not take page faults,
+   and optionally lock it in memory */
+static int
+memif_region_prefault (memif_connection_t * conn, memif_region_t * r)
+{
+  uint64_t page_size = 1ULL << r->log2_page_size;
+  uint64_t p;
+
+  if (conn->args.prefault_regions)
+    {
+#ifdef MADV_POPULATE_WRITE
+      if (madvise (r->shm, r->region_size, MADV_POPULATE_WRITE) < 0)
+#endif
+	for (p = 0; p < r->region_size; p += page_size)
+	  *(volatile uint8_t *) (r->shm + p) =
+	    *(volatile uint8_t *) (r->shm + p);
+    }
+
+  if (conn->args.lock_regions && mlock (r->shm, r->region_size) < 0)
+    return memif_syscall_error_handler (errno);
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+/* get NUMA node of memory page (page is faulted in if not present) */
+static int16_t
+memif_numa_node (void *addr)
+{
+  int node = -1;
+
+  if (memif_get_mempolicy (&node, NULL, 0, addr,
+			   MPOL_F_NODE | MPOL_F_ADDR) < 0)
+    return -1;
+
+  return node;
+}
+
+/* get NUMA node of queue buffers, -1 if queue memory is not mapped */
+static int16_t
+memif_queue_numa_node (memif_connection_t * c, memif_queue_t * mq)
+{
+  memif_ring_t *ring;
+
+  if ((c->regions == NULL) || (mq->region >= c->regions_num) ||
+      (c->regions[mq->region].shm == NULL))
+    return -1;
+  ring = c->regions[mq->region].shm + mq->offset;
+  if ((ring->desc[0].region >= c->regions_num) ||
+      (c->regions[ring->desc[0].region].shm == NULL))
+    return -1;
+
+  return memif_numa_node (memif_get_buffer (c, ring, 0));
+}
+
+/* distance of ring slots holding buffers of size bytes, with buffer coloring
+   slots are padded to odd number of cachelines, so buffers following each
+   other start in different cache sets instead of few sets of power of two
+   stride */
+static inline uint32_t
+memif_slot_stride (memif_connection_t * conn, uint32_t size)
+{
+  uint32_t lines;
+
+  if (!conn->args.buffer_coloring)
+    return size;
+  lines = (size + MEMIF_CACHELINE_SIZE - 1) / MEMIF_CACHELINE_SIZE;
+  return (lines | 1) * MEMIF_CACHELINE_SIZE;
+}
+
+/* buffer of ring slot, with buffer size classes slots backed by buffers
+   of one class are consecutive, every slot reserves headroom in front of
+   and tailroom behind its buffer, returns buffer offset within buffer memory
+   of queue */
+static uint64_t
+memif_slot_buffer (memif_connection_t * conn, uint32_t slot,
+		   uint32_t * buffer_length)
+{
+  memif_buffer_class_t *bc = conn->args.buffer_classes;
+  uint32_t ring_size = (1 << conn->run_args.log2_ring_size);
+  uint32_t room = conn->args.headroom + conn->args.tailroom;
+  uint32_t first = 0, n, stride;
+  uint64_t offset = conn->args.headroom;
+  int i, last = -1;
+
+  *buffer_length = 0;
+  for (i = 0; i < MEMIF_MAX_BUFFER_CLASSES; i++)
+    if (bc[i].size)
+      last = i;
+
+  if (last < 0)
+    {
+      *buffer_length = conn->run_args.buffer_size;
+      /* keep slots cacheline aligned */
+      stride = memif_slot_stride (conn,
+				  (conn->run_args.buffer_size + room +
+				   63) & ~63);
+      return offset + (uint64_t) slot *stride;
+    }
+
+  for (i = 0; i <= last; i++)
     {
-      get_list_elt (&e, lm->interrupt_list, lm->interrupt_list_len, fd);
-      if (e != NULL)
+      if (bc[i].size == 0)
+	continue;
+      n = (i == last) ? ring_size - first : ring_size * bc[i].share / 100;
+      /* keep slots cacheline aligned */
+      stride = memif_slot_stride (conn, (bc[i].size + room + 63) & ~63);
+      if (slot < first + n)
 	{
-	  if (((memif_connection_t *) e->data_struct)->on_interrupt != NULL)
-	    {
-	      num =
-		(((memif_connection_t *) e->data_struct)->args.
-		 is_master) ? ((memif_connection_t *) e->data_struct)->
-		run_args.num_s2m_rings : ((memif_connection_t *) e->
-					  data_struct)->run_args.
-		num_m2s_rings;
-	      for (i = 0; i < num; i++)
-		{
-		  if (((memif_connection_t *) e->data_struct)->rx_queues[i].
-		      int_fd == fd)
-		    {
-		      ((memif_connection_t *) e->
-		       data_struct)->on_interrupt ((void *) e->data_struct,
-						   ((memif_connection_t *)
-						    e->data_struct)->
-						   private_ctx, i);
-		      return MEMIF_ERR_SUCCESS;
-		    }
-		}
-	    }
-	  return MEMIF_ERR_SUCCESS;
+	  *buffer_length = bc[i].size;
+	  return offset + (uint64_t) (slot - first) * stride;
 	}
-      get_list_elt (&e, lm->listener_list, lm->listener_list_len, fd);
-      if (e != NULL)
+      first += n;
+      offset += (uint64_t) n *stride;
+    }
+
+  return offset;
+}
+
+/* buffer memory of one queue */
+static memif_region_size_t
+memif_queue_buffers_size (memif_connection_t * conn)
+{
+  uint32_t buffer_length;
+  /* offset past last slot */
+  return memif_slot_buffer (conn, 1 << conn->run_args.log2_ring_size,
+			    &buffer_length) - conn->args.headroom;
+}
+
+/* rings and buffers of all queues have to fit address space,
+   so that region sizes and offsets within them do not wrap */
+static int
+memif_shm_size_valid (memif_connection_t * conn)
+{
+  uint16_t num_queues =
+    conn->run_args.num_s2m_rings + conn->run_args.num_m2s_rings;
+  memif_region_size_t max = SIZE_MAX, rings;
+
+  if (conn->run_args.log2_ring_size > MEMIF_MAX_LOG2_RING_SIZE)
+    return 0;
+  if (num_queues == 0)
+    return 1;
+  rings = (memif_region_size_t) num_queues * memif_get_ring_stride (conn);
+  if (rings > max)
+    return 0;
+  return memif_queue_buffers_size (conn) <= (max - rings) / num_queues;
+}
+
+/* initialize descriptors of ring q (S2M rings first, then M2S) */
+static void
+memif_init_ring (memif_connection_t * conn, memif_ring_t * ring, uint16_t q,
+		 uint64_t buffer_offset)
+{
+  uint32_t ring_size = (1 << conn->run_args.log2_ring_size);
+  memif_region_size_t buffers_size = memif_queue_buffers_size (conn);
+  uint64_t offset;
+  uint32_t buffer_length, j;
+
+  ring->head = ring->tail = 0;
+  ring->head_wide = ring->tail_wide = 0;
+  ring->cookie = MEMIF_COOKIE;
+  ring->flags = 0;
+  for (j = 0; j < ring_size; j++)
+    {
+      offset = memif_slot_buffer (conn, j, &buffer_length);
+      if (conn->regions_num > 1)
 	{
-	  memif_conn_fd_accept_ready ((memif_socket_t *) e->data_struct);
-	  return MEMIF_ERR_SUCCESS;
+	  /* buffers in region owned by this queue */
+	  ring->desc[j].region = q + 1;
+	  ring->desc[j].offset = offset;
 	}
-
-      get_list_elt (&e, lm->pending_list, lm->pending_list_len, fd);
-      if (e != NULL)
+      else
 	{
-	  memif_read_ready (fd);
-	  return MEMIF_ERR_SUCCESS;
+	  ring->desc[j].region = 0;
+	  ring->desc[j].offset = buffer_offset + q * buffers_size + offset;
 	}
+      ring->desc[j].buffer_length = buffer_length;
+    }
+}
+
+/* resume kept regions and eventfds: format rings and reset queues,
+   no memory is allocated or faulted in */
+static int
+memif_reuse_regions_and_queues (memif_connection_t * conn)
+{
+  memif_ring_t *ring;
+  memif_queue_t *mq;
+  uint64_t buffer_offset, b;
+  uint64_t *done;
+  int i;
+
+  buffer_offset = (memif_region_size_t) (conn->run_args.num_s2m_rings +
+					 conn->run_args.num_m2s_rings) *
+    memif_get_ring_stride (conn);
+
+  for (i = 0; i < conn->run_args.num_s2m_rings; i++)
+    {
+      ring = memif_get_ring (conn, MEMIF_RING_S2M, i);
+      memif_init_ring (conn, ring, i, buffer_offset);
+      mq = &conn->tx_queues[i];
+      mq->last_head = mq->last_tail = mq->cached_head = mq->alloc_bufs = 0;
+      memif_queue_reset_state (mq);
+      /* drop interrupts not consumed by previous peer */
+      if (read (mq->int_fd, &b, sizeof (b)) < 0 && errno != EAGAIN)
+	return memif_syscall_error_handler (errno);
+    }
+  for (i = 0; i < conn->run_args.num_m2s_rings; i++)
+    {
+      ring = memif_get_ring (conn, MEMIF_RING_M2S, i);
+      memif_init_ring (conn, ring, i + conn->run_args.num_s2m_rings,
+		       buffer_offset);
+      mq = &conn->rx_queues[i];
+      mq->last_head = mq->last_tail = mq->cached_head = mq->alloc_bufs = 0;
+      done = mq->done;
+      memif_queue_reset_state (mq);
+      mq->done = done;
+      if (read (mq->int_fd, &b, sizeof (b)) < 0 && errno != EAGAIN)
+	return memif_syscall_error_handler (errno);
+    }
+
+  /* kept memory stays faulted in (and locked) */
+  conn->prefault_usecs = 0;
+  conn->flags |= MEMIF_CONNECTION_FLAG_SHM_REUSED;
+  DBG ("%u regions reused", conn->regions_num);
+  return 0;
+}
+
+int
+memif_init_regions_and_queues (memif_connection_t * conn)
+{
+  memif_ring_t *ring = NULL;
+  uint64_t buffer_offset;
+  memif_region_size_t buffers_size;
+  uint16_t num_queues;
+  int i, err;
+  libmemif_main_t *lm = &libmemif_main;
+  memif_list_elt_t e;
+  struct timespec start;
+  uint8_t multi_region;
+
+  num_queues = conn->run_args.num_s2m_rings + conn->run_args.num_m2s_rings;
+
+  /* separate buffer region per queue, if peer maps extra regions
+     and accepts enough of them */
+  multi_region = (conn->flags & MEMIF_CONNECTION_FLAG_MULTI_REGION) &&
+    (conn->run_args.max_region >= num_queues);
+
+  if (conn->flags & MEMIF_CONNECTION_FLAG_SHM_KEPT)
+    {
+      conn->flags &= ~MEMIF_CONNECTION_FLAG_SHM_KEPT;
+      if (conn->shm_run_args.num_s2m_rings == conn->run_args.num_s2m_rings &&
+	  conn->shm_run_args.num_m2s_rings == conn->run_args.num_m2s_rings &&
+	  conn->shm_run_args.log2_ring_size == conn->run_args.log2_ring_size &&
+	  conn->shm_run_args.buffer_size == conn->run_args.buffer_size &&
+	  conn->shm_run_args.max_region == conn->run_args.max_region &&
+	  (conn->regions_num > 1) == multi_region)
+	return memif_reuse_regions_and_queues (conn);
+      /* peer negotiated different layout */
+      if ((err = memif_free_regions_and_queues (conn, &conn->shm_run_args))
+	  != MEMIF_ERR_SUCCESS)
+	return err;
+    }
+  conn->flags &= ~MEMIF_CONNECTION_FLAG_SHM_REUSED;
+
+  if (!memif_shm_size_valid (conn))
+    return MEMIF_ERR_MAXRING;
+
+  buffer_offset = (memif_region_size_t) num_queues *
+    memif_get_ring_stride (conn);
+
+  /* buffer memory of one queue */
+  buffers_size = memif_queue_buffers_size (conn);
+
+  conn->regions_num = multi_region ? num_queues + 1 : 1;
+
+  conn->regions =
+    (memif_region_t *) malloc (sizeof (memif_region_t) * conn->regions_num);
+  if (conn->regions == NULL)
+    {
+      conn->regions_num = 0;
+      return memif_syscall_error_handler (errno);
+    }
+  for (i = 0; i < conn->regions_num; i++)
+    {
+      conn->regions[i].shm = NULL;
+      conn->regions[i].region_size = 0;
+      conn->regions[i].fd = -1;
+      conn->regions[i].log2_page_size = 0;
+      conn->regions[i].is_spare = 0;
+      conn->regions[i].pending = 0;
+    }
 
-      get_list_elt (&e, lm->control_list, lm->control_list_len, fd);
-      if (e != NULL)
+  if (conn->regions_num > 1)
+    {
+      if ((err =
+	   memif_region_create (conn, 0, buffer_offset)) != MEMIF_ERR_SUCCESS)
+	return err;
+      for (i = 1; i < conn->regions_num; i++)
 	{
-	  if (events & MEMIF_FD_EVENT_READ)
-	    {
-	      err =
-		((memif_connection_t *) e->data_struct)->read_fn (e->
-								  data_struct);
-	      if (err != MEMIF_ERR_SUCCESS)
-		return err;
-	    }
-	  if (events & MEMIF_FD_EVENT_WRITE)
-	    {
-	      err =
-		((memif_connection_t *) e->data_struct)->write_fn (e->
-								   data_struct);
-	      if (err != MEMIF_ERR_SUCCESS)
-		return err;
-	    }
-	  if (events & MEMIF_FD_EVENT_ERROR)
-	    {
-	      err =
-		((memif_connection_t *) e->data_struct)->error_fn (e->
-								   data_struct);
-	      if (err != MEMIF_ERR_SUCCESS)
-		return err;
-	    }
+	  if ((err =
+	       memif_region_create (conn, i,
+				    buffers_size)) != MEMIF_ERR_SUCCESS)
+	    return err;
 	}
     }
+  else
+    {
+      if ((err =
+	   memif_region_create (conn, 0,
+				buffer_offset +
+				buffers_size * num_queues)) !=
+	  MEMIF_ERR_SUCCESS)
+	return err;
+    }
+
+  /* memory has to be placed before first touch */
+  for (i = 0; i < num_queues; i++)
+    memif_numa_place_queue (conn, i, buffer_offset, buffers_size);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < conn->regions_num; i++)
+    {
+      if ((err = memif_region_prefault (conn, &conn->regions[i])) !=
+	  MEMIF_ERR_SUCCESS)
+	return err;
+    }
+  conn->prefault_usecs = memif_usecs_since (&start);
+
+  for (i = 0; i < conn->run_args.num_s2m_rings; i++)
+    {
+      ring = memif_get_ring (conn, MEMIF_RING_S2M, i);
+      DBG ("RING: %p I: %d", ring, i);
+      memif_init_ring (conn, ring, i, buffer_offset);
+    }
+  for (i = 0; i < conn->run_args.num_m2s_rings; i++)
+    {
+      ring = memif_get_ring (conn, MEMIF_RING_M2S, i);
+      DBG ("RING: %p I: %d", ring, i);
+      memif_init_ring (conn, ring, i + conn->run_args.num_s2m_rings,
+		       buffer_offset);
+    }
+  memif_queue_t *mq;
+  mq =
+    (memif_queue_t *) malloc (sizeof (memif_queue_t) *
+			      conn->run_args.num_s2m_rings);
+  if (mq == NULL)
+    return memif_syscall_error_handler (errno);
+  int x;
+  for (x = 0; x < conn->run_args.num_s2m_rings; x++)
+    {
+      if ((mq[x].int_fd = eventfd (0, EFD_NONBLOCK)) < 0)
+	return memif_syscall_error_handler (errno);
+      /* add int fd to interrupt fd list */
+      e.key = mq[x].int_fd;
+      e.data_struct = conn;
+      add_list_elt (&e, &lm->interrupt_list, &lm->interrupt_list_len);
+
+      mq[x].ring = memif_get_ring (conn, MEMIF_RING_S2M, x);
+      DBG ("RING: %p I: %d", mq[x].ring, x);
+      mq[x].log2_ring_size = conn->run_args.log2_ring_size;
+      mq[x].region = 0;
+      mq[x].offset =
+	(void *) mq[x].ring - (void *) conn->regions[mq->region].shm;
+      mq[x].last_head = 0;
+      mq[x].last_tail = 0;
+      mq[x].cached_head = 0;
+      mq[x].alloc_bufs = 0;
+      memif_queue_reset_state (&mq[x]);
+      mq[x].headroom = conn->args.headroom;
+      mq[x].tailroom = conn->args.tailroom;
+    }
+  conn->tx_queues = mq;
+
+  mq =
+    (memif_queue_t *) malloc (sizeof (memif_queue_t) *
+			      conn->run_args.num_m2s_rings);
+  if (mq == NULL)
+    return memif_syscall_error_handler (errno);
+  for (x = 0; x < conn->run_args.num_m2s_rings; x++)
+    {
+      if ((mq[x].int_fd = eventfd (0, EFD_NONBLOCK)) < 0)
+	return memif_syscall_error_handler (errno);
+      /* add int fd to interrupt fd list */
+      e.key = mq[x].int_fd;
+      e.data_struct = conn;
+      add_list_elt (&e, &lm->interrupt_list, &lm->interrupt_list_len);
+
+      mq[x].ring = memif_get_ring (conn, MEMIF_RING_M2S, x);
+      DBG ("RING: %p I: %d", mq[x].ring, x);
+      mq[x].log2_ring_size = conn->run_args.log2_ring_size;
+      mq[x].region = 0;
+      mq[x].offset =
+	(void *) mq[x].ring - (void *) conn->regions[mq->region].shm;
+      mq[x].last_head = 0;
+      mq[x].last_tail = 0;
+      mq[x].cached_head = 0;
+      mq[x].alloc_bufs = 0;
+      memif_queue_reset_state (&mq[x]);
+      mq[x].headroom = conn->args.headroom;
+      mq[x].tailroom = conn->args.tailroom;
+      if (memif_queue_done_init (&mq[x]) < 0)
+	return memif_syscall_error_handler (errno);
+    }
+  conn->rx_queues = mq;
+
+  return 0;
+}
 
-  return MEMIF_ERR_SUCCESS;	/* 0 */
+/* rx: take buffer from spare pool and attach it to ring descriptor */
+static inline void
+memif_spare_get (memif_connection_t * c, memif_queue_t * mq, memif_desc_t * d)
+{
+  memif_region_t *r;
 
-error:
-  if (sockfd > 0)
-    close (sockfd);
-  sockfd = -1;
-  return err;
+  mq->spare.n_free--;
+  d->region = mq->spare.free[mq->spare.n_free].region;
+  d->offset = mq->spare.free[mq->spare.n_free].offset;
+  d->buffer_length = mq->spare.buffer_length;
+  r = &c->regions[d->region];
+  if (r->is_spare && (r->qid == mq - c->rx_queues))
+    r->n_pooled--;
 }
 
-int
-memif_poll_event (int timeout)
+/* rx: return buffer to spare pool */
+static inline void
+memif_spare_put (memif_connection_t * c, memif_queue_t * mq,
+		 memif_region_index_t region, memif_region_offset_t offset)
 {
-  libmemif_main_t *lm = &libmemif_main;
-  memif_list_elt_t *elt;
-  struct epoll_event evt, *e;
-  int en = 0, err = MEMIF_ERR_SUCCESS, i = 0;	/* 0 */
-  uint16_t num;
-  uint32_t events = 0;
-  memset (&evt, 0, sizeof (evt));
-  evt.events = EPOLLIN | EPOLLOUT;
-  sigset_t sigset;
-  sigemptyset (&sigset);
-  en = epoll_pwait (memif_epfd, &evt, 1, timeout, &sigset);
-  if (en < 0)
-    {
-      DBG ("epoll_pwait: %s", strerror (errno));
-      return -1;
-    }
-  if (en > 0)
-    {
-      if (evt.events & EPOLLIN)
-	events |= MEMIF_FD_EVENT_READ;
-      if (evt.events & EPOLLOUT)
-	events |= MEMIF_FD_EVENT_WRITE;
-      if (evt.events & EPOLLERR)
-	events |= MEMIF_FD_EVENT_ERROR;
-      err = memif_control_fd_handler (evt.data.fd, events);
-      return err;
-    }
-  return 0;
+  memif_region_t *r = &c->regions[region];
+
+  mq->spare.free[mq->spare.n_free].region = region;
+  mq->spare.free[mq->spare.n_free].offset = offset;
+  mq->spare.n_free++;
+  if (r->is_spare && (r->qid == mq - c->rx_queues))
+    r->n_pooled++;
 }
 
+/* rx: put all buffers of spare region into spare pool of its queue */
 static void
-memif_msg_queue_free (memif_msg_queue_elt_t ** e)
+memif_spare_attach (memif_connection_t * c, memif_region_index_t index)
 {
-  if (*e == NULL)
-    return;
-  memif_msg_queue_free (&(*e)->next);
-  free (*e);
-  *e = NULL;
-  return;
+  memif_region_t *r = &c->regions[index];
+  memif_queue_t *mq = &c->rx_queues[r->qid];
+  uint32_t stride = memif_slot_stride (c, c->run_args.buffer_size);
+  uint32_t i;
+
+  for (i = 0; i < r->num_buffers; i++)
+    memif_spare_put (c, mq, index, i * stride);
+  r->released = 0;
+  DBG ("region %u: %u spare buffers for rx queue %u", index, r->num_buffers,
+       r->qid);
 }
 
-/* send disconnect msg and close interface */
-int
-memif_disconnect_internal (memif_connection_t * c)
+/* rx: pressure dropped, take buffers of unused spare regions out of
+   spare pool and return their pages to kernel, mappings stay valid
+   and pages are faulted in again when region is reattached */
+static void
+memif_spare_release (memif_connection_t * c, memif_queue_t * mq)
 {
-  if (c == NULL)
-    {
-      DBG ("no connection");
-      return MEMIF_ERR_NOCONN;
-    }
-  uint16_t num;
-  int err = MEMIF_ERR_SUCCESS, i;	/* 0 */
-  memif_queue_t *mq;
-  libmemif_main_t *lm = &libmemif_main;
-  memif_list_elt_t *e;
-
-  c->on_disconnect ((void *) c, c->private_ctx);
-
-  if (c->fd > 0)
-    {
-      memif_msg_send_disconnect (c->fd, "interface deleted", 0);
-      lm->control_fd_update (c->fd, MEMIF_FD_EVENT_DEL);
-      close (c->fd);
-    }
-  get_list_elt (&e, lm->control_list, lm->control_list_len, c->fd);
-  if (e != NULL)
-    {
-      if (c->args.is_master)
-	free_list_elt (lm->control_list, lm->control_list_len, c->fd);
-      e->key = c->fd = -1;
-    }
+  memif_region_t *r;
+  uint16_t qid = mq - c->rx_queues;
+  uint32_t j, n;
+  int i;
 
-  if (c->tx_queues != NULL)
+  for (i = 0; i < c->regions_num; i++)
     {
-      num =
-	(c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
-	num_s2m_rings;
-      for (i = 0; i < num; i++)
+      r = &c->regions[i];
+      if (!r->is_spare || r->pending || r->released || (r->qid != qid) ||
+	  (r->n_pooled != r->num_buffers))
+	continue;
+      for (j = n = 0; j < mq->spare.n_free; j++)
+	if (mq->spare.free[j].region != i)
+	  mq->spare.free[n++] = mq->spare.free[j];
+      mq->spare.n_free = n;
+      r->n_pooled = 0;
+      r->released = 1;
+      if (madvise (r->shm, r->region_size, MADV_REMOVE) < 0)
 	{
-	  mq = &c->tx_queues[i];
-	  if (mq != NULL)
-	    {
-	      if (mq->int_fd > 0)
-		close (mq->int_fd);
-	      free_list_elt (lm->interrupt_list, lm->interrupt_list_len,
-			     mq->int_fd);
-	      mq->int_fd = -1;
-	    }
+	  DBG ("region %u: madvise: %s", i, strerror (errno));
 	}
-      free (c->tx_queues);
-      c->tx_queues = NULL;
+      DBG ("region %u released", i);
     }
+}
 
-  if (c->rx_queues != NULL)
+/* rx: spare pool is empty, reattach released spare region */
+static int
+memif_spare_reattach (memif_connection_t * c, memif_queue_t * mq)
+{
+  memif_region_t *r;
+  uint16_t qid = mq - c->rx_queues;
+  int i;
+
+  for (i = 0; i < c->regions_num; i++)
     {
-      num =
-	(c->args.is_master) ? c->run_args.num_s2m_rings : c->run_args.
-	num_m2s_rings;
-      for (i = 0; i < num; i++)
+      r = &c->regions[i];
+      if (r->is_spare && r->released && (r->qid == qid))
 	{
-	  mq = &c->rx_queues[i];
-	  if (mq != NULL)
-	    {
-	      if (mq->int_fd > 0)
-		{
-		  if (c->on_interrupt != NULL)
-		    lm->control_fd_update (mq->int_fd, MEMIF_FD_EVENT_DEL);
-		  close (mq->int_fd);
-		}
-	      free_list_elt (lm->interrupt_list, lm->interrupt_list_len,
-			     mq->int_fd);
-	      mq->int_fd = -1;
-	    }
+	  memif_spare_attach (c, i);
+	  return 0;
 	}
-      free (c->rx_queues);
-      c->rx_queues = NULL;
     }
+  return -1;
+}
 
-  if (c->regions != NULL)
-    {
-      if (munmap (c->regions[0].shm, c->regions[0].region_size) < 0)
-	return memif_syscall_error_handler (errno);
-      if (c->regions[0].fd > 0)
-	close (c->regions[0].fd);
-      c->regions[0].fd = -1;
-      free (c->regions);
-      c->regions = NULL;
-    }
+int
+memif_region_add (memif_conn_handle_t conn, uint16_t qid,
+		  uint32_t num_buffers)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (!(c->flags & MEMIF_CONNECTION_FLAG_CONNECTED))
+    return MEMIF_ERR_DISCONNECTED;
+  /* slave owns shared memory */
+  if (c->args.is_master)
+    return MEMIF_ERR_INVAL_ARG;
+  if (qid >= c->run_args.num_m2s_rings)
+    return MEMIF_ERR_QID;
+  /* older master maps regions during handshake only */
+  if (!(c->flags & MEMIF_CONNECTION_FLAG_MULTI_REGION))
+    return MEMIF_ERR_MAXREG;
+  libmemif_main_t *lm = &libmemif_main;
+  memif_region_t *r;
+  uint32_t total = num_buffers;
+  uint16_t index = c->regions_num;
+  int i, err;
+
+  /* spare buffers replace ring buffers, so all buffers of queue
+     have to be interchangeable */
+  for (i = 0; i < MEMIF_MAX_BUFFER_CLASSES; i++)
+    if (c->args.buffer_classes[i].size)
+      return MEMIF_ERR_INVAL_ARG;
+  if (c->args.headroom || c->args.tailroom)
+    return MEMIF_ERR_INVAL_ARG;
+
+  for (i = 0; i < c->regions_num; i++)
+    if (c->regions[i].is_spare && (c->regions[i].qid == qid))
+      total += c->regions[i].num_buffers;
+  if ((num_buffers == 0) || (total > UINT16_MAX))
+    return MEMIF_ERR_INVAL_ARG;
+  if (index > c->run_args.max_region)
+    return MEMIF_ERR_MAXREG;
+
+  r = (memif_region_t *) realloc (c->regions,
+				  sizeof (memif_region_t) * (index + 1));
+  if (r == NULL)
+    return memif_syscall_error_handler (errno);
+  c->regions = r;
+  r = &c->regions[index];
+  memset (r, 0, sizeof (memif_region_t));
+  r->fd = -1;
+
+  if ((err = memif_region_create (c, index, (uint64_t) num_buffers *
+				  memif_slot_stride (c,
+						     c->run_args.
+						     buffer_size))) !=
+      MEMIF_ERR_SUCCESS)
+    goto error;
+  if ((err = memif_region_prefault (c, r)) != MEMIF_ERR_SUCCESS)
+    goto error;
+
+  /* region is only added once it is queued for announcement */
+  if ((err = memif_msg_enq_add_region (c, index)) != MEMIF_ERR_SUCCESS)
+    goto error;
+  r->is_spare = 1;
+  r->pending = 1;
+  r->qid = qid;
+  r->num_buffers = num_buffers;
+  c->regions_num++;
+
+  c->flags |= MEMIF_CONNECTION_FLAG_WRITE;
+  lm->control_fd_update (c->fd, MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_WRITE |
+			 MEMIF_FD_EVENT_MOD);
 
-  memset (&c->run_args, 0, sizeof (memif_conn_run_args_t));
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+
+error:
+  if (r->shm != NULL)
+    munmap (r->shm, r->region_size);
+  if (r->fd >= 0)
+    close (r->fd);
+  return err;
+}
 
-  memif_msg_queue_free (&c->msg_queue);
+int
+memif_region_ack (memif_connection_t * c)
+{
+  memif_queue_t *mq;
+  memif_region_t *r;
+  void *p;
+  int i;
 
-  if (!(c->args.is_master))
+  if (c->args.is_master)
+    return MEMIF_ERR_SUCCESS;	/* 0 */
+
+  /* peer acknowledges regions in order */
+  for (i = 0; i < c->regions_num; i++)
+    if (c->regions[i].pending)
+      break;
+  if (i == c->regions_num)
+    return MEMIF_ERR_SUCCESS;	/* 0 */
+
+  r = &c->regions[i];
+  mq = &c->rx_queues[r->qid];
+  p = realloc (mq->spare.free,
+	       sizeof (mq->spare.free[0]) * (mq->spare_size + r->num_buffers));
+  if (p == NULL)
+    return memif_syscall_error_handler (errno);
+  mq->spare.free = p;
+  mq->spare_size += r->num_buffers;
+  mq->spare.buffer_length = c->run_args.buffer_size;
+
+  r->pending = 0;
+  memif_spare_attach (c, i);
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+/* tx: restore formatted buffer of slot transmitted with data moved into
+   headroom or tailroom, unless peer exchanged buffer of the slot */
+static inline void
+memif_tx_slot_restore (memif_queue_t * mq, uint32_t slot)
+{
+  memif_buffer_origin_t *o = &mq->origin[slot];
+  memif_desc_t *d = &mq->ring->desc[slot];
+
+  if (o->buffer_length == 0)
+    return;
+  if ((d->region == o->region) && (d->offset == o->moved_offset))
     {
-      if (lm->disconn_slaves == 0)
-	{
-	  if (timerfd_settime (lm->timerfd, 0, &lm->arm, NULL) < 0)
-	    {
-	      err = memif_syscall_error_handler (errno);
-	      DBG_UNIX ("timerfd_settime: arm");
-	    }
-	}
-      lm->disconn_slaves++;
+      d->offset = o->offset;
+      d->buffer_length = o->buffer_length;
     }
-
-  return err;
+  o->buffer_length = 0;
+  mq->n_moved--;
 }
 
-int
-memif_delete (memif_conn_handle_t * conn)
+/* bytes data of buffer b were moved into headroom (push) and behind end
+   of buffer into tailroom (tail, single slot packets only),
+   returns -1 if data is outside of reserved space */
+static int
+memif_buffer_moved (memif_connection_t * c, memif_queue_t * mq,
+		    memif_buffer_t * b, uint16_t * push, uint16_t * tail)
 {
-  memif_connection_t *c = (memif_connection_t *) * conn;
-  if (c == NULL)
+  memif_desc_t *d = &mq->ring->desc[b->desc_index];
+  int64_t p = (uint8_t *) memif_get_buffer (c, mq->ring, b->desc_index) -
+    (uint8_t *) b->data;
+  int64_t t = (int64_t) b->data_len - p - b->buffer_len;
+
+  if (t < 0)
+    t = 0;
+  if ((p < 0) || (p > mq->headroom) || (t > mq->tailroom) ||
+      (t && (d->flags & MEMIF_DESC_FLAG_NEXT)))
     {
-      DBG ("no connection");
-      return MEMIF_ERR_NOCONN;
+      DBG ("buffer %u data outside of headroom/tailroom", b->desc_index);
+      return -1;
     }
-  libmemif_main_t *lm = &libmemif_main;
-  memif_list_elt_t *e = NULL;
-  memif_socket_t *ms = NULL;
+  *push = p;
+  *tail = t;
+  return 0;
+}
 
-  int err = MEMIF_ERR_SUCCESS;
+/* tx: move descriptor of slot with data by push/tail bytes, formatted
+   buffer is remembered until peer releases the slot */
+static void
+memif_tx_slot_move (memif_queue_t * mq, uint32_t slot, uint16_t push,
+		    uint16_t tail)
+{
+  memif_desc_t *d = &mq->ring->desc[slot];
+  memif_buffer_origin_t *o = &mq->origin[slot];
 
-  if (c->fd > 0)
+  if (o->buffer_length == 0)
     {
-      DBG ("DISCONNECTING");
-      err = memif_disconnect_internal (c);
-      if (err == MEMIF_ERR_NOCONN)
-	return err;
+      o->region = d->region;
+      o->offset = d->offset;
+      o->buffer_length = d->buffer_length;
+      mq->n_moved++;
     }
+  d->offset -= push;
+  d->buffer_length += push + tail;
+  o->moved_offset = d->offset;
+}
 
-  free_list_elt_ctx (lm->control_list, lm->control_list_len, c);
+/* tx: refresh cached peer tail, with buffer pools buffers of ring slots
+   released by peer return to pools, moved buffers are restored */
+static void
+memif_tx_refresh_tail (memif_queue_t * mq)
+{
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t tail = memif_ring_tail (mq);
+
+  if (mq->num_pools || mq->n_moved)
+    for (; mq->last_tail != tail; mq->last_tail = (mq->last_tail + 1) & mask)
+      {
+	if (mq->n_moved)
+	  memif_tx_slot_restore (mq, mq->last_tail);
+	if (mq->num_pools)
+	  memif_pool_put (mq, &mq->ring->desc[mq->last_tail]);
+      }
+  mq->last_tail = tail;
+}
 
-  if (c->args.is_master)
+/* tx: free ring slots not allocated yet */
+static inline uint32_t
+memif_tx_free_slots (memif_queue_t * mq)
+{
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  /* one slot is always left empty */
+  uint32_t ns = (mq->last_tail - mq->last_head - 1) & mask;
+  return (ns > mq->alloc_bufs) ? ns - mq->alloc_bufs : 0;
+}
+
+/* tx: prepare ring slots starting at slot for packet of size bytes,
+   with buffer pools smallest free buffer fitting size is attached, buffers
+   of largest class with enough free buffers are chained otherwise,
+   returns number of slots used, 0 if there is not enough free slots */
+static uint16_t
+memif_tx_slots_alloc (memif_queue_t * mq, uint32_t slot, uint32_t size,
+		      uint32_t ns)
+{
+  memif_ring_t *ring = mq->ring;
+  memif_desc_t *d0;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t buffer_length;
+  uint16_t nseg = 0;
+  int i, k = -1;
+
+  if (mq->num_pools == 0)
     {
-      get_list_elt (&e, lm->listener_list, lm->listener_list_len,
-		    c->listener_fd);
-      if (e != NULL)
-	{
-	  ms = (memif_socket_t *) e->data_struct;
-	  ms->use_count--;
-	  free_list_elt (ms->interface_list, ms->interface_list_len,
-			 c->args.interface_id);
-	  if (ms->use_count <= 0)
-	    {
-	      lm->control_fd_update (c->listener_fd, MEMIF_FD_EVENT_DEL);
-	      free_list_elt (lm->listener_list, lm->listener_list_len,
-			     c->listener_fd);
-	      close (c->listener_fd);
-	      c->listener_fd = ms->fd = -1;
-	      free (ms->interface_list);
-	      ms->interface_list = NULL;
-	      free (ms->filename);
-	      ms->filename = NULL;
-	      free (ms);
-	      ms = NULL;
-	    }
-	}
+      buffer_length = ring->desc[slot].buffer_length;
+      nseg = (size <= buffer_length) ? 1 :
+	(size + buffer_length - 1) / buffer_length;
     }
   else
     {
-      lm->disconn_slaves--;
-      if (lm->disconn_slaves <= 0)
+      for (i = 0; i < mq->num_pools; i++)
+	if (mq->pools[i].n_free && (mq->pools[i].buffer_length >= size))
+	  {
+	    k = i;
+	    nseg = 1;
+	    break;
+	  }
+      for (i = mq->num_pools - 1; (k < 0) && (i >= 0); i--)
 	{
-	  if (timerfd_settime (lm->timerfd, 0, &lm->disarm, NULL) < 0)
-	    {
-	      err = memif_syscall_error_handler (errno);
-	      DBG ("timerfd_settime: disarm");
-	    }
+	  buffer_length = mq->pools[i].buffer_length;
+	  nseg = (size + buffer_length - 1) / buffer_length;
+	  if (mq->pools[i].n_free >= nseg)
+	    k = i;
 	}
+      if (k < 0)
+	return 0;
     }
 
-  if (c->args.socket_filename)
-    free (c->args.socket_filename);
-  c->args.socket_filename = NULL;
+  if (nseg > ns)
+    return 0;
 
-  free (c);
-  c = NULL;
+  for (i = 0; i < nseg; i++)
+    {
+      d0 = &ring->desc[(slot + i) & mask];
+      if (k >= 0)
+	memif_pool_get (&mq->pools[k], d0);
+      d0->flags = (i < nseg - 1) ? MEMIF_DESC_FLAG_NEXT : 0;
+    }
 
-  *conn = c;
-  return err;
+  return nseg;
 }
 
-int
-memif_connect1 (memif_connection_t * c)
+/* memif_buffer_alloc for tx ring with buffer pools */
+static int
+memif_buffer_alloc_pool (memif_connection_t * c, memif_queue_t * mq,
+			 memif_buffer_t * bufs, uint16_t count,
+			 uint16_t * count_out, uint32_t size)
 {
-  libmemif_main_t *lm = &libmemif_main;
-  memif_region_t *mr = c->regions;
-  memif_queue_t *mq;
-  int i;
-  uint16_t num;
+  memif_ring_t *ring = mq->ring;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t s0, ns;
+  uint16_t n;
+  memif_buffer_t *b0;
 
-  if (mr != NULL)
+  ns = memif_tx_free_slots (mq);
+  if (ns < count)
     {
-      if (!mr->shm)
-	{
-	  if (mr->fd < 0)
-	    return MEMIF_ERR_NO_SHMFD;
-
-	  if ((mr->shm = mmap (NULL, mr->region_size, PROT_READ | PROT_WRITE,
-			       MAP_SHARED, mr->fd, 0)) == MAP_FAILED)
-	    {
-	      return memif_syscall_error_handler (errno);
-	    }
-	}
+      memif_tx_refresh_tail (mq);
+      ns = memif_tx_free_slots (mq);
     }
 
-  num =
-    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
-    num_s2m_rings;
-  for (i = 0; i < num; i++)
-    {
-      mq = &c->tx_queues[i];
-      if (mq != NULL)
-	{
-	  mq->ring = c->regions[mq->region].shm + mq->offset;
-	  if (mq->ring->cookie != MEMIF_COOKIE)
-	    {
-	      DBG ("wrong cookie on tx ring %u", i);
-	      return MEMIF_ERR_COOKIE;
-	    }
-	  mq->ring->head = mq->ring->tail = mq->last_head = mq->alloc_bufs =
-	    0;
-	}
-    }
-  num =
-    (c->args.is_master) ? c->run_args.num_s2m_rings : c->run_args.
-    num_m2s_rings;
-  for (i = 0; i < num; i++)
+  while (count)
     {
-      mq = &c->rx_queues[i];
-      if (mq != NULL)
+      s0 = (mq->last_head + mq->alloc_bufs) & mask;
+      if ((n = memif_tx_slots_alloc (mq, s0, size, ns)) == 0)
 	{
-	  mq->ring = c->regions[mq->region].shm + mq->offset;
-	  if (mq->ring->cookie != MEMIF_COOKIE)
-	    {
-	      DBG ("wrong cookie on rx ring %u", i);
-	      return MEMIF_ERR_COOKIE;
-	    }
-	  mq->ring->head = mq->ring->tail = mq->last_head = mq->alloc_bufs =
-	    0;
+	  /* pools may be refilled by slots released by peer */
+	  memif_tx_refresh_tail (mq);
+	  ns = memif_tx_free_slots (mq);
+	  if ((n = memif_tx_slots_alloc (mq, s0, size, ns)) == 0)
+	    break;
 	}
-    }
-
-  lm->control_fd_update (c->fd, MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_MOD);
 
-  return 0;
-}
+      b0 = (bufs + *count_out);
+      b0->desc_index = s0;
+      b0->buffer_len = ring->desc[s0].buffer_length * n;
+      b0->data = memif_get_buffer (c, ring, s0);
 
-int
-memif_init_regions_and_queues (memif_connection_t * conn)
-{
-  memif_ring_t *ring = NULL;
-  uint64_t buffer_offset;
-  memif_region_t *r;
-  int i, j;
-  libmemif_main_t *lm = &libmemif_main;
-  memif_list_elt_t e;
+      mq->alloc_bufs += n;
+      ns -= n;
+      count--;
+      *count_out += 1;
+    }
 
-  conn->regions = (memif_region_t *) malloc (sizeof (memif_region_t));
-  if (conn->regions == NULL)
-    return memif_syscall_error_handler (errno);
-  r = conn->regions;
+  DBG ("allocated: %u bufs. Total %u allocated bufs", *count_out,
+       mq->alloc_bufs);
 
-  buffer_offset =
-    (conn->run_args.num_s2m_rings +
-     conn->run_args.num_m2s_rings) * (sizeof (memif_ring_t) +
-				      sizeof (memif_desc_t) *
-				      (1 << conn->run_args.log2_ring_size));
+  if (count)
+    {
+      DBG ("ring buffer full!");
+      return MEMIF_ERR_NOBUF_RING;
+    }
 
-  r->region_size = buffer_offset +
-    conn->run_args.buffer_size * (1 << conn->run_args.log2_ring_size) *
-    (conn->run_args.num_s2m_rings + conn->run_args.num_m2s_rings);
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
 
-  if ((r->fd = memfd_create ("memif region 0", MFD_ALLOW_SEALING)) == -1)
-    return memif_syscall_error_handler (errno);
-/*
-    if ((fcntl (r->fd, F_ADD_SEALS, F_SEAL_SHRINK)) == -1)
-        return memif_syscall_error_handler (errno);
-*/
-  if ((ftruncate (r->fd, r->region_size)) == -1)
-    return memif_syscall_error_handler (errno);
+int
+memif_buffer_alloc_single (memif_conn_handle_t conn, uint16_t qid,
+			   memif_buffer_t * bufs, uint16_t count,
+			   uint16_t * count_out)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
+    num_s2m_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  memif_queue_t *mq = &c->tx_queues[qid];
+  memif_ring_t *ring = mq->ring;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t slot, ns;
+  uint16_t n, i;
 
-  if ((r->shm = mmap (NULL, r->region_size, PROT_READ | PROT_WRITE,
-		      MAP_SHARED, r->fd, 0)) == MAP_FAILED)
-    return memif_syscall_error_handler (errno);
+  /* buffers of different sizes */
+  if (mq->buffer_size == 0)
+    return memif_buffer_alloc (conn, qid, bufs, count, count_out, 0);
 
-  for (i = 0; i < conn->run_args.num_s2m_rings; i++)
+  ns = memif_tx_free_slots (mq);
+  if (ns < count)
     {
-      ring = memif_get_ring (conn, MEMIF_RING_S2M, i);
-      DBG ("RING: %p I: %d", ring, i);
-      ring->head = ring->tail = 0;
-      ring->cookie = MEMIF_COOKIE;
-      ring->flags = 0;
-      for (j = 0; j < (1 << conn->run_args.log2_ring_size); j++)
-	{
-	  uint16_t slot = i * (1 << conn->run_args.log2_ring_size) + j;
-	  ring->desc[j].region = 0;
-	  ring->desc[j].offset = buffer_offset +
-	    (uint32_t) (slot * conn->run_args.buffer_size);
-	  ring->desc[j].buffer_length = conn->run_args.buffer_size;
-	}
+      memif_tx_refresh_tail (mq);
+      ns = memif_tx_free_slots (mq);
     }
-  for (i = 0; i < conn->run_args.num_m2s_rings; i++)
+
+  n = memif_min (count, ns);
+  slot = (mq->last_head + mq->alloc_bufs) & mask;
+  for (i = 0; i < n; i++)
     {
-      ring = memif_get_ring (conn, MEMIF_RING_M2S, i);
-      DBG ("RING: %p I: %d", ring, i);
-      ring->head = ring->tail = 0;
-      ring->cookie = MEMIF_COOKIE;
-      ring->flags = 0;
-      for (j = 0; j < (1 << conn->run_args.log2_ring_size); j++)
-	{
-	  uint16_t slot =
-	    (i +
-	     conn->run_args.num_s2m_rings) *
-	    (1 << conn->run_args.log2_ring_size) + j;
-	  ring->desc[j].region = 0;
-	  ring->desc[j].offset = buffer_offset +
-	    (uint32_t) (slot * conn->run_args.buffer_size);
-	  ring->desc[j].buffer_length = conn->run_args.buffer_size;
-	}
+      ring->desc[slot].flags = 0;
+      bufs[i].desc_index = slot;
+      bufs[i].buffer_len = mq->buffer_size;
+      bufs[i].data = memif_get_buffer (c, ring, slot);
+      slot = (slot + 1) & mask;
     }
-  memif_queue_t *mq;
-  mq =
-    (memif_queue_t *) malloc (sizeof (memif_queue_t) *
-			      conn->run_args.num_s2m_rings);
-  if (mq == NULL)
-    return memif_syscall_error_handler (errno);
-  int x;
-  for (x = 0; x < conn->run_args.num_s2m_rings; x++)
-    {
-      if ((mq[x].int_fd = eventfd (0, EFD_NONBLOCK)) < 0)
-	return memif_syscall_error_handler (errno);
-      /* add int fd to interrupt fd list */
-      e.key = mq[x].int_fd;
-      e.data_struct = conn;
-      add_list_elt (&e, &lm->interrupt_list, &lm->interrupt_list_len);
 
-      mq[x].ring = memif_get_ring (conn, MEMIF_RING_S2M, x);
-      DBG ("RING: %p I: %d", mq[x].ring, x);
-      mq[x].log2_ring_size = conn->run_args.log2_ring_size;
-      mq[x].region = 0;
-      mq[x].offset =
-	(void *) mq[x].ring - (void *) conn->regions[mq->region].shm;
-      mq[x].last_head = 0;
-      mq[x].alloc_bufs = 0;
-    }
-  conn->tx_queues = mq;
+  mq->alloc_bufs += n;
+  *count_out = n;
 
-  mq =
-    (memif_queue_t *) malloc (sizeof (memif_queue_t) *
-			      conn->run_args.num_m2s_rings);
-  if (mq == NULL)
-    return memif_syscall_error_handler (errno);
-  for (x = 0; x < conn->run_args.num_m2s_rings; x++)
+  if (n < count)
     {
-      if ((mq[x].int_fd = eventfd (0, EFD_NONBLOCK)) < 0)
-	return memif_syscall_error_handler (errno);
-      /* add int fd to interrupt fd list */
-      e.key = mq[x].int_fd;
-      e.data_struct = conn;
-      add_list_elt (&e, &lm->interrupt_list, &lm->interrupt_list_len);
-
-      mq[x].ring = memif_get_ring (conn, MEMIF_RING_M2S, x);
-      DBG ("RING: %p I: %d", mq[x].ring, x);
-      mq[x].log2_ring_size = conn->run_args.log2_ring_size;
-      mq[x].region = 0;
-      mq[x].offset =
-	(void *) mq[x].ring - (void *) conn->regions[mq->region].shm;
-      mq[x].last_head = 0;
-      mq[x].alloc_bufs = 0;
+      DBG ("ring buffer full! qid: %u", qid);
+      return MEMIF_ERR_NOBUF_RING;
     }
-  conn->rx_queues = mq;
 
-  return 0;
+  return MEMIF_ERR_SUCCESS;	/* 0 */
 }
 
 int
@@ -1356,29 +3238,33 @@ memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
   memif_ring_t *ring = mq->ring;
   memif_buffer_t *b0, *b1;
   uint8_t chain_buf0, chain_buf1;
-  uint16_t mask = (1 << mq->log2_ring_size) - 1;
-  uint16_t s0, s1, ns;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t head = mq->last_head;
+  uint32_t s0, s1, ns;
   *count_out = 0;
   int i, err = MEMIF_ERR_SUCCESS;	/* 0 */
 
-  if (ring->tail != ring->head)
+  if (mq->buffer_size && (size <= mq->buffer_size))
+    return memif_buffer_alloc_single (conn, qid, bufs, count, count_out);
+  if (mq->num_pools)
+    return memif_buffer_alloc_pool (c, mq, bufs, count, count_out,
+				    (size) ? size : c->run_args.buffer_size);
+
+  /* (head == tail) ? receive function will asume that no packets are available,
+     so one slot is always left empty */
+  ns = (mq->last_tail - head - 1) & mask;
+  /* cached peer tail is only refreshed if cached view says ring is full */
+  if (ns < count)
     {
-      if (ring->head > ring->tail)
-	ns = (1 << mq->log2_ring_size) - ring->head + ring->tail;
-      else
-	ns = ring->tail - ring->head;
+      memif_tx_refresh_tail (mq);
+      ns = (mq->last_tail - head - 1) & mask;
     }
-  else
-    ns = (1 << mq->log2_ring_size);
-
-  /* (head == tail) ? receive function will asume that no packets are available */
-  ns -= 1;
 
   while (count && ns)
     {
       while ((count > 2) && (ns > 2))
 	{
-	  s0 = (ring->head + mq->alloc_bufs) & mask;
+	  s0 = (head + mq->alloc_bufs) & mask;
 	  chain_buf0 = size / ring->desc[s0].buffer_length;
 	  if (((size % ring->desc[s0].buffer_length) != 0) || (size == 0))
 	    chain_buf0++;
@@ -1386,7 +3272,7 @@ memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
 	  if (chain_buf0 > ns)
 	    break;
 
-	  s1 = (ring->head + mq->alloc_bufs + chain_buf0) & mask;
+	  s1 = (head + mq->alloc_bufs + chain_buf0) & mask;
 	  chain_buf1 = size / ring->desc[s1].buffer_length;
 	  if (((size % ring->desc[s1].buffer_length) != 0) || (size == 0))
 	    chain_buf1++;
@@ -1403,9 +3289,8 @@ memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
 	  ring->desc[s1].flags = 0;
 	  b0->buffer_len = ring->desc[s0].buffer_length * chain_buf0;
 	  b1->buffer_len = ring->desc[s1].buffer_length * chain_buf1;
-	  /* TODO: support multiple regions -> ring descriptor contains region index */
-	  b0->data = c->regions->shm + ring->desc[s0].offset;
-	  b1->data = c->regions->shm + ring->desc[s1].offset;
+	  b0->data = memif_get_buffer (c, ring, s0);
+	  b1->data = memif_get_buffer (c, ring, s1);
 
 	  for (i = 0; i < (memif_min (chain_buf0, chain_buf1) - 1); i++)
 	    {
@@ -1432,7 +3317,7 @@ memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
 	  ns -= chain_buf0 + chain_buf1;
 	  *count_out += 2;
 	}
-      s0 = (ring->head + mq->alloc_bufs) & mask;
+      s0 = (head + mq->alloc_bufs) & mask;
 
       b0 = (bufs + *count_out);
 
@@ -1446,7 +3331,7 @@ memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
       b0->desc_index = s0;
       ring->desc[s0].flags = 0;
       b0->buffer_len = ring->desc[s0].buffer_length * chain_buf0;
-      b0->data = c->regions->shm + ring->desc[s0].offset;
+      b0->data = memif_get_buffer (c, ring, s0);
 
       for (i = 0; i < (chain_buf0 - 1); i++)
 	{
@@ -1474,6 +3359,158 @@ memif_buffer_alloc (memif_conn_handle_t conn, uint16_t qid,
   return err;
 }
 
+int
+memif_queue_done_init (memif_queue_t * mq)
+{
+  mq->done = calloc (((1 << mq->log2_ring_size) + 63) / 64,
+		     sizeof (uint64_t));
+  mq->done_pending = 0;
+  return (mq->done == NULL) ? -1 : 0;
+}
+
+/* release nslots rx ring slots starting at slot, slots freed ahead of tail
+   are marked in completion bitmap, tail (mq->last_tail) advances only over
+   contiguous freed slots */
+static void
+memif_rx_complete (memif_queue_t * mq, uint32_t slot, uint16_t nslots)
+{
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t tail = mq->last_tail;
+  uint64_t w, m;
+  int i, off, n;
+
+  if ((slot != tail) || (mq->done == NULL))
+    {
+      /* out of order, tail stays */
+      if (mq->done == NULL)
+	{
+	  mq->last_tail = (slot + nslots) & mask;
+	  return;
+	}
+      for (i = 0; i < nslots; i++)
+	{
+	  n = (slot + i) & mask;
+	  mq->done[n >> 6] |= 1ULL << (n & 63);
+	}
+      mq->done_pending += nslots;
+      return;
+    }
+
+  tail = (tail + nslots) & mask;
+
+  /* consume slots freed earlier */
+  while (mq->done_pending)
+    {
+      off = tail & 63;
+      w = ~(mq->done[tail >> 6] >> off);
+      n = (w) ? __builtin_ctzll (w) : 64;
+      if (n == 0)
+	break;
+      m = (n == 64) ? ~0ULL : ((1ULL << n) - 1);
+      mq->done[tail >> 6] &= ~(m << off);
+      tail = (tail + n) & mask;
+      mq->done_pending -= n;
+    }
+
+  mq->last_tail = tail;
+}
+
+/* rx: application holds more than half of ring slots, exchange ring
+   buffers of oldest held packets for spare buffers and release their
+   slots, so peer can keep transmitting, application keeps its buffers */
+static void
+memif_rx_detach (memif_connection_t * c, memif_queue_t * mq)
+{
+  memif_ring_t *ring = mq->ring;
+  uint32_t high = (1 << mq->log2_ring_size) / 2;
+  memif_desc_t *d;
+
+  while ((mq->alloc_bufs > high) && (mq->last_tail != mq->last_head))
+    {
+      d = &ring->desc[mq->last_tail];
+      /* chained packet stays in ring */
+      if (d->flags & MEMIF_DESC_FLAG_NEXT)
+	break;
+      if ((mq->spare.n_free == 0) && (memif_spare_reattach (c, mq) < 0))
+	break;
+      memif_spare_get (c, mq, d);
+      memif_rx_complete (mq, mq->last_tail, 1);
+      mq->alloc_bufs--;
+      mq->n_detached++;
+    }
+
+  MEMIF_MEORY_BARRIER ();
+  memif_ring_set_tail (mq, mq->last_tail);
+}
+
+/* region containing buffer, -1 if there is none */
+static int
+memif_buffer_region (memif_connection_t * c, void *data)
+{
+  memif_region_t *r;
+  int i;
+
+  for (i = 0; i < c->regions_num; i++)
+    {
+      r = &c->regions[i];
+      if ((r->shm != NULL) && (data >= r->shm) &&
+	  (data < r->shm + r->region_size))
+	return i;
+    }
+  return -1;
+}
+
+/* rx queue with spare buffers: detached buffers return to spare pool,
+   others release their ring slots */
+static int
+memif_buffer_free_spare (memif_connection_t * c, memif_queue_t * mq,
+			 memif_buffer_t * bufs, uint16_t count,
+			 uint16_t * count_out)
+{
+  memif_ring_t *ring = mq->ring;
+  uint8_t chain_buf0;
+  memif_buffer_t *b0;
+  int r;
+
+  for (; *count_out < count; *count_out += 1)
+    {
+      b0 = bufs + *count_out;
+      /* ring slot of detached buffer holds spare buffer */
+      if (b0->data != memif_get_buffer (c, ring, b0->desc_index))
+	{
+	  if ((mq->n_detached == 0) ||
+	      ((r = memif_buffer_region (c, b0->data)) < 0))
+	    break;
+	  memif_spare_put (c, mq, r, b0->data - c->regions[r].shm);
+	  mq->n_detached--;
+	}
+      else
+	{
+	  if (mq->alloc_bufs == 0)
+	    break;
+	  chain_buf0 =
+	    b0->buffer_len / ring->desc[b0->desc_index].buffer_length;
+	  if ((b0->buffer_len % ring->desc[b0->desc_index].buffer_length) !=
+	      0)
+	    chain_buf0++;
+	  memif_rx_complete (mq, b0->desc_index, chain_buf0);
+	  mq->alloc_bufs -= chain_buf0;
+	}
+      b0->data = NULL;
+    }
+
+  /* pressure dropped */
+  if ((mq->n_detached == 0) &&
+      (mq->alloc_bufs <= (uint32_t) (1 << mq->log2_ring_size) / 4))
+    memif_spare_release (c, mq);
+
+  MEMIF_MEORY_BARRIER ();
+  memif_ring_set_tail (mq, mq->last_tail);
+  DBG ("tail: %u", mq->last_tail);
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
 int
 memif_buffer_free (memif_conn_handle_t conn, uint16_t qid,
 		   memif_buffer_t * bufs, uint16_t count,
@@ -1492,12 +3529,13 @@ memif_buffer_free (memif_conn_handle_t conn, uint16_t qid,
   libmemif_main_t *lm = &libmemif_main;
   memif_queue_t *mq = &c->rx_queues[qid];
   memif_ring_t *ring = mq->ring;
-  uint16_t tail = ring->tail;
-  uint16_t mask = (1 << mq->log2_ring_size) - 1;
   uint8_t chain_buf0, chain_buf1;
   memif_buffer_t *b0, *b1;
   *count_out = 0;
 
+  if (mq->spare.free != NULL)
+    return memif_buffer_free_spare (c, mq, bufs, count, count_out);
+
   if (mq->alloc_bufs < count)
     count = mq->alloc_bufs;
 
@@ -1517,7 +3555,8 @@ memif_buffer_free (memif_conn_handle_t conn, uint16_t qid,
 	  if ((b1->buffer_len % ring->desc[b1->desc_index].buffer_length) !=
 	      0)
 	    chain_buf1++;
-	  tail = (b1->desc_index + chain_buf1) & mask;
+	  memif_rx_complete (mq, b0->desc_index, chain_buf0);
+	  memif_rx_complete (mq, b1->desc_index, chain_buf1);
 	  b0->data = NULL;
 	  b1->data = NULL;
 
@@ -1529,7 +3568,7 @@ memif_buffer_free (memif_conn_handle_t conn, uint16_t qid,
       chain_buf0 = b0->buffer_len / ring->desc[b0->desc_index].buffer_length;
       if ((b0->buffer_len % ring->desc[b0->desc_index].buffer_length) != 0)
 	chain_buf0++;
-      tail = (b0->desc_index + chain_buf0) & mask;
+      memif_rx_complete (mq, b0->desc_index, chain_buf0);
       b0->data = NULL;
 
       count--;
@@ -1537,8 +3576,8 @@ memif_buffer_free (memif_conn_handle_t conn, uint16_t qid,
       mq->alloc_bufs -= chain_buf0;
     }
   MEMIF_MEORY_BARRIER ();
-  ring->tail = tail;
-  DBG ("tail: %u", ring->tail);
+  memif_ring_set_tail (mq, mq->last_tail);
+  DBG ("tail: %u", mq->last_tail);
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -1559,14 +3598,33 @@ memif_tx_burst (memif_conn_handle_t conn, uint16_t qid,
     return MEMIF_ERR_QID;
   memif_queue_t *mq = &c->tx_queues[qid];
   memif_ring_t *ring = mq->ring;
-  uint16_t head = ring->head;
-  uint16_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t head = mq->last_head;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
   uint8_t chain_buf0, chain_buf1;
   *tx = 0;
   uint16_t curr_buf = 0;
   memif_buffer_t *b0, *b1;
+  uint16_t push, tail, n;
   int i;
 
+  /* data moved into headroom/tailroom, all buffers are validated
+     before any descriptor is moved */
+  for (i = 0; (mq->origin != NULL) && (i < count); i++)
+    if (memif_buffer_moved (c, mq, bufs + i, &push, &tail) < 0)
+      return MEMIF_ERR_INVAL_ARG;
+  for (i = 0; (mq->origin != NULL) && (i < count); i++)
+    {
+      b0 = bufs + i;
+      memif_buffer_moved (c, mq, b0, &push, &tail);
+      if ((push == 0) && (tail == 0))
+	continue;
+      n = (b0->buffer_len + ring->desc[b0->desc_index].buffer_length - 1) /
+	ring->desc[b0->desc_index].buffer_length;
+      memif_tx_slot_move (mq, b0->desc_index, push, tail);
+      /* number of slots is derived from length of first slot */
+      b0->buffer_len = n * ring->desc[b0->desc_index].buffer_length;
+    }
+
   while (count)
     {
       while (count > 2)
@@ -1746,22 +3804,246 @@ memif_tx_burst (memif_conn_handle_t conn, uint16_t qid,
       curr_buf++;
     }
   MEMIF_MEORY_BARRIER ();
-  ring->head = head;
+  mq->last_head = head;
+  memif_ring_set_head (mq, head);
+
+  mq->alloc_bufs -= *tx;
+
+  /* TODO: return num of buffers and packets */
+  *tx = curr_buf;
+
+  return memif_tx_interrupt (mq, curr_buf);
+}
+
+/* clear interrupt, refresh cached peer head and return number of
+   descriptors ready to receive */
+static int
+memif_rx_prepare (memif_connection_t * c, memif_queue_t * mq,
+		  uint16_t count, uint32_t * ns)
+{
+  memif_ring_t *ring = mq->ring;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t head = mq->cached_head;
+
+  /* interrupt may be pending even with interrupts masked, peer could
+     see them unmasked just before they were masked */
+  uint64_t b;
+  ssize_t r = read (mq->int_fd, &b, sizeof (b));
+  if ((r == -1) && (errno != EAGAIN))
+    return memif_syscall_error_handler (errno);
+
+  /* cached peer head is only refreshed if cached view says ring is empty
+     or doesn't hold enough buffers */
+  *ns = (head - mq->last_head) & mask;
+  if (*ns < count)
+    {
+      head = mq->cached_head = memif_ring_head (mq);
+      *ns = (head - mq->last_head) & mask;
+    }
+
+  if (mq->rx_mode == MEMIF_RX_MODE_ADAPTIVE)
+    {
+      if (*ns == 0)
+	{
+	  if (memif_rx_adaptive_idle (c, mq))
+	    *ns = (mq->cached_head - mq->last_head) & mask;
+	}
+      else
+	{
+	  mq->empty_polls = 0;
+	  /* woken up by interrupt, back to polling */
+	  if ((ring->flags & MEMIF_RING_FLAG_MASK_INT) == 0)
+	    ring->flags |= MEMIF_RING_FLAG_MASK_INT;
+	}
+    }
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+/* copy packet data to shared memory buffer, large copies use non-temporal
+   stores so that outbound payload doesn't pollute cache,
+   returns 1 if non-temporal stores were used (caller must fence) */
+static inline int
+memif_copy_to_buffer (void *dst, const void *src, uint32_t len)
+{
+#ifdef __SSE2__
+  uint32_t pre;
+
+  if (len < MEMIF_COPY_NT_THRESHOLD)
+    {
+      memcpy (dst, src, len);
+      return 0;
+    }
+
+  /* align destination to 16 bytes */
+  pre = (16 - ((uintptr_t) dst & 15)) & 15;
+  memcpy (dst, src, pre);
+  dst += pre;
+  src += pre;
+  len -= pre;
+
+  while (len >= 64)
+    {
+      __m128i x0 = _mm_loadu_si128 ((const __m128i *) src);
+      __m128i x1 = _mm_loadu_si128 ((const __m128i *) (src + 16));
+      __m128i x2 = _mm_loadu_si128 ((const __m128i *) (src + 32));
+      __m128i x3 = _mm_loadu_si128 ((const __m128i *) (src + 48));
+      _mm_stream_si128 ((__m128i *) dst, x0);
+      _mm_stream_si128 ((__m128i *) (dst + 16), x1);
+      _mm_stream_si128 ((__m128i *) (dst + 32), x2);
+      _mm_stream_si128 ((__m128i *) (dst + 48), x3);
+      dst += 64;
+      src += 64;
+      len -= 64;
+    }
+  while (len >= 16)
+    {
+      _mm_stream_si128 ((__m128i *) dst,
+			_mm_loadu_si128 ((const __m128i *) src));
+      dst += 16;
+      src += 16;
+      len -= 16;
+    }
+  memcpy (dst, src, len);
+  return 1;
+#else
+  memcpy (dst, src, len);
+  return 0;
+#endif /* __SSE2__ */
+}
+
+int
+memif_tx_burst_copy (memif_conn_handle_t conn, uint16_t qid,
+		     const struct iovec *pkts, uint16_t count, uint16_t * tx)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
+    num_s2m_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  memif_queue_t *mq = &c->tx_queues[qid];
+  memif_ring_t *ring = mq->ring;
+  memif_desc_t *d0;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t head = mq->last_head;
+  uint32_t ns;
+  uint16_t nseg;
+  uint32_t len, off;
+  int i, err, nt = 0;
+  *tx = 0;
+
+  /* slots allocated by memif_buffer_alloc would be published with head */
+  if (mq->alloc_bufs)
+    return MEMIF_ERR_INVAL_ARG;
+
+  ns = memif_tx_free_slots (mq);
+
+  while (*tx < count)
+    {
+      len = pkts[*tx].iov_len;
+      if ((nseg = memif_tx_slots_alloc (mq, head, len, ns)) == 0)
+	{
+	  /* cached peer tail is only refreshed if cached view says ring
+	     is full */
+	  memif_tx_refresh_tail (mq);
+	  ns = (mq->last_tail - head - 1) & mask;
+	  if ((nseg = memif_tx_slots_alloc (mq, head, len, ns)) == 0)
+	    break;
+	}
+
+      for (i = 0, off = 0; i < nseg; i++)
+	{
+	  d0 = &ring->desc[head];
+	  d0->length = memif_min (len - off, d0->buffer_length);
+	  nt |= memif_copy_to_buffer (memif_get_buffer (c, ring, head),
+				      pkts[*tx].iov_base + off, d0->length);
+	  off += d0->length;
+	  head = (head + 1) & mask;
+	}
+
+      ns -= nseg;
+      *tx += 1;
+    }
+
+#ifdef __SSE2__
+  /* non-temporal stores are weakly ordered, make payload visible
+     before head */
+  if (nt)
+    _mm_sfence ();
+#endif /* __SSE2__ */
+  MEMIF_MEORY_BARRIER ();
+  mq->last_head = head;
+  memif_ring_set_head (mq, head);
+
+  DBG ("transmitted %u/%u packets", *tx, count);
+
+  if ((err = memif_tx_interrupt (mq, *tx)) != MEMIF_ERR_SUCCESS)
+    return err;
+
+  if (*tx < count)
+    {
+      DBG ("ring buffer full! qid: %u", qid);
+      return MEMIF_ERR_NOBUF_RING;
+    }
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+/* fill buffers from consecutive descriptors starting at ring slot head,
+   descriptors are scanned in blocks of MEMIF_RX_VECTOR_SIZE so that
+   flag check and buffer fill can be vectorized, stops at first descriptor
+   starting a chain (caller makes sure that n does not cross ring end)
+   returns number of filled buffers */
+MEMIF_TARGET_CLONES static uint16_t
+memif_rx_burst_nochain (memif_connection_t * c, memif_ring_t * ring,
+			uint32_t head, memif_buffer_t * bufs, uint16_t n)
+{
+  memif_desc_t *d = &ring->desc[head];
+  uint16_t flags;
+  uint16_t i = 0;
+  int j;
+
+  while ((n - i) >= MEMIF_RX_VECTOR_SIZE)
+    {
+      flags = 0;
+      for (j = 0; j < MEMIF_RX_VECTOR_SIZE; j++)
+	flags |= d[j].flags;
+      if (flags & MEMIF_DESC_FLAG_NEXT)
+	break;
 
-  mq->alloc_bufs -= *tx;
+      for (j = 0; j < MEMIF_RX_VECTOR_SIZE; j++)
+	{
+	  bufs[j].desc_index = head + j;
+	  bufs[j].buffer_len = d[j].buffer_length;
+	  bufs[j].data_len = d[j].length;
+	  bufs[j].data = c->regions[d[j].region].shm + d[j].offset;
+	}
 
-  /* TODO: return num of buffers and packets */
-  *tx = curr_buf;
+      d += MEMIF_RX_VECTOR_SIZE;
+      bufs += MEMIF_RX_VECTOR_SIZE;
+      head += MEMIF_RX_VECTOR_SIZE;
+      i += MEMIF_RX_VECTOR_SIZE;
+    }
 
-  if ((ring->flags & MEMIF_RING_FLAG_MASK_INT) == 0)
+  /* remainder or block containing chain */
+  while ((i < n) && ((d->flags & MEMIF_DESC_FLAG_NEXT) == 0))
     {
-      uint64_t a = 1;
-      int r = write (mq->int_fd, &a, sizeof (a));
-      if (r < 0)
-	return MEMIF_ERR_INT_WRITE;
+      bufs->desc_index = head;
+      bufs->buffer_len = d->buffer_length;
+      bufs->data_len = d->length;
+      bufs->data = c->regions[d->region].shm + d->offset;
+      d++;
+      bufs++;
+      head++;
+      i++;
     }
 
-  return MEMIF_ERR_SUCCESS;	/* 0 */
+  return i;
 }
 
 int
@@ -1780,102 +4062,38 @@ memif_rx_burst (memif_conn_handle_t conn, uint16_t qid,
     return MEMIF_ERR_QID;
   memif_queue_t *mq = &c->rx_queues[qid];
   memif_ring_t *ring = mq->ring;
-  uint16_t head = ring->head;
-  uint16_t ns;
-  uint16_t mask = (1 << mq->log2_ring_size) - 1;
-  memif_buffer_t *b0, *b1;
+  uint32_t ns;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  memif_buffer_t *b0;
   uint16_t curr_buf = 0;
+  uint16_t n;
   *rx = 0;
-  int i;
-
-  uint64_t b;
-  ssize_t r = read (mq->int_fd, &b, sizeof (b));
-  if ((r == -1) && (errno != EAGAIN))
-    return memif_syscall_error_handler (errno);
+  int i, err;
 
-  if (head == mq->last_head)
+  if ((err = memif_rx_prepare (c, mq, count, &ns)) != MEMIF_ERR_SUCCESS)
+    return err;
+  if (ns == 0)
     return 0;
 
-  if (head > mq->last_head)
-    ns = head - mq->last_head;
-  else
-    ns = (1 << mq->log2_ring_size) - mq->last_head + head;
-
   while (ns && count)
     {
       DBG ("ns: %u, count: %u", ns, count);
-      while ((ns > 2) && (count > 2))
-	{
-	  b0 = (bufs + curr_buf);
-	  b1 = (bufs + curr_buf + 1);
-
-	  b0->desc_index = mq->last_head;
-	  i = 0;
-	  b0->data_len = 0;
-	  b0->buffer_len = 0;
-
-	  b0->data = memif_get_buffer (conn, ring, mq->last_head);
-	  b0->data_len += ring->desc[mq->last_head].length;
-	  b0->buffer_len += ring->desc[mq->last_head].buffer_length;
-#ifdef MEMIF_DBG_SHM
-	  print_bytes (b0->data +
-		       ring->desc[b0->desc_index].buffer_length * i++,
-		       ring->desc[b0->desc_index].buffer_length, DBG_TX_BUF);
-#endif /* MEMIF_DBG_SHM */
-	  ns--;
-	  *rx += 1;
-	  while (ring->desc[mq->last_head].flags & MEMIF_DESC_FLAG_NEXT)
-	    {
-	      ring->desc[mq->last_head].flags &= ~MEMIF_DESC_FLAG_NEXT;
-	      mq->last_head = (mq->last_head + 1) & mask;
-	      b0->data_len += ring->desc[mq->last_head].length;
-	      b0->buffer_len += ring->desc[mq->last_head].buffer_length;
-#ifdef MEMIF_DBG_SHM
-	      print_bytes (b0->data +
-			   ring->desc[b0->desc_index].buffer_length * i++,
-			   ring->desc[b0->desc_index].buffer_length,
-			   DBG_TX_BUF);
-#endif /* MEMIF_DBG_SHM */
-	      ns--;
-	      *rx += 1;
-	    }
-	  mq->last_head = (mq->last_head + 1) & mask;
-
-	  b1->desc_index = mq->last_head;
-	  i = 0;
-	  b1->data_len = 0;
-	  b1->buffer_len = 0;
-
-	  b1->data = memif_get_buffer (conn, ring, mq->last_head);
-	  b1->data_len += ring->desc[mq->last_head].length;
-	  b1->buffer_len += ring->desc[mq->last_head].buffer_length;
-#ifdef MEMIF_DBG_SHM
-	  print_bytes (b1->data +
-		       ring->desc[b1->desc_index].buffer_length * i++,
-		       ring->desc[b1->desc_index].buffer_length, DBG_TX_BUF);
-#endif /* MEMIF_DBG_SHM */
-	  ns--;
-	  *rx += 1;
-	  while (ring->desc[mq->last_head].flags & MEMIF_DESC_FLAG_NEXT)
-	    {
-	      ring->desc[mq->last_head].flags &= ~MEMIF_DESC_FLAG_NEXT;
-	      mq->last_head = (mq->last_head + 1) & mask;
-	      b1->data_len += ring->desc[mq->last_head].length;
-	      b1->buffer_len += ring->desc[mq->last_head].buffer_length;
-#ifdef MEMIF_DBG_SHM
-	      print_bytes (b1->data +
-			   ring->desc[b1->desc_index].buffer_length * i++,
-			   ring->desc[b1->desc_index].buffer_length,
-			   DBG_TX_BUF);
-#endif /* MEMIF_DBG_SHM */
-	      ns--;
-	      *rx += 1;
-	    }
-	  mq->last_head = (mq->last_head + 1) & mask;
+      /* bulk of single buffer packets up to ring end or chain start */
+      n = memif_min (ns, count);
+      n = memif_min (n, (1 << mq->log2_ring_size) - mq->last_head);
+      n = memif_rx_burst_nochain (c, ring, mq->last_head, bufs + curr_buf,
+				  n);
+      mq->last_head = (mq->last_head + n) & mask;
+      ns -= n;
+      count -= n;
+      curr_buf += n;
+      *rx += n;
+      if ((ns == 0) || (count == 0))
+	break;
+      if ((n > 0) && (mq->last_head == 0))
+	continue;
 
-	  count -= 2;
-	  curr_buf += 2;
-	}
+      /* chained buffer */
       b0 = (bufs + curr_buf);
 
       b0->desc_index = mq->last_head;
@@ -1896,7 +4114,9 @@ memif_rx_burst (memif_conn_handle_t conn, uint16_t qid,
 
       while (ring->desc[mq->last_head].flags & MEMIF_DESC_FLAG_NEXT)
 	{
-	  ring->desc[mq->last_head].flags &= ~MEMIF_DESC_FLAG_NEXT;
+	  /* chain stays visible to memif_rx_detach */
+	  if (mq->spare.free == NULL)
+	    ring->desc[mq->last_head].flags &= ~MEMIF_DESC_FLAG_NEXT;
 	  mq->last_head = (mq->last_head + 1) & mask;
 	  b0->data_len += ring->desc[mq->last_head].length;
 	  b0->buffer_len += ring->desc[mq->last_head].buffer_length;
@@ -1916,6 +4136,10 @@ memif_rx_burst (memif_conn_handle_t conn, uint16_t qid,
 
   mq->alloc_bufs += *rx;
 
+  if ((mq->spare.free != NULL) &&
+      (mq->alloc_bufs > (uint32_t) (1 << mq->log2_ring_size) / 2))
+    memif_rx_detach (c, mq);
+
   /* TODO: return num of buffers and packets */
   *rx = curr_buf;
 
@@ -1928,6 +4152,410 @@ memif_rx_burst (memif_conn_handle_t conn, uint16_t qid,
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
 
+int
+memif_packet_alloc (memif_conn_handle_t conn, uint16_t qid,
+		    memif_packet_t * pkts, uint16_t count,
+		    struct iovec *segs, uint16_t max_segs,
+		    uint16_t * count_out, uint32_t size)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
+    num_s2m_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  memif_queue_t *mq = &c->tx_queues[qid];
+  memif_ring_t *ring = mq->ring;
+  memif_packet_t *p0;
+  memif_desc_t *d0;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t head = mq->last_head;
+  uint32_t s0, ns;
+  uint16_t nseg, used_segs = 0;
+  int i;
+  *count_out = 0;
+
+  if (size == 0)
+    size = (mq->num_pools) ? c->run_args.buffer_size : 1;
+
+  /* slots already allocated by previous calls are not available */
+  ns = memif_tx_free_slots (mq);
+  if (ns < count)
+    {
+      memif_tx_refresh_tail (mq);
+      ns = memif_tx_free_slots (mq);
+    }
+
+  while (*count_out < count)
+    {
+      s0 = (head + mq->alloc_bufs) & mask;
+      /* segment array limits number of slots */
+      nseg = memif_tx_slots_alloc (mq, s0, size,
+				   memif_min (ns, (uint32_t) (max_segs - used_segs)));
+      if (nseg == 0)
+	{
+	  memif_tx_refresh_tail (mq);
+	  ns = memif_tx_free_slots (mq);
+	  nseg = memif_tx_slots_alloc (mq, s0, size,
+				       memif_min (ns, (uint32_t) (max_segs - used_segs)));
+	  if (nseg == 0)
+	    break;
+	}
+
+      p0 = pkts + *count_out;
+      p0->desc_index = s0;
+      p0->num_segs = nseg;
+      p0->data_len = 0;
+      p0->segs = segs + used_segs;
+      for (i = 0; i < nseg; i++)
+	{
+	  d0 = &ring->desc[(s0 + i) & mask];
+	  p0->segs[i].iov_base = memif_get_buffer (c, ring, (s0 + i) & mask);
+	  p0->segs[i].iov_len = d0->buffer_length;
+	}
+
+      mq->alloc_bufs += nseg;
+      used_segs += nseg;
+      ns -= nseg;
+      *count_out += 1;
+    }
+
+  DBG ("allocated: %u/%u packets, %u segments", *count_out, count,
+       used_segs);
+
+  if (*count_out < count)
+    {
+      DBG ("ring buffer full! qid: %u", qid);
+      return MEMIF_ERR_NOBUF_RING;
+    }
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+int
+memif_tx_burst_pkt (memif_conn_handle_t conn, uint16_t qid,
+		    memif_packet_t * pkts, uint16_t count, uint16_t * tx)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
+    num_s2m_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  memif_queue_t *mq = &c->tx_queues[qid];
+  memif_ring_t *ring = mq->ring;
+  memif_packet_t *p0;
+  memif_desc_t *d0;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t head = mq->last_head;
+  uint32_t nsegs = 0;
+  int i;
+  *tx = 0;
+
+  while (*tx < count)
+    {
+      p0 = pkts + *tx;
+      for (i = 0; i < p0->num_segs; i++)
+	{
+	  d0 = &ring->desc[(p0->desc_index + i) & mask];
+	  d0->length = p0->segs[i].iov_len;
+	  d0->flags = (i < p0->num_segs - 1) ? MEMIF_DESC_FLAG_NEXT : 0;
+#ifdef MEMIF_DBG_SHM
+	  print_bytes (p0->segs[i].iov_base, d0->length, DBG_TX_BUF);
+#endif /* MEMIF_DBG_SHM */
+	}
+      head = (p0->desc_index + p0->num_segs) & mask;
+      nsegs += p0->num_segs;
+      p0->segs = NULL;
+      *tx += 1;
+    }
+
+  MEMIF_MEORY_BARRIER ();
+  mq->last_head = head;
+  memif_ring_set_head (mq, head);
+
+  mq->alloc_bufs = (mq->alloc_bufs > nsegs) ? mq->alloc_bufs - nsegs : 0;
+
+  return memif_tx_interrupt (mq, *tx);
+}
+
+int
+memif_rx_burst_pkt (memif_conn_handle_t conn, uint16_t qid,
+		    memif_packet_t * pkts, uint16_t count,
+		    struct iovec *segs, uint16_t max_segs,
+		    uint16_t * rx_pkts, uint16_t * rx_segs)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_s2m_rings : c->run_args.
+    num_m2s_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  memif_queue_t *mq = &c->rx_queues[qid];
+  memif_ring_t *ring = mq->ring;
+  memif_packet_t *p0;
+  memif_desc_t *d0;
+  uint32_t mask = (1 << mq->log2_ring_size) - 1;
+  uint32_t ns;
+  uint16_t nseg;
+  int i, err;
+  *rx_pkts = 0;
+  *rx_segs = 0;
+
+  if ((err = memif_rx_prepare (c, mq, count, &ns)) != MEMIF_ERR_SUCCESS)
+    return err;
+
+  while (ns && (*rx_pkts < count))
+    {
+      /* find end of chain */
+      nseg = 1;
+      while ((nseg < ns) &&
+	     (ring->desc[(mq->last_head + nseg - 1) & mask].flags &
+	      MEMIF_DESC_FLAG_NEXT))
+	nseg++;
+      if (ring->desc[(mq->last_head + nseg - 1) & mask].flags &
+	  MEMIF_DESC_FLAG_NEXT)
+	{
+	  /* rest of the packet not published by peer yet */
+	  DBG ("incomplete chain at ring slot %u", mq->last_head);
+	  ns = 0;
+	  break;
+	}
+      if (*rx_segs + nseg > max_segs)
+	break;
+
+      p0 = pkts + *rx_pkts;
+      p0->desc_index = mq->last_head;
+      p0->num_segs = nseg;
+      p0->data_len = 0;
+      p0->segs = segs + *rx_segs;
+      for (i = 0; i < nseg; i++)
+	{
+	  d0 = &ring->desc[(mq->last_head + i) & mask];
+	  p0->segs[i].iov_base =
+	    memif_get_buffer (c, ring, (mq->last_head + i) & mask);
+	  p0->segs[i].iov_len = d0->length;
+	  p0->data_len += d0->length;
+	}
+
+      mq->last_head = (mq->last_head + nseg) & mask;
+      ns -= nseg;
+      *rx_segs += nseg;
+      *rx_pkts += 1;
+    }
+
+  mq->alloc_bufs += *rx_segs;
+
+  if (ns)
+    {
+      DBG ("not enough buffers!");
+      return MEMIF_ERR_NOBUF;
+    }
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+int
+memif_packet_free (memif_conn_handle_t conn, uint16_t qid,
+		   memif_packet_t * pkts, uint16_t count,
+		   uint16_t * count_out)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num =
+    (c->args.is_master) ? c->run_args.num_s2m_rings : c->run_args.
+    num_m2s_rings;
+  if (qid >= num)
+    return MEMIF_ERR_QID;
+  memif_queue_t *mq = &c->rx_queues[qid];
+  memif_packet_t *p0;
+  *count_out = 0;
+
+  while ((*count_out < count) && mq->alloc_bufs)
+    {
+      p0 = pkts + *count_out;
+      memif_rx_complete (mq, p0->desc_index, p0->num_segs);
+      mq->alloc_bufs -= memif_min (p0->num_segs, mq->alloc_bufs);
+      p0->segs = NULL;
+      *count_out += 1;
+    }
+  MEMIF_MEORY_BARRIER ();
+  memif_ring_set_tail (mq, mq->last_tail);
+  DBG ("tail: %u", mq->last_tail);
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
+int
+memif_forward_burst (memif_conn_handle_t conn, uint16_t rx_qid,
+		     uint16_t tx_qid, memif_buffer_t * bufs, uint16_t count,
+		     uint16_t * fwd)
+{
+  memif_connection_t *c = (memif_connection_t *) conn;
+  if (c == NULL)
+    return MEMIF_ERR_NOCONN;
+  if (c->fd < 0)
+    return MEMIF_ERR_DISCONNECTED;
+  uint8_t num_rx =
+    (c->args.is_master) ? c->run_args.num_s2m_rings : c->run_args.
+    num_m2s_rings;
+  uint8_t num_tx =
+    (c->args.is_master) ? c->run_args.num_m2s_rings : c->run_args.
+    num_s2m_rings;
+  if ((rx_qid >= num_rx) || (tx_qid >= num_tx))
+    return MEMIF_ERR_QID;
+  memif_queue_t *rx_mq = &c->rx_queues[rx_qid];
+  memif_queue_t *tx_mq = &c->tx_queues[tx_qid];
+  memif_ring_t *rx_ring = rx_mq->ring;
+  memif_ring_t *tx_ring = tx_mq->ring;
+  uint32_t rx_mask = (1 << rx_mq->log2_ring_size) - 1;
+  uint32_t tx_mask = (1 << tx_mq->log2_ring_size) - 1;
+  uint32_t head = tx_mq->last_head;
+  uint32_t ns, rs, ts;
+  uint16_t descs = 0;
+  memif_desc_t tmp;
+  memif_buffer_t *b0;
+  uint8_t chain_buf0;
+  uint16_t push, tail;
+  int i, err = MEMIF_ERR_SUCCESS;	/* 0 */
+  *fwd = 0;
+
+  /* forwarded descriptors are published right behind tx ring head,
+     so there can be no buffers allocated by memif_buffer_alloc pending */
+  if (tx_mq->alloc_bufs)
+    {
+      DBG ("tx queue %u has pending allocated buffers", tx_qid);
+      return MEMIF_ERR_INVAL_ARG;
+    }
+
+  if (rx_mq->alloc_bufs < count)
+    count = rx_mq->alloc_bufs;
+
+  /* (head == tail) ? receive function will asume that no packets are available */
+  ns = (tx_mq->last_tail - head - 1) & tx_mask;
+  if (ns < count)
+    {
+      memif_tx_refresh_tail (tx_mq);
+      ns = (tx_mq->last_tail - head - 1) & tx_mask;
+    }
+
+  while (count)
+    {
+      b0 = (bufs + *fwd);
+      /* buffer exchanged for spare buffer has no ring slot */
+      if (rx_mq->spare.free &&
+	  (b0->data != memif_get_buffer (c, rx_ring, b0->desc_index)))
+	{
+	  err = MEMIF_ERR_INVAL_ARG;
+	  break;
+	}
+      chain_buf0 =
+	b0->buffer_len / rx_ring->desc[b0->desc_index].buffer_length;
+      if ((b0->buffer_len % rx_ring->desc[b0->desc_index].buffer_length) !=
+	  0)
+	chain_buf0++;
+
+      if ((chain_buf0 > ns) ||
+	  (tx_mq->num_pools &&
+	   (memif_pool_free_count (tx_mq) < chain_buf0)))
+	{
+	  DBG ("ring buffer full! qid: %u", tx_qid);
+	  err = MEMIF_ERR_NOBUF_RING;
+	  break;
+	}
+
+      /* headers pushed into headroom (trailers into tailroom) */
+      push = tail = 0;
+      if (rx_mq->headroom || rx_mq->tailroom)
+	{
+	  if ((memif_buffer_moved (c, rx_mq, b0, &push, &tail) < 0) ||
+	      ((push || tail) && (tx_mq->origin == NULL)))
+	    {
+	      err = MEMIF_ERR_INVAL_ARG;
+	      break;
+	    }
+	}
+
+      /* rx descriptor takes over free tx buffer (refill),
+         tx descriptor takes over received buffer */
+      for (i = 0; i < chain_buf0; i++)
+	{
+	  rs = (b0->desc_index + i) & rx_mask;
+	  ts = (head + i) & tx_mask;
+
+	  /* free tx slots hold no buffers, refill from pool */
+	  if (tx_mq->num_pools)
+	    memif_pool_get (memif_pool_select (tx_mq,
+					       rx_ring->desc[rs].
+					       buffer_length),
+			    &tx_ring->desc[ts]);
+
+	  tmp.region = tx_ring->desc[ts].region;
+	  tmp.offset = tx_ring->desc[ts].offset;
+	  tmp.buffer_length = tx_ring->desc[ts].buffer_length;
+
+	  tx_ring->desc[ts].region = rx_ring->desc[rs].region;
+	  tx_ring->desc[ts].offset = rx_ring->desc[rs].offset;
+	  tx_ring->desc[ts].buffer_length = rx_ring->desc[rs].buffer_length;
+	  tx_ring->desc[ts].length = rx_ring->desc[rs].length;
+	  tx_ring->desc[ts].flags =
+	    (i < (chain_buf0 - 1)) ? MEMIF_DESC_FLAG_NEXT : 0;
+
+	  rx_ring->desc[rs].region = tmp.region;
+	  rx_ring->desc[rs].offset = tmp.offset;
+	  rx_ring->desc[rs].buffer_length = tmp.buffer_length;
+	  rx_ring->desc[rs].flags = 0;
+	}
+
+      if (push || tail)
+	{
+	  memif_tx_slot_move (tx_mq, head, push, tail);
+	  tx_ring->desc[head].length = (chain_buf0 == 1) ? b0->data_len :
+	    tx_ring->desc[head].length + push;
+	}
+
+      head = (head + chain_buf0) & tx_mask;
+      memif_rx_complete (rx_mq, b0->desc_index, chain_buf0);
+      b0->data = NULL;
+
+      ns -= chain_buf0;
+      descs += chain_buf0;
+      count--;
+      *fwd += 1;
+    }
+
+  if (*fwd == 0)
+    return err;
+
+  MEMIF_MEORY_BARRIER ();
+  tx_mq->last_head = head;
+  memif_ring_set_head (tx_mq, head);
+  memif_ring_set_tail (rx_mq, rx_mq->last_tail);
+  rx_mq->alloc_bufs -= descs;
+  DBG ("forwarded %u bufs (%u descriptors), rx tail: %u, tx head: %u", *fwd,
+       descs, rx_mq->last_tail, head);
+
+  if ((i = memif_tx_interrupt (tx_mq, *fwd)) != MEMIF_ERR_SUCCESS)
+    return i;
+
+  return err;
+}
+
 int
 memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
 		   char *buf, ssize_t buflen)
@@ -1944,7 +4572,7 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
   if (l0 + l1 <= buflen)
     {
       md->if_name = strncpy (buf + l0, (char *) c->args.interface_name, l1);
-      md->if_name[l0 + l1] = '\0';
+      md->if_name[l1] = '\0';
       l0 += l1 + 1;
     }
   else
@@ -1954,7 +4582,7 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
   if (l0 + l1 <= buflen)
     {
       md->inst_name = strncpy (buf + l0, (char *) c->args.instance_name, l1);
-      md->inst_name[l0 + l1] = '\0';
+      md->inst_name[l1] = '\0';
       l0 += l1 + 1;
     }
   else
@@ -1964,7 +4592,7 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
   if (l0 + l1 <= buflen)
     {
       md->remote_if_name = strncpy (buf + l0, (char *) c->remote_if_name, l1);
-      md->remote_if_name[l0 + l1] = '\0';
+      md->remote_if_name[l1] = '\0';
       l0 += l1 + 1;
     }
   else
@@ -1974,7 +4602,7 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
   if (l0 + l1 <= buflen)
     {
       md->remote_inst_name = strncpy (buf + l0, (char *) c->remote_name, l1);
-      md->remote_inst_name[l0 + l1] = '\0';
+      md->remote_inst_name[l1] = '\0';
       l0 += l1 + 1;
     }
   else
@@ -1986,7 +4614,7 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
     {
       l1 = strlen ((char *) c->args.secret);
       md->secret = strncpy (buf + l0, (char *) c->args.secret, l1);
-      md->secret[l0 + l1] = '\0';
+      md->secret[l1] = '\0';
       l0 += l1 + 1;
     }
   else
@@ -2000,7 +4628,7 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
     {
       md->socket_filename =
 	strncpy (buf + l0, (char *) c->args.socket_filename, l1);
-      md->socket_filename[l0 + l1] = '\0';
+      md->socket_filename[l1] = '\0';
       l0 += l1 + 1;
     }
   else
@@ -2013,17 +4641,27 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
   l1 = sizeof (memif_queue_details_t) * md->rx_queues_num;
   if (l0 + l1 <= buflen)
     {
-      md->rx_queues = (memif_queue_details_t *) buf + l0;
-      l0 = l1 + 1;
+      md->rx_queues = (memif_queue_details_t *) (buf + l0);
+      l0 += l1;
     }
   else
-    err = MEMIF_ERR_NOBUF_DET;
+    {
+      md->rx_queues = NULL;
+      err = MEMIF_ERR_NOBUF_DET;
+    }
 
-  for (i = 0; i < md->rx_queues_num; i++)
+  for (i = 0; (md->rx_queues != NULL) && (i < md->rx_queues_num); i++)
     {
       md->rx_queues[i].qid = i;
       md->rx_queues[i].ring_size = (1 << c->rx_queues[i].log2_ring_size);
       md->rx_queues[i].buffer_size = c->run_args.buffer_size;
+      md->rx_queues[i].numa_node =
+	memif_queue_numa_node (c, &c->rx_queues[i]);
+      md->rx_queues[i].int_sent = 0;
+      md->rx_queues[i].int_suppressed = 0;
+      md->rx_queues[i].headroom = c->rx_queues[i].headroom;
+      md->rx_queues[i].tailroom = c->rx_queues[i].tailroom;
+      md->rx_queues[i].spare_buffers = c->rx_queues[i].spare.n_free;
     }
 
   md->tx_queues_num =
@@ -2033,20 +4671,56 @@ memif_get_details (memif_conn_handle_t conn, memif_details_t * md,
   l1 = sizeof (memif_queue_details_t) * md->tx_queues_num;
   if (l0 + l1 <= buflen)
     {
-      md->tx_queues = (memif_queue_details_t *) buf + l0;
-      l0 = l1 + 1;
+      md->tx_queues = (memif_queue_details_t *) (buf + l0);
+      l0 += l1;
     }
   else
-    err = MEMIF_ERR_NOBUF_DET;
+    {
+      md->tx_queues = NULL;
+      err = MEMIF_ERR_NOBUF_DET;
+    }
 
-  for (i = 0; i < md->tx_queues_num; i++)
+  for (i = 0; (md->tx_queues != NULL) && (i < md->tx_queues_num); i++)
     {
       md->tx_queues[i].qid = i;
       md->tx_queues[i].ring_size = (1 << c->tx_queues[i].log2_ring_size);
       md->tx_queues[i].buffer_size = c->run_args.buffer_size;
+      md->tx_queues[i].numa_node =
+	memif_queue_numa_node (c, &c->tx_queues[i]);
+      md->tx_queues[i].int_sent = c->tx_queues[i].int_sent;
+      md->tx_queues[i].int_suppressed = c->tx_queues[i].int_suppressed;
+      md->tx_queues[i].headroom = c->tx_queues[i].headroom;
+      md->tx_queues[i].tailroom = c->tx_queues[i].tailroom;
+      md->tx_queues[i].spare_buffers = 0;
+    }
+
+  md->regions_num = c->regions_num;
+
+  /* align region details */
+  l0 = (l0 + 7) & ~7;
+  l1 = sizeof (memif_region_details_t) * md->regions_num;
+  if (l0 + l1 <= buflen)
+    {
+      md->regions = (memif_region_details_t *) (buf + l0);
+      l0 += l1;
+    }
+  else
+    {
+      md->regions = NULL;
+      err = MEMIF_ERR_NOBUF_DET;
+    }
+
+  for (i = 0; (md->regions != NULL) && (i < md->regions_num); i++)
+    {
+      md->regions[i].index = i;
+      md->regions[i].size = c->regions[i].region_size;
+      md->regions[i].log2_page_size = c->regions[i].log2_page_size;
     }
 
   md->link_up_down = (c->fd > 0) ? 1 : 0;
+  md->shm_reused = (c->flags & MEMIF_CONNECTION_FLAG_SHM_REUSED) ? 1 : 0;
+  md->setup_usecs = c->setup_usecs;
+  md->prefault_usecs = c->prefault_usecs;
 
   return err;			/* 0 */
 }
@@ -2087,9 +4761,12 @@ memif_cleanup ()
   if (lm->listener_list)
     free (lm->listener_list);
   lm->listener_list = NULL;
-  if (lm->pending_list)
-    free (lm->pending_list);
-  lm->pending_list = NULL;
+  free (lm->fd_table);
+  lm->fd_table = NULL;
+  lm->fd_table_len = 0;
+  free (lm->connect_heap);
+  lm->connect_heap = NULL;
+  lm->connect_heap_len = lm->connect_heap_size = 0;
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -78,8 +78,14 @@ typedef struct __attribute__ ((packed))
   memif_ring_index_t max_m2s_ring;
   memif_ring_index_t max_s2m_ring;
   memif_log2_ring_size_t max_log2_ring_size;
+  uint32_t features;		/* MEMIF_MSG_FEATURE_* supported by master */
 } memif_msg_hello_t;
 
+/* slave sends all setup messages without waiting for ack of previous one */
+#define MEMIF_MSG_FEATURE_PIPELINE (1 << 0)
+/* peer maps buffer region per queue (regions 1..n) besides ring region 0 */
+#define MEMIF_MSG_FEATURE_MULTI_REGION (1 << 1)
+
 typedef struct __attribute__ ((packed))
 {
   memif_version_t version;
@@ -87,6 +93,7 @@ typedef struct __attribute__ ((packed))
   memif_interface_mode_t mode:8;
   uint8_t secret[24];
   uint8_t name[32];
+  uint32_t features;		/* features of hello used by slave */
 } memif_msg_init_t;
 
 typedef struct __attribute__ ((packed))
@@ -103,6 +110,8 @@ typedef struct __attribute__ ((packed))
   memif_region_index_t region;
   memif_region_offset_t offset;
   memif_log2_ring_size_t log2_ring_size;
+  uint16_t headroom;		/* bytes reserved in front of every buffer */
+  uint16_t tailroom;		/* bytes reserved behind every buffer */
 } memif_msg_add_ring_t;
 
 typedef struct __attribute__ ((packed))
@@ -161,6 +170,11 @@ _Static_assert (sizeof (memif_desc_t) == 32,
 #define MEMIF_CACHELINE_ALIGN_MARK(mark) \
   uint8_t mark[0] __attribute__((aligned(MEMIF_CACHELINE_SIZE)))
 
+/* rings of up to 2^14 entries use 16-bit head and tail, larger rings
+   (allowed by max_log2_ring_size in hello) use 32-bit head_wide and
+   tail_wide instead */
+#define MEMIF_RING_NARROW_MAX_LOG2_SIZE 14
+
 typedef struct
 {
   MEMIF_CACHELINE_ALIGN_MARK (cacheline0);
@@ -168,8 +182,11 @@ typedef struct
   uint16_t flags;
 #define MEMIF_RING_FLAG_MASK_INT 1
   volatile uint16_t head;
+  volatile uint32_t head_wide;
     MEMIF_CACHELINE_ALIGN_MARK (cacheline1);
   volatile uint16_t tail;
+  uint16_t reserved;
+  volatile uint32_t tail_wide;
     MEMIF_CACHELINE_ALIGN_MARK (cacheline2);
   memif_desc_t desc[0];
 } memif_ring_t;
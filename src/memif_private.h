@@ -26,6 +26,8 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <sys/timerfd.h>
+#include <time.h>
+#include <signal.h>
 
 #include <libmemif.h>
 
@@ -36,14 +38,41 @@
 #define MEMIF_DEFAULT_RX_QUEUES 1
 #define MEMIF_DEFAULT_TX_QUEUES 1
 #define MEMIF_DEFAULT_BUFFER_SIZE 2048
+#define MEMIF_DEFAULT_RX_POLL_BUDGET 1024
 
 #define MEMIF_MAX_M2S_RING		255
 #define MEMIF_MAX_S2M_RING		255
 #define MEMIF_MAX_REGION		255
-#define MEMIF_MAX_LOG2_RING_SIZE	14
+#define MEMIF_MAX_LOG2_RING_SIZE	24
 
 #define MEMIF_MAX_FDS 512
 
+/* maximum number of control messages sent by single sendmmsg */
+#define MEMIF_MSG_BATCH_SIZE 64
+
+/* maximum number of connections accepted on single listener event */
+#define MEMIF_ACCEPT_BATCH_SIZE 64
+
+/* slave connect retry delay, doubles after each attempt until connected */
+#define MEMIF_CONNECT_BACKOFF_MIN_MSEC 16
+#define MEMIF_CONNECT_BACKOFF_MAX_MSEC 4096
+
+/* number of descriptors scanned at once by rx fast path */
+#define MEMIF_RX_VECTOR_SIZE 8
+
+/* runtime dispatch of data path functions to best available instruction set
+   (aarch64 always has NEON, so default build is vectorized already) */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(MEMIF_NO_TARGET_CLONES)
+#define MEMIF_TARGET_CLONES \
+  __attribute__ ((target_clones ("avx2", "sse4.2", "default")))
+#else
+#define MEMIF_TARGET_CLONES
+#endif
+
+/* copies of at least this many bytes to shared memory bypass cache
+   (peer reads packet data from another core) */
+#define MEMIF_COPY_NT_THRESHOLD 1024
+
 #define memif_min(a,b) (((a) < (b)) ? (a) : (b))
 
 #ifdef MEMIF_DBG
@@ -82,10 +111,42 @@
 typedef struct
 {
   void *shm;
-  uint32_t region_size;
+  memif_region_size_t region_size;
   int fd;
+  uint8_t log2_page_size;	/* page size backing shared memory */
+
+  /* slave: region added to live connection (memif_region_add),
+     its buffers are spares of rx queue qid */
+  uint8_t is_spare;
+  uint8_t pending;		/* not acknowledged by peer yet */
+  uint8_t released;		/* pages returned to kernel */
+  uint16_t qid;
+  uint32_t num_buffers;
+  uint32_t n_pooled;		/* buffers of region in spare pool */
 } memif_region_t;
 
+/* free buffers of one size class */
+typedef struct
+{
+  uint32_t buffer_length;
+  uint32_t n_free;
+  struct
+  {
+    memif_region_index_t region;
+    memif_region_offset_t offset;
+  } *free;
+} memif_buffer_pool_t;
+
+/* formatted buffer of tx ring slot transmitted with data moved into
+   headroom or tailroom, restored when peer releases the slot */
+typedef struct
+{
+  memif_region_index_t region;
+  uint32_t buffer_length;	/* 0 = slot buffer not moved */
+  memif_region_offset_t offset;
+  memif_region_offset_t moved_offset;
+} memif_buffer_origin_t;
+
 typedef struct
 {
   memif_ring_t *ring;
@@ -93,13 +154,53 @@ typedef struct
   uint8_t region;
   uint32_t offset;
 
-  uint16_t last_head;
-  uint16_t last_tail;
+  /* local copies of ring indices, shared ring head/tail written by peer
+     is only read when cached view can't satisfy the request */
+  uint32_t last_head;		/* tx: own head, rx: next slot to receive */
+  uint32_t last_tail;		/* tx: cached peer tail, rx: own tail */
+  uint32_t cached_head;		/* rx: cached peer head */
 
   int int_fd;
 
   uint64_t int_count;
   uint32_t alloc_bufs;
+
+  /* tx interrupt coalescing */
+  memif_tx_coalesce_t coalesce;
+  uint32_t int_pending;		/* packets sent since last interrupt */
+  uint32_t int_batch;		/* current packet limit */
+  uint32_t int_last_head;	/* head at last interrupt */
+  uint8_t int_timer_armed;
+  int int_timer_fd;
+  uint64_t int_sent;
+  uint64_t int_suppressed;
+
+  /* rx adaptive mode */
+  uint8_t rx_mode;
+  uint32_t empty_polls;		/* consecutive empty polls */
+
+  /* rx: slots freed out of order, tail advances over contiguous prefix */
+  uint64_t *done;		/* bitmap, one bit per ring slot */
+  uint32_t done_pending;	/* slots marked in bitmap */
+
+  /* tx: ring holds buffers of different sizes, free buffers are kept
+     in pools and attached to ring slots at allocation */
+  memif_buffer_pool_t pools[MEMIF_MAX_BUFFER_CLASSES];
+  uint8_t num_pools;
+  uint32_t buffer_size;		/* tx: length of all buffers, 0 if sizes differ */
+
+  /* space reserved around buffers by slave */
+  uint16_t headroom;
+  uint16_t tailroom;
+  /* tx: slots transmitted with data moved into headroom/tailroom */
+  memif_buffer_origin_t *origin;	/* one per ring slot */
+  uint32_t n_moved;
+
+  /* rx: buffers of regions added to live connection, exchanged for ring
+     buffers of received packets while application holds many slots */
+  memif_buffer_pool_t spare;
+  uint32_t spare_size;		/* capacity of spare pool */
+  uint16_t n_detached;		/* received buffers moved out of ring */
 } memif_queue_t;
 
 typedef struct memif_msg_queue_elt
@@ -122,6 +223,7 @@ typedef struct
   uint8_t num_m2s_rings;
   uint16_t buffer_size;
   memif_log2_ring_size_t log2_ring_size;
+  memif_region_index_t max_region;	/* highest region index peer accepts */
 } memif_conn_run_args_t;
 
 typedef struct memif_connection
@@ -141,18 +243,44 @@ typedef struct memif_connection
 
   /* connection message queue */
   memif_msg_queue_elt_t *msg_queue;
+  memif_msg_queue_elt_t *msg_queue_tail;	/* valid if msg_queue != NULL */
+  /* sent messages are kept for reuse until memif_delete */
+  memif_msg_queue_elt_t *msg_pool;
+  uint32_t msg_pool_allocs;	/* elements allocated from heap */
 
   uint8_t remote_if_name[32];
   uint8_t remote_name[32];
   uint8_t remote_disconnect_string[96];
 
+  /* region 0 holds rings, buffers are either in region 0 behind rings
+     or in separate region per queue */
   memif_region_t *regions;
+  uint16_t regions_num;
 
   memif_queue_t *rx_queues;
   memif_queue_t *tx_queues;
 
+  /* layout of regions and queues kept across reconnect (keep_regions) */
+  memif_conn_run_args_t shm_run_args;
+
+  /* connection setup time, from hello/init to connected */
+  struct timespec setup_start;
+  uint32_t setup_usecs;
+  uint32_t prefault_usecs;	/* time spent faulting in and locking regions */
+
+  /* slave connect attempts */
+  uint32_t connect_backoff_msec;	/* delay of next attempt before jitter */
+  uint32_t connect_heap_index;	/* position in connect heap + 1, 0 = none */
+  uint64_t connect_at_usecs;	/* time of next attempt */
+  uint64_t disconnect_usecs;	/* time connection was lost, 0 = connected */
+
   uint16_t flags;
 #define MEMIF_CONNECTION_FLAG_WRITE (1 << 0)
+#define MEMIF_CONNECTION_FLAG_SHM_KEPT (1 << 1)
+#define MEMIF_CONNECTION_FLAG_SHM_REUSED (1 << 2)
+#define MEMIF_CONNECTION_FLAG_CONNECTED (1 << 3)
+#define MEMIF_CONNECTION_FLAG_PIPELINE (1 << 4)
+#define MEMIF_CONNECTION_FLAG_MULTI_REGION (1 << 5)
 } memif_connection_t;
 
 /*
@@ -164,16 +292,33 @@ typedef struct
   void *data_struct;
 } memif_list_elt_t;
 
-/*
- * WIP
- */
+/* owner type of fd in fd dispatch table */
+#define MEMIF_FD_TYPE_NONE      0
+#define MEMIF_FD_TYPE_INTERRUPT 1	/* rx queue interrupt eventfd */
+#define MEMIF_FD_TYPE_INT_TIMER 2	/* tx queue coalescing timerfd */
+#define MEMIF_FD_TYPE_LISTENER  3	/* master listener socket */
+#define MEMIF_FD_TYPE_PENDING   4	/* accepted socket before init message */
+#define MEMIF_FD_TYPE_CONTROL   5	/* connection control socket */
+
+/* fd dispatch table entry, indexed by fd */
+typedef struct
+{
+  uint8_t type;
+  uint16_t qid;
+  uint32_t gen;			/* changed with owner, detects stale events */
+  void *data_struct;
+} memif_fd_entry_t;
+
+/* listener socket shared by master interfaces with the same socket filename */
 typedef struct
 {
   int fd;
   uint16_t use_count;
   uint8_t *filename;
-  uint16_t interface_list_len;
-  memif_list_elt_t *interface_list;	/* memif master interfaces listening on this socket */
+  /* memif master interfaces listening on this socket, open addressing hash
+     keyed by interface id, size is power of 2 and at least 2x use_count */
+  uint32_t interface_hash_size;
+  memif_list_elt_t *interface_hash;
 } memif_socket_t;
 
 /*
@@ -184,21 +329,29 @@ typedef struct
 {
   memif_control_fd_update_t *control_fd_update;
   int timerfd;
-  struct itimerspec arm, disarm;
-  uint16_t disconn_slaves;
+  /* disconnected slaves, min-heap ordered by time of next connect attempt,
+     timerfd is armed for the earliest attempt only */
+  uint32_t connect_heap_len;
+  uint32_t connect_heap_size;
+  memif_connection_t **connect_heap;
+  uint64_t timer_usecs;		/* time timerfd is armed for, 0 = disarmed */
+  unsigned int rand_seed;	/* connect attempt jitter */
   uint8_t *app_name;
 
-  /* master implementation... */
-  memif_socket_t ms;
-
   uint16_t control_list_len;
   uint16_t interrupt_list_len;
   uint16_t listener_list_len;
-  uint16_t pending_list_len;
   memif_list_elt_t *control_list;
   memif_list_elt_t *interrupt_list;
   memif_list_elt_t *listener_list;
-  memif_list_elt_t *pending_list;
+
+  /* resolves event fd to its owner in constant time */
+  uint32_t fd_table_len;
+  memif_fd_entry_t *fd_table;
+
+  /* signal mask used while waiting in memif_poll_event */
+  sigset_t poll_sigmask;
+  memif_stats_t stats;
 } libmemif_main_t;
 
 extern libmemif_main_t libmemif_main;
@@ -212,8 +365,24 @@ int memif_connect1 (memif_connection_t * c);
 /* memory map region, initalize rings and queues */
 int memif_init_regions_and_queues (memif_connection_t * c);
 
+#ifdef MEMIF_UNIT_TEST
+/* ring ring_num of direction type in region 0 */
+memif_ring_t *memif_get_ring (memif_connection_t * conn,
+			      memif_ring_type_t type, uint16_t ring_num);
+#endif /* MEMIF_UNIT_TEST */
+
 int memif_disconnect_internal (memif_connection_t * c);
 
+/* mmap region received from peer */
+int memif_region_map (memif_connection_t * c, memif_region_t * mr);
+
+/* peer acknowledged oldest region added by memif_region_add,
+   its buffers become spares of rx queue */
+int memif_region_ack (memif_connection_t * c);
+
+/* allocate rx queue slot completion bitmap (log2_ring_size must be set) */
+int memif_queue_done_init (memif_queue_t * mq);
+
 /* map errno to memif error code */
 int memif_syscall_error_handler (int err_code);
 
@@ -225,6 +394,53 @@ int get_list_elt (memif_list_elt_t ** e, memif_list_elt_t * list,
 
 int free_list_elt (memif_list_elt_t * list, uint16_t len, int key);
 
+/* add master interface to listener socket interface hash */
+int memif_socket_interface_add (memif_socket_t * ms, memif_connection_t * c);
+
+void memif_socket_interface_del (memif_socket_t * ms,
+				 memif_connection_t * c);
+
+/* find master interface by id, returns NULL if not found */
+memif_connection_t *memif_socket_interface_get (memif_socket_t * ms,
+						uint32_t id);
+
+/* register owner of fd in fd dispatch table, returns -1 if table can't grow */
+int memif_fd_table_set (int fd, uint8_t type, uint16_t qid,
+			void *data_struct);
+
+void memif_fd_table_del (int fd);
+
+/* shared memory taken by ring header and descriptors */
+static inline memif_region_size_t
+memif_ring_bytes (uint8_t log2_ring_size)
+{
+  return sizeof (memif_ring_t) +
+    ((memif_region_size_t) sizeof (memif_desc_t) << log2_ring_size);
+}
+
+static inline memif_fd_entry_t *
+memif_fd_table_get (int fd)
+{
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((fd < 0) || ((uint32_t) fd >= lm->fd_table_len) ||
+      (lm->fd_table[fd].type == MEMIF_FD_TYPE_NONE))
+    return NULL;
+  return &lm->fd_table[fd];
+}
+
+/* generation of fd table entry, changes whenever fd is registered or
+   unregistered */
+static inline uint32_t
+memif_fd_table_gen (int fd)
+{
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((fd < 0) || ((uint32_t) fd >= lm->fd_table_len))
+    return 0;
+  return lm->fd_table[fd].gen;
+}
+
 #ifndef __NR_memfd_create
 #if defined __x86_64__
 #define __NR_memfd_create 319
@@ -243,9 +459,144 @@ memfd_create (const char *name, unsigned int flags)
   return syscall (__NR_memfd_create, name, flags);
 }
 
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE (1 << 0)
+#endif
+#ifndef MPOL_F_ADDR
+#define MPOL_F_ADDR (1 << 1)
+#endif
+
+/* highest supported NUMA node + 1 */
+#define MEMIF_MAX_NUMA_NODES 1024
+
+static inline long
+memif_mbind (void *addr, unsigned long len, int mode,
+	     const unsigned long *nodemask, unsigned long maxnode,
+	     unsigned int flags)
+{
+  return syscall (__NR_mbind, addr, len, mode, nodemask, maxnode, flags);
+}
+
+static inline long
+memif_get_mempolicy (int *mode, unsigned long *nodemask,
+		     unsigned long maxnode, void *addr, unsigned long flags)
+{
+  return syscall (__NR_get_mempolicy, mode, nodemask, maxnode, addr, flags);
+}
+
+/* microseconds elapsed since t (CLOCK_MONOTONIC) */
+static inline uint32_t
+memif_usecs_since (struct timespec *t)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000000 +
+    (now.tv_nsec - t->tv_nsec) / 1000;
+}
+
+/* get message queue element from connection pool, heap allocation is
+   needed only until pool holds as many elements as the longest queue */
+static inline memif_msg_queue_elt_t *
+memif_msg_queue_elt_get (memif_connection_t * c)
+{
+  memif_msg_queue_elt_t *e = c->msg_pool;
+
+  if (e != NULL)
+    c->msg_pool = e->next;
+  else
+    {
+      e = (memif_msg_queue_elt_t *) malloc (sizeof (memif_msg_queue_elt_t));
+      if (e == NULL)
+	return NULL;
+      c->msg_pool_allocs++;
+    }
+  memset (e, 0, sizeof (memif_msg_queue_elt_t));
+  e->fd = -1;
+  return e;
+}
+
+static inline void
+memif_msg_queue_elt_put (memif_connection_t * c, memif_msg_queue_elt_t * e)
+{
+  e->next = c->msg_pool;
+  c->msg_pool = e;
+}
+
+/* current CLOCK_MONOTONIC time in microseconds */
+static inline uint64_t
+memif_time_usecs ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline void
+memif_queue_reset_state (memif_queue_t * mq)
+{
+  memset (&mq->coalesce, 0, sizeof (mq->coalesce));
+  mq->int_pending = mq->int_batch = mq->int_last_head = 0;
+  mq->int_timer_armed = 0;
+  mq->int_timer_fd = -1;
+  mq->int_sent = mq->int_suppressed = 0;
+  mq->rx_mode = MEMIF_RX_MODE_INTERRUPT;
+  mq->empty_polls = 0;
+  mq->done = NULL;
+  mq->done_pending = 0;
+  mq->num_pools = 0;
+  mq->buffer_size = 0;
+  mq->origin = NULL;
+  mq->n_moved = 0;
+  mq->spare.free = NULL;
+  mq->spare.n_free = 0;
+  mq->spare_size = 0;
+  mq->n_detached = 0;
+}
+
+/* shared ring indices, wide format is used by rings larger than
+   2^MEMIF_RING_NARROW_MAX_LOG2_SIZE, the branch is predicted per queue */
+static inline uint32_t
+memif_ring_head (memif_queue_t * mq)
+{
+  if (mq->log2_ring_size > MEMIF_RING_NARROW_MAX_LOG2_SIZE)
+    return mq->ring->head_wide;
+  return mq->ring->head;
+}
+
+static inline uint32_t
+memif_ring_tail (memif_queue_t * mq)
+{
+  if (mq->log2_ring_size > MEMIF_RING_NARROW_MAX_LOG2_SIZE)
+    return mq->ring->tail_wide;
+  return mq->ring->tail;
+}
+
+static inline void
+memif_ring_set_head (memif_queue_t * mq, uint32_t head)
+{
+  if (mq->log2_ring_size > MEMIF_RING_NARROW_MAX_LOG2_SIZE)
+    mq->ring->head_wide = head;
+  else
+    mq->ring->head = head;
+}
+
+static inline void
+memif_ring_set_tail (memif_queue_t * mq, uint32_t tail)
+{
+  if (mq->log2_ring_size > MEMIF_RING_NARROW_MAX_LOG2_SIZE)
+    mq->ring->tail_wide = tail;
+  else
+    mq->ring->tail = tail;
+}
+
 static inline void *
 memif_get_buffer (memif_connection_t * conn, memif_ring_t * ring,
-		  uint16_t index)
+		  uint32_t index)
 {
   return (conn->regions[ring->desc[index].region].shm +
 	  ring->desc[index].offset);
@@ -255,6 +606,12 @@ memif_get_buffer (memif_connection_t * conn, memif_ring_t * ring,
 #define F_LINUX_SPECIFIC_BASE 1024
 #endif
 #define MFD_ALLOW_SEALING       0x0002U
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB             0x0004U
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT          26
+#endif
 #define F_ADD_SEALS (F_LINUX_SPECIFIC_BASE + 9)
 #define F_GET_SEALS (F_LINUX_SPECIFIC_BASE + 10)
 
@@ -33,32 +33,40 @@
 #include <socket.h>
 #include <memif.h>
 
-/* sends msg to socket */
-static_fn int
-memif_msg_send (int fd, memif_msg_t * msg, int afd)
+/* fill msghdr for msg, afd > 0 is passed to peer */
+static void
+memif_msg_hdr_init (struct msghdr *mh, struct iovec *iov, char *ctl,
+		    memif_msg_t * msg, int afd)
 {
-  struct msghdr mh = { 0 };
-  struct iovec iov[1];
-  char ctl[CMSG_SPACE (sizeof (int))];
-  int rv, err = MEMIF_ERR_SUCCESS;	/* 0 */
-
-  iov[0].iov_base = (void *) msg;
-  iov[0].iov_len = sizeof (memif_msg_t);
-  mh.msg_iov = iov;
-  mh.msg_iovlen = 1;
+  iov->iov_base = (void *) msg;
+  iov->iov_len = sizeof (memif_msg_t);
+  mh->msg_iov = iov;
+  mh->msg_iovlen = 1;
 
   if (afd > 0)
     {
       struct cmsghdr *cmsg;
-      memset (&ctl, 0, sizeof (ctl));
-      mh.msg_control = ctl;
-      mh.msg_controllen = sizeof (ctl);
-      cmsg = CMSG_FIRSTHDR (&mh);
+      memset (ctl, 0, CMSG_SPACE (sizeof (int)));
+      mh->msg_control = ctl;
+      mh->msg_controllen = CMSG_SPACE (sizeof (int));
+      cmsg = CMSG_FIRSTHDR (mh);
       cmsg->cmsg_len = CMSG_LEN (sizeof (int));
       cmsg->cmsg_level = SOL_SOCKET;
       cmsg->cmsg_type = SCM_RIGHTS;
       memcpy (CMSG_DATA (cmsg), &afd, sizeof (int));
     }
+}
+
+/* sends msg to socket */
+static_fn int
+memif_msg_send (int fd, memif_msg_t * msg, int afd)
+{
+  struct msghdr mh = { 0 };
+  struct iovec iov[1];
+  char ctl[CMSG_SPACE (sizeof (int))];
+  int rv, err = MEMIF_ERR_SUCCESS;	/* 0 */
+
+  memif_msg_hdr_init (&mh, iov, ctl, msg, afd);
   rv = sendmsg (fd, &mh, 0);
   if (rv < 0)
     err = memif_syscall_error_handler (errno);
@@ -66,32 +74,29 @@ memif_msg_send (int fd, memif_msg_t * msg, int afd)
   return err;
 }
 
+/* append message to connection message queue */
+static void
+memif_msg_enq (memif_connection_t * c, memif_msg_queue_elt_t * e)
+{
+  e->next = NULL;
+  if (c->msg_queue == NULL)
+    c->msg_queue = e;
+  else
+    c->msg_queue_tail->next = e;
+  c->msg_queue_tail = e;
+}
+
 /* response from memif master - master is ready to handle next message */
 static_fn int
 memif_msg_enq_ack (memif_connection_t * c)
 {
-  memif_msg_queue_elt_t *e =
-    (memif_msg_queue_elt_t *) malloc (sizeof (memif_msg_queue_elt_t));
+  memif_msg_queue_elt_t *e = memif_msg_queue_elt_get (c);
   if (e == NULL)
     return memif_syscall_error_handler (errno);
 
-  memset (&e->msg, 0, sizeof (e->msg));
   e->msg.type = MEMIF_MSG_TYPE_ACK;
-  e->fd = -1;
-
-  e->next = NULL;
-  if (c->msg_queue == NULL)
-    {
-      c->msg_queue = e;
-      return MEMIF_ERR_SUCCESS;	/* 0 */
-    }
 
-  memif_msg_queue_elt_t *cur = c->msg_queue;
-  while (cur->next != NULL)
-    {
-      cur = cur->next;
-    }
-  cur->next = e;
+  memif_msg_enq (c, e);
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -109,6 +114,7 @@ memif_msg_send_hello (int fd)
   h->max_m2s_ring = MEMIF_MAX_M2S_RING;
   h->max_region = MEMIF_MAX_REGION;
   h->max_log2_ring_size = MEMIF_MAX_LOG2_RING_SIZE;
+  h->features = MEMIF_MSG_FEATURE_PIPELINE | MEMIF_MSG_FEATURE_MULTI_REGION;
 
   strncpy ((char *) h->name, lm->app_name, strlen (lm->app_name));
 
@@ -121,56 +127,42 @@ memif_msg_send_hello (int fd)
 static_fn int
 memif_msg_enq_init (memif_connection_t * c)
 {
-  memif_msg_queue_elt_t *e =
-    (memif_msg_queue_elt_t *) malloc (sizeof (memif_msg_queue_elt_t));
+  memif_msg_queue_elt_t *e = memif_msg_queue_elt_get (c);
   if (e == NULL)
     return memif_syscall_error_handler (errno);
-  memset (e, 0, sizeof (memif_msg_queue_elt_t));
 
-  memset (&e->msg, 0, sizeof (e->msg));
   memif_msg_init_t *i = &e->msg.init;
 
   e->msg.type = MEMIF_MSG_TYPE_INIT;
-  e->fd = -1;
   i->version = MEMIF_VERSION;
   i->id = c->args.interface_id;
   i->mode = c->args.mode;
+  if (c->flags & MEMIF_CONNECTION_FLAG_PIPELINE)
+    i->features |= MEMIF_MSG_FEATURE_PIPELINE;
+  if (c->flags & MEMIF_CONNECTION_FLAG_MULTI_REGION)
+    i->features |= MEMIF_MSG_FEATURE_MULTI_REGION;
 
   strncpy ((char *) i->name, (char *) c->args.instance_name,
 	   strlen ((char *) c->args.instance_name));
   if (c->args.secret)
     strncpy ((char *) i->secret, (char *) c->args.secret, sizeof (i->secret));
 
-  e->next = NULL;
-  if (c->msg_queue == NULL)
-    {
-      c->msg_queue = e;
-      return MEMIF_ERR_SUCCESS;	/* 0 */
-    }
-
-  memif_msg_queue_elt_t *cur = c->msg_queue;
-  while (cur->next != NULL)
-    {
-      cur = cur->next;
-    }
-  cur->next = e;
+  memif_msg_enq (c, e);
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
 
 /* send information about region specified by region_index */
-static_fn int
+int
 memif_msg_enq_add_region (memif_connection_t * c, uint8_t region_index)
 {
   /* maybe check if region is valid? */
   memif_region_t *mr = &c->regions[region_index];
 
-  memif_msg_queue_elt_t *e =
-    (memif_msg_queue_elt_t *) malloc (sizeof (memif_msg_queue_elt_t));
+  memif_msg_queue_elt_t *e = memif_msg_queue_elt_get (c);
   if (e == NULL)
     return memif_syscall_error_handler (errno);
 
-  memset (&e->msg, 0, sizeof (e->msg));
   memif_msg_add_region_t *ar = &e->msg.add_region;
 
   e->msg.type = MEMIF_MSG_TYPE_ADD_REGION;
@@ -178,19 +170,7 @@ memif_msg_enq_add_region (memif_connection_t * c, uint8_t region_index)
   ar->index = region_index;
   ar->size = mr->region_size;
 
-  e->next = NULL;
-  if (c->msg_queue == NULL)
-    {
-      c->msg_queue = e;
-      return MEMIF_ERR_SUCCESS;	/* 0 */
-    }
-
-  memif_msg_queue_elt_t *cur = c->msg_queue;
-  while (cur->next != NULL)
-    {
-      cur = cur->next;
-    }
-  cur->next = e;
+  memif_msg_enq (c, e);
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -199,12 +179,10 @@ memif_msg_enq_add_region (memif_connection_t * c, uint8_t region_index)
 static_fn int
 memif_msg_enq_add_ring (memif_connection_t * c, uint8_t index, uint8_t dir)
 {
-  memif_msg_queue_elt_t *e =
-    (memif_msg_queue_elt_t *) malloc (sizeof (memif_msg_queue_elt_t));
+  memif_msg_queue_elt_t *e = memif_msg_queue_elt_get (c);
   if (e == NULL)
     return memif_syscall_error_handler (errno);
 
-  memset (&e->msg, 0, sizeof (e->msg));
   memif_msg_add_ring_t *ar = &e->msg.add_ring;
 
   e->msg.type = MEMIF_MSG_TYPE_ADD_RING;
@@ -221,21 +199,11 @@ memif_msg_enq_add_ring (memif_connection_t * c, uint8_t index, uint8_t dir)
   ar->offset = mq->offset;
   ar->region = mq->region;
   ar->log2_ring_size = mq->log2_ring_size;
+  ar->headroom = mq->headroom;
+  ar->tailroom = mq->tailroom;
   ar->flags = (dir == MEMIF_RING_S2M) ? MEMIF_MSG_ADD_RING_FLAG_S2M : 0;
 
-  e->next = NULL;
-  if (c->msg_queue == NULL)
-    {
-      c->msg_queue = e;
-      return MEMIF_ERR_SUCCESS;	/* 0 */
-    }
-
-  memif_msg_queue_elt_t *cur = c->msg_queue;
-  while (cur->next != NULL)
-    {
-      cur = cur->next;
-    }
-  cur->next = e;
+  memif_msg_enq (c, e);
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -244,32 +212,17 @@ memif_msg_enq_add_ring (memif_connection_t * c, uint8_t index, uint8_t dir)
 static_fn int
 memif_msg_enq_connect (memif_connection_t * c)
 {
-  memif_msg_queue_elt_t *e =
-    (memif_msg_queue_elt_t *) malloc (sizeof (memif_msg_queue_elt_t));
+  memif_msg_queue_elt_t *e = memif_msg_queue_elt_get (c);
   if (e == NULL)
     return memif_syscall_error_handler (errno);
 
-  memset (&e->msg, 0, sizeof (e->msg));
   memif_msg_connect_t *cm = &e->msg.connect;
 
   e->msg.type = MEMIF_MSG_TYPE_CONNECT;
-  e->fd = -1;
   strncpy ((char *) cm->if_name, (char *) c->args.interface_name,
 	   strlen ((char *) c->args.interface_name));
 
-  e->next = NULL;
-  if (c->msg_queue == NULL)
-    {
-      c->msg_queue = e;
-      return MEMIF_ERR_SUCCESS;	/* 0 */
-    }
-
-  memif_msg_queue_elt_t *cur = c->msg_queue;
-  while (cur->next != NULL)
-    {
-      cur = cur->next;
-    }
-  cur->next = e;
+  memif_msg_enq (c, e);
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -278,32 +231,17 @@ memif_msg_enq_connect (memif_connection_t * c)
 static_fn int
 memif_msg_enq_connected (memif_connection_t * c)
 {
-  memif_msg_queue_elt_t *e =
-    (memif_msg_queue_elt_t *) malloc (sizeof (memif_msg_queue_elt_t));
+  memif_msg_queue_elt_t *e = memif_msg_queue_elt_get (c);
   if (e == NULL)
     return memif_syscall_error_handler (errno);
 
-  memset (&e->msg, 0, sizeof (e->msg));
   memif_msg_connected_t *cm = &e->msg.connected;
 
   e->msg.type = MEMIF_MSG_TYPE_CONNECTED;
-  e->fd = -1;
   strncpy ((char *) cm->if_name, (char *) c->args.interface_name,
 	   strlen ((char *) c->args.interface_name));
 
-  e->next = NULL;
-  if (c->msg_queue == NULL)
-    {
-      c->msg_queue = e;
-      return MEMIF_ERR_SUCCESS;	/* 0 */
-    }
-
-  memif_msg_queue_elt_t *cur = c->msg_queue;
-  while (cur->next != NULL)
-    {
-      cur = cur->next;
-    }
-  cur->next = e;
+  memif_msg_enq (c, e);
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -330,11 +268,22 @@ memif_msg_send_disconnect (int fd, uint8_t * err_string, uint32_t err_code)
   return memif_msg_send (fd, &msg, -1);
 }
 
+/* record duration of connection setup */
+static void
+memif_setup_done (memif_connection_t * c)
+{
+  c->setup_usecs = memif_usecs_since (&c->setup_start);
+  c->flags |= MEMIF_CONNECTION_FLAG_CONNECTED;
+  DBG ("connection setup took %u usecs", c->setup_usecs);
+}
+
 static_fn int
 memif_msg_receive_hello (memif_connection_t * c, memif_msg_t * msg)
 {
   memif_msg_hello_t *h = &msg->hello;
 
+  clock_gettime (CLOCK_MONOTONIC, &c->setup_start);
+
   if (msg->hello.min_version > MEMIF_VERSION ||
       msg->hello.max_version < MEMIF_VERSION)
     {
@@ -349,6 +298,17 @@ memif_msg_receive_hello (memif_connection_t * c, memif_msg_t * msg)
   c->run_args.log2_ring_size = memif_min (h->max_log2_ring_size,
 					  c->args.log2_ring_size);
   c->run_args.buffer_size = c->args.buffer_size;
+  c->run_args.max_region = memif_min (h->max_region, MEMIF_MAX_REGION);
+  /* hello of older master has no features (zeroed) */
+  if (h->features & MEMIF_MSG_FEATURE_PIPELINE)
+    c->flags |= MEMIF_CONNECTION_FLAG_PIPELINE;
+  else
+    c->flags &= ~MEMIF_CONNECTION_FLAG_PIPELINE;
+  /* older master advertises max_region but maps region 0 only */
+  if (h->features & MEMIF_MSG_FEATURE_MULTI_REGION)
+    c->flags |= MEMIF_CONNECTION_FLAG_MULTI_REGION;
+  else
+    c->flags &= ~MEMIF_CONNECTION_FLAG_MULTI_REGION;
   strncpy ((char *) c->remote_name, (char *) h->name,
 	   strlen ((char *) h->name));
 
@@ -360,8 +320,7 @@ static_fn int
 memif_msg_receive_init (memif_socket_t * ms, int fd, memif_msg_t * msg)
 {
   memif_msg_init_t *i = &msg->init;
-  memif_list_elt_t *elt = NULL;
-  memif_list_elt_t elt2;
+  memif_list_elt_t elt;
   memif_connection_t *c = NULL;
   libmemif_main_t *lm = &libmemif_main;
   uint8_t err_string[96];
@@ -376,8 +335,8 @@ memif_msg_receive_init (memif_socket_t * ms, int fd, memif_msg_t * msg)
       goto error;
     }
 
-  get_list_elt (&elt, ms->interface_list, ms->interface_list_len, i->id);
-  if (elt == NULL)
+  c = memif_socket_interface_get (ms, i->id);
+  if (c == NULL)
     {
       DBG ("MEMIF_ID_ERR");
       strncpy ((char *) err_string, MEMIF_ID_ERR, strlen (MEMIF_ID_ERR));
@@ -385,8 +344,6 @@ memif_msg_receive_init (memif_socket_t * ms, int fd, memif_msg_t * msg)
       goto error;
     }
 
-  c = (memif_connection_t *) elt->data_struct;
-
   if (!(c->args.is_master))
     {
       DBG ("MEMIF_SLAVE_ERR");
@@ -404,6 +361,7 @@ memif_msg_receive_init (memif_socket_t * ms, int fd, memif_msg_t * msg)
     }
 
   c->fd = fd;
+  clock_gettime (CLOCK_MONOTONIC, &c->setup_start);
 
   if (i->mode != c->args.mode)
     {
@@ -450,22 +408,40 @@ memif_msg_receive_init (memif_socket_t * ms, int fd, memif_msg_t * msg)
 	}
     }
 
+  if (i->features & MEMIF_MSG_FEATURE_PIPELINE)
+    c->flags |= MEMIF_CONNECTION_FLAG_PIPELINE;
+  else
+    c->flags &= ~MEMIF_CONNECTION_FLAG_PIPELINE;
+  if (i->features & MEMIF_MSG_FEATURE_MULTI_REGION)
+    c->flags |= MEMIF_CONNECTION_FLAG_MULTI_REGION;
+  else
+    c->flags &= ~MEMIF_CONNECTION_FLAG_MULTI_REGION;
+
+  if (memif_fd_table_set (c->fd, MEMIF_FD_TYPE_CONTROL, 0, c) < 0)
+    {
+      DBG ("MEMIF_NOMEM_ERR");
+      strncpy ((char *) err_string, MEMIF_NOMEM_ERR,
+	       strlen (MEMIF_NOMEM_ERR));
+      c->fd = -1;
+      err = MEMIF_ERR_NOMEM;
+      goto error;
+    }
+
   c->read_fn = memif_conn_fd_read_ready;
   c->write_fn = memif_conn_fd_write_ready;
   c->error_fn = memif_conn_fd_error;
 
-  elt2.key = c->fd;
-  elt2.data_struct = c;
+  elt.key = c->fd;
+  elt.data_struct = c;
 
-  add_list_elt (&elt2, &lm->control_list, &lm->control_list_len);
-  free_list_elt (lm->pending_list, lm->pending_list_len, fd);
+  add_list_elt (&elt, &lm->control_list, &lm->control_list_len);
 
   return err;
 
 error:
   memif_msg_send_disconnect (fd, err_string, 0);
   lm->control_fd_update (fd, MEMIF_FD_EVENT_DEL);
-  free_list_elt (lm->pending_list, lm->pending_list_len, fd);
+  memif_fd_table_del (fd);
   close (fd);
   fd = -1;
   return err;
@@ -477,22 +453,47 @@ memif_msg_receive_add_region (memif_connection_t * c, memif_msg_t * msg,
 			      int fd)
 {
   memif_msg_add_region_t *ar = &msg->add_region;
+  libmemif_main_t *lm = &libmemif_main;
   memif_region_t *mr;
+  int i;
   if (fd < 0)
     return MEMIF_ERR_NO_SHMFD;
 
   if (ar->index > MEMIF_MAX_REGION)
     return MEMIF_ERR_MAXREG;
 
-  mr =
-    (memif_region_t *) realloc (c->regions,
-				sizeof (memif_region_t) * (ar->index + 1));
-  if (mr == NULL)
-    return memif_syscall_error_handler (errno);
-  c->regions = mr;
+  if (ar->index >= c->regions_num)
+    {
+      mr =
+	(memif_region_t *) realloc (c->regions,
+				    sizeof (memif_region_t) * (ar->index +
+							       1));
+      if (mr == NULL)
+	return memif_syscall_error_handler (errno);
+      c->regions = mr;
+      /* regions may be received out of order */
+      for (i = c->regions_num; i < ar->index; i++)
+	{
+	  c->regions[i].fd = -1;
+	  c->regions[i].region_size = 0;
+	  c->regions[i].shm = NULL;
+	  c->regions[i].log2_page_size = 0;
+	}
+      c->regions_num = ar->index + 1;
+    }
   c->regions[ar->index].fd = fd;
   c->regions[ar->index].region_size = ar->size;
   c->regions[ar->index].shm = NULL;
+  c->regions[ar->index].log2_page_size = 0;
+
+  /* region added by slave to live connection, map before ack
+     so descriptors pointing into it can be used right away */
+  if (c->flags & MEMIF_CONNECTION_FLAG_CONNECTED)
+    {
+      lm->control_fd_update (c->fd, MEMIF_FD_EVENT_READ |
+			     MEMIF_FD_EVENT_WRITE | MEMIF_FD_EVENT_MOD);
+      return memif_region_map (c, &c->regions[ar->index]);
+    }
 
   return MEMIF_ERR_SUCCESS;	/* 0 */
 }
@@ -509,6 +510,19 @@ memif_msg_receive_add_ring (memif_connection_t * c, memif_msg_t * msg, int fd)
   if (fd < 0)
     return MEMIF_ERR_NO_INTFD;
 
+  /* larger than advertised in hello */
+  if (ar->log2_ring_size > MEMIF_MAX_LOG2_RING_SIZE)
+    return MEMIF_ERR_MAXRING;
+
+  /* ring has to lie within region announced before it */
+  if (ar->region >= c->regions_num)
+    return MEMIF_ERR_MAXREG;
+  if ((c->regions[ar->region].region_size <
+       memif_ring_bytes (ar->log2_ring_size)) ||
+      (ar->offset > c->regions[ar->region].region_size -
+       memif_ring_bytes (ar->log2_ring_size)))
+    return MEMIF_ERR_MAXRING;
+
   if (ar->flags & MEMIF_MSG_ADD_RING_FLAG_S2M)
     {
       if (ar->index > MEMIF_MAX_S2M_RING)
@@ -523,9 +537,14 @@ memif_msg_receive_add_ring (memif_connection_t * c, memif_msg_t * msg, int fd)
 	return memif_syscall_error_handler (errno);
       c->rx_queues = mq;
       c->rx_queues[ar->index].int_fd = fd;
+      memif_queue_reset_state (&c->rx_queues[ar->index]);
       c->rx_queues[ar->index].log2_ring_size = ar->log2_ring_size;
       c->rx_queues[ar->index].region = ar->region;
       c->rx_queues[ar->index].offset = ar->offset;
+      c->rx_queues[ar->index].headroom = ar->headroom;
+      c->rx_queues[ar->index].tailroom = ar->tailroom;
+      if (memif_queue_done_init (&c->rx_queues[ar->index]) < 0)
+	return memif_syscall_error_handler (errno);
       c->run_args.num_s2m_rings++;
     }
   else
@@ -542,9 +561,12 @@ memif_msg_receive_add_ring (memif_connection_t * c, memif_msg_t * msg, int fd)
 	return memif_syscall_error_handler (errno);
       c->tx_queues = mq;
       c->tx_queues[ar->index].int_fd = fd;
+      memif_queue_reset_state (&c->tx_queues[ar->index]);
       c->tx_queues[ar->index].log2_ring_size = ar->log2_ring_size;
       c->tx_queues[ar->index].region = ar->region;
       c->tx_queues[ar->index].offset = ar->offset;
+      c->tx_queues[ar->index].headroom = ar->headroom;
+      c->tx_queues[ar->index].tailroom = ar->tailroom;
       c->run_args.num_m2s_rings++;
     }
 
@@ -572,6 +594,9 @@ memif_msg_receive_connect (memif_connection_t * c, memif_msg_t * msg)
     {
       for (i = 0; i < c->run_args.num_m2s_rings; i++)
 	{
+	  if (memif_fd_table_set (c->rx_queues[i].int_fd,
+				  MEMIF_FD_TYPE_INTERRUPT, i, c) < 0)
+	    return MEMIF_ERR_NOMEM;
 	  elt.key = c->rx_queues[i].int_fd;
 	  elt.data_struct = c;
 	  add_list_elt (&elt, &lm->interrupt_list, &lm->interrupt_list_len);
@@ -581,6 +606,7 @@ memif_msg_receive_connect (memif_connection_t * c, memif_msg_t * msg)
 
     }
 
+  memif_setup_done (c);
   c->on_connect ((void *) c, c->private_ctx);
 
   return err;
@@ -605,9 +631,16 @@ memif_msg_receive_connected (memif_connection_t * c, memif_msg_t * msg)
   if (c->on_interrupt != NULL)
     {
       for (i = 0; i < c->run_args.num_s2m_rings; i++)
-	lm->control_fd_update (c->rx_queues[i].int_fd, MEMIF_FD_EVENT_READ);
+	{
+	  if (memif_fd_table_set (c->rx_queues[i].int_fd,
+				  MEMIF_FD_TYPE_INTERRUPT, i, c) < 0)
+	    return MEMIF_ERR_NOMEM;
+	  lm->control_fd_update (c->rx_queues[i].int_fd,
+				 MEMIF_FD_EVENT_READ);
+	}
     }
 
+  memif_setup_done (c);
   c->on_connect ((void *) c, c->private_ctx);
 
   return err;
@@ -641,10 +674,9 @@ memif_msg_receive (int ifd)
   int err = MEMIF_ERR_SUCCESS;	/* 0 */
   int fd = -1;
   int i;
-  libmemif_main_t *lm = &libmemif_main;
   memif_connection_t *c = NULL;
   memif_socket_t *ms = NULL;
-  memif_list_elt_t *elt = NULL;
+  memif_fd_entry_t *fe = NULL;
 
   iov[0].iov_base = (void *) &msg;
   iov[0].iov_len = sizeof (memif_msg_t);
@@ -687,13 +719,16 @@ memif_msg_receive (int ifd)
 
   DBG ("Message type %u received", msg.type);
 
-  get_list_elt (&elt, lm->control_list, lm->control_list_len, ifd);
-  if (elt != NULL)
-    c = (memif_connection_t *) elt->data_struct;
+  fe = memif_fd_table_get (ifd);
+  if ((fe != NULL) && (fe->type == MEMIF_FD_TYPE_CONTROL))
+    c = (memif_connection_t *) fe->data_struct;
 
   switch (msg.type)
     {
     case MEMIF_MSG_TYPE_ACK:
+      if ((c != NULL) && (c->flags & MEMIF_CONNECTION_FLAG_CONNECTED) &&
+	  ((err = memif_region_ack (c)) != MEMIF_ERR_SUCCESS))
+	return err;
       break;
 
     case MEMIF_MSG_TYPE_HELLO:
@@ -703,8 +738,11 @@ memif_msg_receive (int ifd)
 	return err;
       if ((err = memif_msg_enq_init (c)) != MEMIF_ERR_SUCCESS)
 	return err;
-      if ((err = memif_msg_enq_add_region (c, 0)) != MEMIF_ERR_SUCCESS)
-	return err;
+      for (i = 0; i < c->regions_num; i++)
+	{
+	  if ((err = memif_msg_enq_add_region (c, i)) != MEMIF_ERR_SUCCESS)
+	    return err;
+	}
       for (i = 0; i < c->run_args.num_s2m_rings; i++)
 	{
 	  if ((err =
@@ -724,19 +762,19 @@ memif_msg_receive (int ifd)
       break;
 
     case MEMIF_MSG_TYPE_INIT:
-      get_list_elt (&elt, lm->pending_list, lm->pending_list_len, ifd);
-      if (elt == NULL)
+      fe = memif_fd_table_get (ifd);
+      if ((fe == NULL) || (fe->type != MEMIF_FD_TYPE_PENDING))
 	return -1;
-      ms = (memif_socket_t *) elt->data_struct;
+      ms = (memif_socket_t *) fe->data_struct;
       if ((err = memif_msg_receive_init (ms, ifd, &msg)) != MEMIF_ERR_SUCCESS)
 	return err;
       /* c->remote_pid = cr->pid */
       /* c->remote_uid = cr->uid */
       /* c->remote_gid = cr->gid */
-      get_list_elt (&elt, lm->control_list, lm->control_list_len, ifd);
-      if (elt == NULL)
+      fe = memif_fd_table_get (ifd);
+      if ((fe == NULL) || (fe->type != MEMIF_FD_TYPE_CONTROL))
 	return -1;
-      c = (memif_connection_t *) elt->data_struct;
+      c = (memif_connection_t *) fe->data_struct;
       if ((err = memif_msg_enq_ack (c)) != MEMIF_ERR_SUCCESS)
 	return err;
       break;
@@ -800,20 +838,74 @@ int
 memif_conn_fd_read_ready (memif_connection_t * c)
 {
   int err;
-  err = memif_msg_receive (c->fd);
-  if (err != 0)
+  char b;
+
+  do
     {
-      err = memif_disconnect_internal (c);
+      err = memif_msg_receive (c->fd);
+      if (err != 0)
+	return memif_disconnect_internal (c);
     }
+  /* pipelining peer sends several messages at once, handle all of them */
+  while ((c->flags & MEMIF_CONNECTION_FLAG_PIPELINE) && (c->fd >= 0) &&
+	 (recv (c->fd, &b, sizeof (b), MSG_PEEK | MSG_DONTWAIT) > 0));
+
   return err;
 }
 
+/* send all queued messages by sendmmsg (up to MEMIF_MSG_BATCH_SIZE per
+   syscall), peer does not wait for ack (MEMIF_CONNECTION_FLAG_PIPELINE) */
+static_fn int
+memif_msg_send_queue (memif_connection_t * c)
+{
+  struct mmsghdr mmh[MEMIF_MSG_BATCH_SIZE];
+  struct iovec iov[MEMIF_MSG_BATCH_SIZE];
+  char ctl[MEMIF_MSG_BATCH_SIZE][CMSG_SPACE (sizeof (int))];
+  memif_msg_queue_elt_t *e;
+  int n, rv;
+
+  while (c->msg_queue != NULL)
+    {
+      memset (mmh, 0, sizeof (mmh));
+      for (n = 0, e = c->msg_queue; (e != NULL) &&
+	   (n < MEMIF_MSG_BATCH_SIZE); e = e->next, n++)
+	memif_msg_hdr_init (&mmh[n].msg_hdr, &iov[n], ctl[n], &e->msg,
+			    e->fd);
+
+      rv = sendmmsg (c->fd, mmh, n, 0);
+      if (rv < 0)
+	return memif_syscall_error_handler (errno);
+      if (rv == 0)
+	break;
+
+      while (rv--)
+	{
+	  e = c->msg_queue;
+	  c->msg_queue = e->next;
+	  DBG ("Message type %u sent", e->msg.type);
+	  memif_msg_queue_elt_put (c, e);
+	}
+    }
+
+  return MEMIF_ERR_SUCCESS;	/* 0 */
+}
+
 /* get msg from msg queue buffer and send it to socket */
 int
 memif_conn_fd_write_ready (memif_connection_t * c)
 {
+  libmemif_main_t *lm = &libmemif_main;
   int err = MEMIF_ERR_SUCCESS;	/* 0 */
 
+  if ((c->flags & MEMIF_CONNECTION_FLAG_PIPELINE) && (c->msg_queue != NULL))
+    {
+      err = memif_msg_send_queue (c);
+      if ((c->msg_queue == NULL) &&
+	  (c->flags & MEMIF_CONNECTION_FLAG_CONNECTED))
+	lm->control_fd_update (c->fd,
+			       MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_MOD);
+      goto done;
+    }
 
   if ((c->flags & MEMIF_CONNECTION_FLAG_WRITE) == 0)
     goto done;
@@ -832,7 +924,11 @@ memif_conn_fd_write_ready (memif_connection_t * c)
         MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_WRITE | MEMIF_FD_EVENT_MOD);
 */
   err = memif_msg_send (c->fd, &e->msg, e->fd);
-  free (e);
+  memif_msg_queue_elt_put (c, e);
+
+  /* messages on live connection are rare, stop polling for write */
+  if ((c->msg_queue == NULL) && (c->flags & MEMIF_CONNECTION_FLAG_CONNECTED))
+    lm->control_fd_update (c->fd, MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_MOD);
   goto done;
 
 done:
@@ -844,30 +940,43 @@ memif_conn_fd_accept_ready (memif_socket_t * ms)
 {
   int addr_len;
   struct sockaddr_un client;
-  int conn_fd;
+  int conn_fd, i, err;
   libmemif_main_t *lm = &libmemif_main;
 
   DBG ("accept called");
 
-  addr_len = sizeof (client);
-  conn_fd =
-    accept (ms->fd, (struct sockaddr *) &client, (socklen_t *) & addr_len);
-
-  if (conn_fd < 0)
+  /* listener socket is non-blocking, accept pending connections in batch
+     and leave the rest for next event */
+  for (i = 0; i < MEMIF_ACCEPT_BATCH_SIZE; i++)
     {
-      return memif_syscall_error_handler (errno);
-    }
-  DBG ("accept fd %d", ms->fd);
-  DBG ("conn fd %d", conn_fd);
+      addr_len = sizeof (client);
+      conn_fd =
+	accept (ms->fd, (struct sockaddr *) &client,
+		(socklen_t *) & addr_len);
 
-  memif_list_elt_t elt;
-  elt.key = conn_fd;
-  elt.data_struct = ms;
+      if (conn_fd < 0)
+	{
+	  /* spurious wakeup or all pending connections accepted */
+	  if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	    break;
+	  return memif_syscall_error_handler (errno);
+	}
+      DBG ("accept fd %d", ms->fd);
+      DBG ("conn fd %d", conn_fd);
+
+      if (memif_fd_table_set (conn_fd, MEMIF_FD_TYPE_PENDING, 0, ms) < 0)
+	{
+	  close (conn_fd);
+	  return MEMIF_ERR_NOMEM;
+	}
+      lm->control_fd_update (conn_fd,
+			     MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_WRITE);
 
-  add_list_elt (&elt, &lm->pending_list, &lm->pending_list_len);
-  lm->control_fd_update (conn_fd, MEMIF_FD_EVENT_READ | MEMIF_FD_EVENT_WRITE);
+      if ((err = memif_msg_send_hello (conn_fd)) != MEMIF_ERR_SUCCESS)
+	return err;
+    }
 
-  return memif_msg_send_hello (conn_fd);
+  return MEMIF_ERR_SUCCESS;
 }
 
 int
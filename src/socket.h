@@ -28,6 +28,7 @@
 #define MEMIF_MODE_ERR      "mode mismatch"
 #define MEMIF_SECRET_ERR    "incorrect secret"
 #define MEMIF_NOSECRET_ERR  "secret required"
+#define MEMIF_NOMEM_ERR     "out of memory"
 
 /* socket.c */
 
@@ -44,6 +45,9 @@ int memif_read_ready (int fd);
 int memif_msg_send_disconnect (int fd, uint8_t * err_string,
 			       uint32_t err_code);
 
+/* also used to add region to connected interface */
+int memif_msg_enq_add_region (memif_connection_t * c, uint8_t region);
+
 /* when compiling unit tests, compile functions without static keyword
    and declare functions in header file */
 #ifdef MEMIF_UNIT_TEST
@@ -51,14 +55,14 @@ int memif_msg_send_disconnect (int fd, uint8_t * err_string,
 
 int memif_msg_send (int fd, memif_msg_t * msg, int afd);
 
+int memif_msg_send_queue (memif_connection_t * c);
+
 int memif_msg_enq_ack (memif_connection_t * c);
 
 int memif_msg_send_hello (int fd);
 
 int memif_msg_enq_init (memif_connection_t * c);
 
-int memif_msg_enq_add_region (memif_connection_t * c, uint8_t region);
-
 int memif_msg_enq_add_ring (memif_connection_t * c, uint8_t index,
 			    uint8_t dir);
 
@@ -16,14 +16,21 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include <main_test.h>
 
 #include <memif_private.h>
+#include <socket.h>
 
 #define SOCKET_FILENAME "/run/vpp/memif.sock"
 
+/* number of master interfaces sharing listener socket */
+#define TEST_MULT_IF_NUM 1000
+
 uint8_t ready_called;
 #define read_call  (1 << 0)
 #define write_call (1 << 1)
@@ -60,6 +67,31 @@ register_fd_ready_fn (memif_connection_t * c,
   c->error_fn = error_fn;
 }
 
+static void
+tx_packets (memif_conn_handle_t conn, uint16_t qid, uint16_t count)
+{
+  int err;
+  uint16_t buf, tx;
+  memif_buffer_t bufs[count];
+
+  if ((err =
+       memif_buffer_alloc (conn, qid, bufs, count, &buf,
+			   0)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  if ((err =
+       memif_tx_burst (conn, qid, bufs, buf, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+}
+
+static uint64_t
+read_interrupt (int fd)
+{
+  uint64_t b = 0;
+  if (read (fd, &b, sizeof (b)) < 0)
+    return 0;
+  return b;
+}
+
 START_TEST (test_init)
 {
   int err;
@@ -99,6 +131,61 @@ START_TEST (test_init_epoll)
   lm->timerfd = -1;
 }
 
+END_TEST
+START_TEST (test_poll_events)
+{
+  int err, i;
+  int efd[3];
+  uint16_t n;
+  uint64_t v = 1;
+  struct epoll_event evt;
+  memif_stats_t st;
+
+  if ((err = memif_init (NULL, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  /* fds unknown to libmemif are ignored by memif_control_fd_handler */
+  for (i = 0; i < 3; i++)
+    {
+      efd[i] = eventfd (0, EFD_NONBLOCK);
+      ck_assert_int_gt (efd[i], -1);
+      memset (&evt, 0, sizeof (evt));
+      evt.events = EPOLLIN;
+      evt.data.fd = efd[i];
+      ck_assert_int_eq (epoll_ctl (memif_epfd, EPOLL_CTL_ADD, efd[i], &evt),
+			0);
+      ck_assert_int_eq (write (efd[i], &v, sizeof (v)), sizeof (v));
+    }
+
+  ck_assert_uint_eq (memif_poll_events (0, 0, &n), MEMIF_ERR_INVAL_ARG);
+
+  if ((err = memif_poll_events (0, 8, &n)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (n, 3);
+
+  if ((err = memif_get_stats (&st)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (st.poll_calls, 1);
+  ck_assert_uint_eq (st.poll_events, 3);
+  ck_assert_uint_eq (st.poll_max_events, 3);
+
+  /* level triggered, single event per call */
+  if ((err = memif_poll_event (0)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  memif_get_stats (&st);
+  ck_assert_uint_eq (st.poll_calls, 2);
+  ck_assert_uint_eq (st.poll_events, 4);
+
+  for (i = 0; i < 3; i++)
+    close (efd[i]);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+}
+
 END_TEST
 START_TEST (test_create)
 {
@@ -153,7 +240,7 @@ START_TEST (test_create)
   struct itimerspec timer;
   timerfd_gettime (lm->timerfd, &timer);
 
-  ck_assert_msg (timer.it_interval.tv_sec == lm->arm.it_interval.tv_sec,
+  ck_assert_msg (timer.it_value.tv_sec || timer.it_value.tv_nsec,
 		 "timerfd not armed!");
 
   if (lm->timerfd > 0)
@@ -223,6 +310,14 @@ START_TEST (test_create_master)
 
   ck_assert (S_ISSOCK (file_stat.st_mode));
 
+  /* listener wakeup without pending connection */
+  memif_fd_entry_t *fe = memif_fd_table_get (c->listener_fd);
+  ck_assert_ptr_ne (fe, NULL);
+  if ((err =
+       memif_conn_fd_accept_ready ((memif_socket_t *) fe->data_struct)) !=
+      MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
   memif_delete (&conn);
   ck_assert_ptr_eq (conn, NULL);
 }
@@ -309,7 +404,7 @@ START_TEST (test_create_mult)
   struct itimerspec timer;
   timerfd_gettime (lm->timerfd, &timer);
 
-  ck_assert_msg (timer.it_interval.tv_sec == lm->arm.it_interval.tv_sec,
+  ck_assert_msg (timer.it_value.tv_sec || timer.it_value.tv_nsec,
 		 "timerfd not armed!");
 
   if (lm->timerfd > 0)
@@ -320,6 +415,78 @@ START_TEST (test_create_mult)
   ck_assert_ptr_eq (conn, NULL);
 }
 
+END_TEST
+START_TEST (test_create_master_mult_socket)
+{
+  int err, i, listener_fd;
+  memif_conn_handle_t conn[TEST_MULT_IF_NUM];
+  memif_conn_handle_t conn1 = NULL;
+  memif_conn_args_t args;
+  memif_socket_t *ms, *ms1;
+  memset (conn, 0, sizeof (conn));
+  memset (&args, 0, sizeof (args));
+  args.is_master = 1;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+
+  for (i = 0; i < TEST_MULT_IF_NUM; i++)
+    {
+      args.interface_id = i * 7919;
+      if ((err = memif_create (&conn[i], &args, on_connect,
+			       on_disconnect, on_interrupt,
+			       NULL)) != MEMIF_ERR_SUCCESS)
+	ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+    }
+
+  /* filename with existing socket filename as prefix gets its own socket */
+  args.socket_filename = (uint8_t *) SOCKET_FILENAME "1";
+  args.interface_id = 0;
+  if ((err = memif_create (&conn1, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn[0];
+  memif_connection_t *c1 = (memif_connection_t *) conn1;
+
+  ck_assert_int_ne (c->listener_fd, c1->listener_fd);
+  ck_assert_ptr_ne (memif_fd_table_get (c->listener_fd), NULL);
+  ck_assert_ptr_ne (memif_fd_table_get (c1->listener_fd), NULL);
+  ms = (memif_socket_t *) memif_fd_table_get (c->listener_fd)->data_struct;
+  ms1 = (memif_socket_t *) memif_fd_table_get (c1->listener_fd)->data_struct;
+
+  ck_assert_uint_eq (ms->use_count, TEST_MULT_IF_NUM);
+  ck_assert_uint_eq (ms1->use_count, 1);
+  ck_assert_ptr_eq (memif_socket_interface_get (ms1, 0), conn1);
+  ck_assert_ptr_eq (memif_socket_interface_get (ms1, 7919), NULL);
+
+  for (i = 0; i < TEST_MULT_IF_NUM; i++)
+    {
+      c = (memif_connection_t *) conn[i];
+      ck_assert_int_eq (c->listener_fd, ms->fd);
+      ck_assert_ptr_eq (memif_socket_interface_get (ms, i * 7919), conn[i]);
+    }
+
+  /* remaining interfaces are still found after removing every other one */
+  for (i = 0; i < TEST_MULT_IF_NUM; i += 2)
+    memif_delete (&conn[i]);
+  for (i = 0; i < TEST_MULT_IF_NUM; i++)
+    ck_assert_ptr_eq (memif_socket_interface_get (ms, i * 7919),
+		      (i % 2) ? conn[i] : NULL);
+
+  listener_fd = ms->fd;
+  for (i = 1; i < TEST_MULT_IF_NUM; i += 2)
+    memif_delete (&conn[i]);
+  ck_assert_ptr_eq (memif_fd_table_get (listener_fd), NULL);
+
+  memif_delete (&conn1);
+  ck_assert_ptr_eq (conn1, NULL);
+}
+
 END_TEST
 START_TEST (test_control_fd_handler)
 {
@@ -358,6 +525,7 @@ START_TEST (test_control_fd_handler)
   c->fd = 69;
   lm->control_list[0].key = c->fd;
   lm->control_list[0].data_struct = c;
+  memif_fd_table_set (c->fd, MEMIF_FD_TYPE_CONTROL, 0, c);
 
   if ((err =
        memif_control_fd_handler (c->fd,
@@ -389,19 +557,21 @@ START_TEST (test_control_fd_handler)
 }
 
 END_TEST
-START_TEST (test_buffer_alloc)
+static int interrupt_qid = -1;
+
+static int
+on_interrupt_qid (memif_conn_handle_t conn, void *ctx, uint16_t qid)
 {
-  int err, i;
-  uint8_t qid;
-  uint16_t buf;
-  memif_buffer_t *bufs;
-  uint16_t max_buf = 10;
-  ready_called = 0;
+  interrupt_qid = qid;
+  return 0;
+}
+
+START_TEST (test_fd_dispatch)
+{
+  int err;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
   memset (&args, 0, sizeof (args));
-  args.num_s2m_rings = 2;
-  args.num_m2s_rings = 2;
 
   libmemif_main_t *lm = &libmemif_main;
 
@@ -414,80 +584,241 @@ START_TEST (test_buffer_alloc)
 	   strlen (TEST_APP_NAME));
 
   if ((err = memif_create (&conn, &args, on_connect,
-			   on_disconnect, on_interrupt,
+			   on_disconnect, on_interrupt_qid,
 			   NULL)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  memif_connection_t *c = (memif_connection_t *) conn;
+  /* table grows to cover high fd numbers */
+  ck_assert_int_eq (memif_fd_table_set (5000, MEMIF_FD_TYPE_INTERRUPT, 3,
+					conn), 0);
+  ck_assert_uint_gt (lm->fd_table_len, 5000);
+  ck_assert_ptr_eq (memif_fd_table_get (4999), NULL);
 
-  c->run_args.num_s2m_rings = 2;
-  c->run_args.num_m2s_rings = 2;
-  c->run_args.log2_ring_size = 10;
-  c->run_args.buffer_size = 2048;
+  interrupt_qid = -1;
+  if ((err =
+       memif_control_fd_handler (5000,
+				 MEMIF_FD_EVENT_READ)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_int_eq (interrupt_qid, 3);
 
-  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+  /* removed fd is not dispatched */
+  memif_fd_table_del (5000);
+  ck_assert_ptr_eq (memif_fd_table_get (5000), NULL);
+  interrupt_qid = -1;
+  if ((err =
+       memif_control_fd_handler (5000,
+				 MEMIF_FD_EVENT_READ)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_int_eq (interrupt_qid, -1);
 
-  c->fd = 69;
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
 
-  /* test buffer allocation qid 0 (positive) */
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
 
-  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+END_TEST
+/* interrupt handler of qid 1 hands fd of qid 0 over to qid 2,
+   like fd closed and its number reused by other queue */
+static int stale_fd = -1;
+static int stale_qids[4];
+static int stale_calls;
+
+static int
+on_interrupt_reuse (memif_conn_handle_t conn, void *ctx, uint16_t qid)
+{
+  if (stale_calls < 4)
+    stale_qids[stale_calls++] = qid;
+  if (qid == 1)
+    {
+      memif_fd_table_del (stale_fd);
+      memif_fd_table_set (stale_fd, MEMIF_FD_TYPE_INTERRUPT, 2, conn);
+    }
+  return 0;
+}
 
-  qid = 0;
-  if ((err =
-       memif_buffer_alloc (conn, qid, bufs, max_buf,
-			   &buf)) != MEMIF_ERR_SUCCESS)
-    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+START_TEST (test_poll_events_stale)
+{
+  int err, i;
+  int efd[2];
+  uint16_t n;
+  uint64_t v = 1;
+  struct epoll_event evt;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
 
-  ck_assert_uint_eq (buf, max_buf);
-  for (i = 0; i < max_buf; i++)
-    ck_assert_uint_eq (bufs[i].buffer_len, MEMIF_DEFAULT_BUFFER_SIZE);
+  libmemif_main_t *lm = &libmemif_main;
 
-  /* test buffer allocation qid 1 (positive) */
-  free (bufs);
-  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+  if ((err = memif_init (NULL, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  qid = 1;
-  if ((err =
-       memif_buffer_alloc (conn, qid, bufs, max_buf,
-			   &buf)) != MEMIF_ERR_SUCCESS)
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt_reuse,
+			   NULL)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_uint_eq (buf, max_buf);
-  for (i = 0; i < max_buf; i++)
-    ck_assert_uint_eq (bufs[i].buffer_len, MEMIF_DEFAULT_BUFFER_SIZE);
+  /* fd of qid 1 becomes ready first, so its event is first in batch */
+  for (i = 1; i >= 0; i--)
+    {
+      efd[i] = eventfd (0, EFD_NONBLOCK);
+      ck_assert_int_gt (efd[i], -1);
+      ck_assert_int_eq (memif_fd_table_set (efd[i], MEMIF_FD_TYPE_INTERRUPT,
+					    i, conn), 0);
+      memset (&evt, 0, sizeof (evt));
+      evt.events = EPOLLIN;
+      evt.data.fd = efd[i];
+      ck_assert_int_eq (epoll_ctl (memif_epfd, EPOLL_CTL_ADD, efd[i], &evt),
+			0);
+      ck_assert_int_eq (write (efd[i], &v, sizeof (v)), sizeof (v));
+    }
+  stale_fd = efd[0];
+  stale_calls = 0;
 
-  /* test buffer allocation qid 2 (negative) */
+  if ((err = memif_poll_events (0, 8, &n)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (n, 2);
 
-  free (bufs);
-  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+  /* event fetched before fd changed owner is not dispatched to new owner */
+  for (i = 0; i < stale_calls; i++)
+    ck_assert_int_ne (stale_qids[i], 2);
 
-  qid = 2;
-  if ((err =
-       memif_buffer_alloc (conn, qid, bufs, max_buf,
-			   &buf)) != MEMIF_ERR_SUCCESS)
-    ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
-		   memif_strerror (err));
+  /* new owner gets events from next call */
+  stale_calls = 0;
+  epoll_ctl (memif_epfd, EPOLL_CTL_DEL, efd[1], NULL);
+  if ((err = memif_poll_events (0, 8, &n)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_int_eq (stale_calls, 1);
+  ck_assert_int_eq (stale_qids[0], 2);
+
+  for (i = 0; i < 2; i++)
+    {
+      epoll_ctl (memif_epfd, EPOLL_CTL_DEL, efd[i], NULL);
+      memif_fd_table_del (efd[i]);
+      close (efd[i]);
+    }
 
   if (lm->timerfd > 0)
     close (lm->timerfd);
   lm->timerfd = -1;
 
-  free (bufs);
-  bufs = NULL;
-
   memif_delete (&conn);
   ck_assert_ptr_eq (conn, NULL);
 }
 
 END_TEST
-START_TEST (test_tx_burst)
+START_TEST (test_connect_backoff)
+{
+  int err, i;
+  uint64_t now;
+  memif_conn_handle_t conn[16];
+  memif_conn_handle_t master = NULL;
+  memif_conn_args_t args;
+  memif_connection_t *c, **heap;
+  memset (conn, 0, sizeof (conn));
+  memset (&args, 0, sizeof (args));
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  args.socket_filename = (uint8_t *) SOCKET_FILENAME "2";
+  unlink (SOCKET_FILENAME "2");
+
+  for (i = 0; i < 16; i++)
+    {
+      args.interface_id = i;
+      if ((err = memif_create (&conn[i], &args, on_connect,
+			       on_disconnect, on_interrupt,
+			       NULL)) != MEMIF_ERR_SUCCESS)
+	ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+    }
+
+  /* timer is armed for earliest attempt, heap keeps the rest ordered */
+  heap = lm->connect_heap;
+  ck_assert_uint_eq (lm->connect_heap_len, 16);
+  ck_assert_uint_eq (lm->timer_usecs, heap[0]->connect_at_usecs);
+  for (i = 1; i < 16; i++)
+    ck_assert_uint_le (heap[(i - 1) / 2]->connect_at_usecs,
+		       heap[i]->connect_at_usecs);
+
+  for (i = 1; i < 16; i++)
+    memif_delete (&conn[i]);
+  ck_assert_uint_eq (lm->connect_heap_len, 1);
+
+  /* failed attempt is retried with twice the delay */
+  c = (memif_connection_t *) conn[0];
+  ck_assert_uint_eq (c->connect_backoff_msec,
+		     2 * MEMIF_CONNECT_BACKOFF_MIN_MSEC);
+  c->connect_at_usecs = 0;
+  now = memif_time_usecs ();
+  if ((err =
+       memif_control_fd_handler (lm->timerfd,
+				 MEMIF_FD_EVENT_READ)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (lm->stats.connect_calls, 1);
+  ck_assert_uint_eq (lm->stats.connect_errors, 1);
+  ck_assert_int_eq (c->fd, -1);
+  ck_assert_uint_eq (c->connect_heap_index, 1);
+  ck_assert_uint_eq (c->connect_backoff_msec,
+		     4 * MEMIF_CONNECT_BACKOFF_MIN_MSEC);
+  ck_assert_uint_ge (c->connect_at_usecs,
+		     now + MEMIF_CONNECT_BACKOFF_MIN_MSEC * 1000);
+  ck_assert_uint_eq (lm->timer_usecs, c->connect_at_usecs);
+
+  /* slave which is not due is not touched */
+  if ((err =
+       memif_control_fd_handler (lm->timerfd,
+				 MEMIF_FD_EVENT_READ)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (lm->stats.connect_calls, 1);
+
+  args.is_master = 1;
+  args.interface_id = 0;
+  if ((err = memif_create (&master, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->connect_at_usecs = 0;
+  if ((err =
+       memif_control_fd_handler (lm->timerfd,
+				 MEMIF_FD_EVENT_READ)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (lm->stats.connect_calls, 2);
+  ck_assert_uint_eq (lm->stats.connects, 1);
+  ck_assert_int_ge (c->fd, 0);
+  ck_assert_uint_eq (c->disconnect_usecs, 0);
+  ck_assert_uint_eq (lm->connect_heap_len, 0);
+  ck_assert_uint_eq (lm->timer_usecs, 0);
+
+  memif_delete (&conn[0]);
+  ck_assert_ptr_eq (conn[0], NULL);
+  ck_assert_uint_eq (lm->connect_heap_len, 0);
+  memif_delete (&master);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+}
+
+END_TEST
+START_TEST (test_buffer_alloc)
 {
   int err, i;
-  uint16_t max_buf = 10, buf, tx;
   uint8_t qid;
+  uint16_t buf;
   memif_buffer_t *bufs;
+  uint16_t max_buf = 10;
   ready_called = 0;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
@@ -522,9 +853,10 @@ START_TEST (test_tx_burst)
 
   c->fd = 69;
 
-  /* test transmit qid 0 (positive) */
+  /* test buffer allocation qid 0 (positive) */
 
   bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
   qid = 0;
   if ((err =
        memif_buffer_alloc (conn, qid, bufs, max_buf,
@@ -535,17 +867,10 @@ START_TEST (test_tx_burst)
   for (i = 0; i < max_buf; i++)
     ck_assert_uint_eq (bufs[i].buffer_len, MEMIF_DEFAULT_BUFFER_SIZE);
 
-  if ((err =
-       memif_tx_burst (conn, qid, bufs, max_buf, &tx)) != MEMIF_ERR_SUCCESS)
-    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
-
-  ck_assert_uint_eq (tx, max_buf);
-  for (i = 0; i < max_buf; i++)
-    ck_assert_ptr_eq (bufs[i].data, NULL);
-
-  /* test transmit qid 1 (positive) */
+  /* test buffer allocation qid 1 (positive) */
   free (bufs);
   bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
   qid = 1;
   if ((err =
        memif_buffer_alloc (conn, qid, bufs, max_buf,
@@ -556,26 +881,22 @@ START_TEST (test_tx_burst)
   for (i = 0; i < max_buf; i++)
     ck_assert_uint_eq (bufs[i].buffer_len, MEMIF_DEFAULT_BUFFER_SIZE);
 
-  if ((err =
-       memif_tx_burst (conn, qid, bufs, max_buf, &tx)) != MEMIF_ERR_SUCCESS)
-    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
-
-  ck_assert_uint_eq (tx, max_buf);
-  for (i = 0; i < max_buf; i++)
-    ck_assert_ptr_eq (bufs[i].data, NULL);
+  /* test buffer allocation qid 2 (negative) */
 
-  /* test transmit qid 2 (negative) */
   free (bufs);
   bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
   qid = 2;
   if ((err =
-       memif_tx_burst (conn, qid, bufs, max_buf, &tx)) != MEMIF_ERR_SUCCESS)
+       memif_buffer_alloc (conn, qid, bufs, max_buf,
+			   &buf)) != MEMIF_ERR_SUCCESS)
     ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
 		   memif_strerror (err));
 
   if (lm->timerfd > 0)
     close (lm->timerfd);
   lm->timerfd = -1;
+
   free (bufs);
   bufs = NULL;
 
@@ -584,20 +905,18 @@ START_TEST (test_tx_burst)
 }
 
 END_TEST
-START_TEST (test_rx_burst)
+START_TEST (test_buffer_alloc_single)
 {
   int err, i;
-  uint16_t max_buf = 10, buf, rx;
-  uint8_t qid;
-  memif_buffer_t *bufs;
+  uint16_t buf;
+  uint8_t qid = 0;
+  memif_buffer_t bufs[16];
   memif_queue_t *mq;
   memif_ring_t *ring;
   ready_called = 0;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
   memset (&args, 0, sizeof (args));
-  args.num_s2m_rings = 2;
-  args.num_m2s_rings = 2;
 
   libmemif_main_t *lm = &libmemif_main;
 
@@ -616,77 +935,60 @@ START_TEST (test_rx_burst)
 
   memif_connection_t *c = (memif_connection_t *) conn;
 
-  c->run_args.num_s2m_rings = 2;
-  c->run_args.num_m2s_rings = 2;
-  c->run_args.log2_ring_size = 10;
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 4;
   c->run_args.buffer_size = 2048;
 
   if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  if ((err = memif_connect1 (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
   c->fd = 69;
+  mq = &c->tx_queues[qid];
+  ring = mq->ring;
+  ck_assert_uint_eq (mq->buffer_size, 2048);
 
-  /* test receive qid 0 (positive) */
-  qid = 0;
-  mq = &c->rx_queues[qid];
-  ring = mq->ring;
-  ring->head += max_buf;
-
-  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
-
-  if ((err =
-       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
-    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
-
-  ck_assert_uint_eq (rx, max_buf);
-  for (i = 0; i < max_buf; i++)
-    ck_assert_ptr_ne (bufs[i].data, NULL);
-
-  /* test receive qid 1 (positive) */
-  qid = 1;
-  mq = &c->rx_queues[qid];
-  ring = mq->ring;
-  ring->head += max_buf;
-
-  free (bufs);
-  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
-
+  ring->desc[0].flags = MEMIF_DESC_FLAG_NEXT;
   if ((err =
-       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+       memif_buffer_alloc_single (conn, qid, bufs, 10,
+				  &buf)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (buf, 10);
+  ck_assert_uint_eq (ring->desc[0].flags, 0);
+  for (i = 0; i < buf; i++)
+    {
+      ck_assert_uint_eq (bufs[i].desc_index, i);
+      ck_assert_uint_eq (bufs[i].buffer_len, 2048);
+      ck_assert_ptr_eq (bufs[i].data, memif_get_buffer (c, ring, i));
+    }
 
-  ck_assert_uint_eq (rx, max_buf);
-  for (i = 0; i < max_buf; i++)
-    ck_assert_ptr_ne (bufs[i].data, NULL);
-
-  /* test receive qid 2 (negative) */
-  free (bufs);
-  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
-
+  /* memif_buffer_alloc takes same path, 5 of 15 usable slots left */
   if ((err =
-       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
-    ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
-		   memif_strerror (err));
+       memif_buffer_alloc (conn, qid, bufs + 10, 6, &buf,
+			   100)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_NOBUF_RING, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+  ck_assert_uint_eq (buf, 5);
+  ck_assert_uint_eq (bufs[14].desc_index, 14);
+  ck_assert_uint_eq (mq->alloc_bufs, 15);
 
   if (lm->timerfd > 0)
     close (lm->timerfd);
   lm->timerfd = -1;
-  free (bufs);
-  bufs = NULL;
 
   memif_delete (&conn);
   ck_assert_ptr_eq (conn, NULL);
 }
 
 END_TEST
-START_TEST (test_buffer_free)
+START_TEST (test_tx_burst)
 {
   int err, i;
-  uint16_t max_buf = 10, buf, rx;
+  uint16_t max_buf = 10, buf, tx;
   uint8_t qid;
   memif_buffer_t *bufs;
-  memif_queue_t *mq;
-  memif_ring_t *ring;
   ready_called = 0;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
@@ -721,68 +1023,54 @@ START_TEST (test_buffer_free)
 
   c->fd = 69;
 
-  /* test buffer free qid 0 (positive) */
-  qid = 0;
-  mq = &c->rx_queues[qid];
-  ring = mq->ring;
-  ring->head += 10;
+  /* test transmit qid 0 (positive) */
 
   bufs = malloc (sizeof (memif_buffer_t) * max_buf);
-
+  qid = 0;
   if ((err =
-       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+       memif_buffer_alloc (conn, qid, bufs, max_buf,
+			   &buf)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_uint_eq (rx, max_buf);
+  ck_assert_uint_eq (buf, max_buf);
   for (i = 0; i < max_buf; i++)
-    ck_assert_ptr_ne (bufs[i].data, NULL);
+    ck_assert_uint_eq (bufs[i].buffer_len, MEMIF_DEFAULT_BUFFER_SIZE);
 
   if ((err =
-       memif_buffer_free (conn, qid, bufs, max_buf,
-			  &buf)) != MEMIF_ERR_SUCCESS)
+       memif_tx_burst (conn, qid, bufs, max_buf, &tx)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_uint_eq (buf, max_buf);
+  ck_assert_uint_eq (tx, max_buf);
   for (i = 0; i < max_buf; i++)
     ck_assert_ptr_eq (bufs[i].data, NULL);
-  ck_assert_uint_eq (ring->head, ring->tail);
-
-  /* test buffer free qid 1 (positive) */
-  qid = 1;
-  mq = &c->rx_queues[qid];
-  ring = mq->ring;
-  ring->head += 10;
 
+  /* test transmit qid 1 (positive) */
   free (bufs);
   bufs = malloc (sizeof (memif_buffer_t) * max_buf);
-
+  qid = 1;
   if ((err =
-       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+       memif_buffer_alloc (conn, qid, bufs, max_buf,
+			   &buf)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_uint_eq (rx, max_buf);
+  ck_assert_uint_eq (buf, max_buf);
   for (i = 0; i < max_buf; i++)
-    ck_assert_ptr_ne (bufs[i].data, NULL);
+    ck_assert_uint_eq (bufs[i].buffer_len, MEMIF_DEFAULT_BUFFER_SIZE);
 
   if ((err =
-       memif_buffer_free (conn, qid, bufs, max_buf,
-			  &buf)) != MEMIF_ERR_SUCCESS)
+       memif_tx_burst (conn, qid, bufs, max_buf, &tx)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_uint_eq (buf, max_buf);
+  ck_assert_uint_eq (tx, max_buf);
   for (i = 0; i < max_buf; i++)
     ck_assert_ptr_eq (bufs[i].data, NULL);
-  ck_assert_uint_eq (ring->head, ring->tail);
-
 
-  /* test buffer free qid 2 (negative) */
-  qid = 2;
+  /* test transmit qid 2 (negative) */
   free (bufs);
   bufs = malloc (sizeof (memif_buffer_t) * max_buf);
-
+  qid = 2;
   if ((err =
-       memif_buffer_free (conn, qid, bufs, max_buf,
-			  &buf)) != MEMIF_ERR_SUCCESS)
+       memif_tx_burst (conn, qid, bufs, max_buf, &tx)) != MEMIF_ERR_SUCCESS)
     ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
 		   memif_strerror (err));
 
@@ -797,15 +1085,18 @@ START_TEST (test_buffer_free)
 }
 
 END_TEST
-START_TEST (test_get_details)
+START_TEST (test_tx_ring_full)
 {
-  int err, i;
+  int err;
+  uint16_t ring_size = 1 << 10, buf, tx;
+  uint8_t qid = 0;
+  memif_buffer_t *bufs;
+  memif_queue_t *mq;
+  memif_ring_t *ring;
   ready_called = 0;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
   memset (&args, 0, sizeof (args));
-  args.num_s2m_rings = 2;
-  args.num_m2s_rings = 2;
 
   libmemif_main_t *lm = &libmemif_main;
 
@@ -824,67 +1115,72 @@ START_TEST (test_get_details)
 
   memif_connection_t *c = (memif_connection_t *) conn;
 
-  c->run_args.num_s2m_rings = 2;
-  c->run_args.num_m2s_rings = 2;
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
   c->run_args.log2_ring_size = 10;
   c->run_args.buffer_size = 2048;
 
   if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  memif_details_t md;
-  memset (&md, 0, sizeof (md));
-  ssize_t buflen = 2048;
-  char *buf = malloc (buflen);
-  memset (buf, 0, buflen);
+  c->fd = 69;
 
-  if ((err = memif_get_details (conn, &md, buf, buflen)) != MEMIF_ERR_SUCCESS)
+  mq = &c->tx_queues[qid];
+  ring = mq->ring;
+  bufs = malloc (sizeof (memif_buffer_t) * ring_size);
+
+  /* fill whole ring (one slot is always left empty) */
+  if ((err =
+       memif_buffer_alloc (conn, qid, bufs, ring_size - 1,
+			   &buf, 0)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (buf, ring_size - 1);
 
-  ck_assert_str_eq (md.if_name, c->args.interface_name);
-  ck_assert_str_eq (md.inst_name, c->args.instance_name);
-  ck_assert_str_eq (md.remote_if_name, c->remote_if_name);
-  ck_assert_str_eq (md.remote_inst_name, c->remote_name);
-  ck_assert_str_eq (md.secret, c->args.secret);
-  ck_assert_str_eq (md.socket_filename, c->args.socket_filename);
+  if ((err =
+       memif_tx_burst (conn, qid, bufs, buf, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (tx, ring_size - 1);
+  ck_assert_uint_eq (ring->head, ring_size - 1);
+  ck_assert_uint_eq (mq->last_head, ring->head);
 
-  ck_assert_uint_eq (md.id, c->args.interface_id);
-  ck_assert_uint_ne (md.role, c->args.is_master);
-  ck_assert_uint_eq (md.mode, c->args.mode);
-  for (i = 0; i < md.rx_queues_num; i++)
-    {
-      ck_assert_uint_eq (md.rx_queues[i].qid, i);
-      ck_assert_uint_eq (md.rx_queues[i].ring_size,
-			 (1 << c->args.log2_ring_size));
-      ck_assert_uint_eq (md.rx_queues[i].buffer_size, c->args.buffer_size);
-    }
-  for (i = 0; i < md.tx_queues_num; i++)
-    {
-      ck_assert_uint_eq (md.tx_queues[i].qid, i);
-      ck_assert_uint_eq (md.tx_queues[i].ring_size,
-			 (1 << c->args.log2_ring_size));
-      ck_assert_uint_eq (md.tx_queues[i].buffer_size, c->args.buffer_size);
-    }
-  ck_assert_uint_eq (md.link_up_down, 0);
+  /* ring full (negative) */
+  if ((err =
+       memif_buffer_alloc (conn, qid, bufs, 1, &buf, 0)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_NOBUF_RING, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+  ck_assert_uint_eq (buf, 0);
+
+  /* peer consumed buffers, cached tail is refreshed (positive) */
+  ring->tail = 16;
+  if ((err =
+       memif_buffer_alloc (conn, qid, bufs, 16, &buf, 0)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (buf, 16);
+  ck_assert_uint_eq (mq->last_tail, 16);
+  ck_assert_uint_eq (bufs[0].desc_index, ring_size - 1);
+  ck_assert_uint_eq (bufs[1].desc_index, 0);
 
   if (lm->timerfd > 0)
     close (lm->timerfd);
   lm->timerfd = -1;
+  free (bufs);
+  bufs = NULL;
 
   memif_delete (&conn);
   ck_assert_ptr_eq (conn, NULL);
 }
 
 END_TEST
-START_TEST (test_init_regions_and_queues)
+START_TEST (test_tx_coalesce)
 {
-  int err;
+  int err, i;
+  uint8_t qid = 0;
+  memif_queue_t *mq;
+  memif_tx_coalesce_t cfg;
   ready_called = 0;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
   memset (&args, 0, sizeof (args));
-  args.num_s2m_rings = 2;
-  args.num_m2s_rings = 2;
 
   libmemif_main_t *lm = &libmemif_main;
 
@@ -903,25 +1199,90 @@ START_TEST (test_init_regions_and_queues)
 
   memif_connection_t *c = (memif_connection_t *) conn;
 
-  c->run_args.num_s2m_rings = 2;
-  c->run_args.num_m2s_rings = 2;
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
   c->run_args.log2_ring_size = 10;
   c->run_args.buffer_size = 2048;
 
   if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_ptr_ne (c->regions, NULL);
-  ck_assert_ptr_ne (c->tx_queues, NULL);
-  ck_assert_ptr_ne (c->rx_queues, NULL);
-
-  ck_assert_ptr_ne (c->regions->shm, NULL);
-  ck_assert_ptr_ne (c->tx_queues->ring, NULL);
-  ck_assert_ptr_ne (c->rx_queues->ring, NULL);
+  c->fd = 69;
+  mq = &c->tx_queues[qid];
+
+  /* no coalescing, interrupt every burst */
+  tx_packets (conn, qid, 10);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 1);
+  ck_assert_uint_eq (mq->int_sent, 1);
+
+  /* packet limit without time limit (negative) */
+  memset (&cfg, 0, sizeof (cfg));
+  cfg.max_packets = 32;
+  if ((err = memif_set_tx_coalesce (conn, qid, &cfg)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+  else
+    ck_abort_msg ("packet limit accepted without time limit");
+
+  /* packet limit, time limit long enough not to expire */
+  cfg.max_usecs = 10000000;
+  if ((err = memif_set_tx_coalesce (conn, qid, &cfg)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_int_ne (c->regions->fd, -1);
-  ck_assert_uint_eq (c->tx_queues->ring->cookie, MEMIF_COOKIE);
-  ck_assert_uint_eq (c->rx_queues->ring->cookie, MEMIF_COOKIE);
+  for (i = 0; i < 3; i++)
+    tx_packets (conn, qid, 10);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 0);
+  ck_assert_uint_eq (mq->int_suppressed, 3);
+  tx_packets (conn, qid, 10);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 1);
+  ck_assert_uint_eq (mq->int_sent, 2);
+
+  /* ring occupancy threshold, 6% of 1024 slots (50 slots used so far) */
+  cfg.max_packets = 1000;
+  cfg.ring_threshold = 6;
+  if ((err = memif_set_tx_coalesce (conn, qid, &cfg)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  tx_packets (conn, qid, 10);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 0);
+  tx_packets (conn, qid, 10);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 1);
+
+  /* time limit */
+  cfg.ring_threshold = 0;
+  cfg.max_usecs = 1000;
+  if ((err = memif_set_tx_coalesce (conn, qid, &cfg)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_int_gt (mq->int_timer_fd, 0);
+  tx_packets (conn, qid, 10);
+  ck_assert_uint_eq (mq->int_timer_armed, 1);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 0);
+  usleep (2000);
+  if ((err =
+       memif_control_fd_handler (mq->int_timer_fd,
+				 MEMIF_FD_EVENT_READ)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 1);
+  ck_assert_uint_eq (mq->int_sent, 4);
+  ck_assert_uint_eq (mq->int_suppressed, 5);
+  ck_assert_uint_eq (mq->int_timer_armed, 0);
+
+  /* packets signaled by timer are not signaled again by next burst,
+     next suppressed burst arms timer again */
+  tx_packets (conn, qid, 10);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 0);
+  ck_assert_uint_eq (mq->int_pending, 10);
+  ck_assert_uint_eq (mq->int_timer_armed, 1);
+
+  /* invalid threshold (negative) */
+  cfg.ring_threshold = 101;
+  if ((err = memif_set_tx_coalesce (conn, qid, &cfg)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+
+  /* qid 1 (negative) */
+  if ((err = memif_set_tx_coalesce (conn, 1, &cfg)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
+		   memif_strerror (err));
 
   if (lm->timerfd > 0)
     close (lm->timerfd);
@@ -932,15 +1293,24 @@ START_TEST (test_init_regions_and_queues)
 }
 
 END_TEST
-START_TEST (test_connect1)
+START_TEST (test_buffer_classes)
 {
-  int err;
+  int err, i;
+  uint16_t buf, tx;
+  uint16_t sizes[4] = { 64, 1500, 9000, 30000 };
+  uint8_t qid = 0;
+  memif_buffer_t bufs[4];
+  memif_queue_t *mq;
+  memif_ring_t *ring;
   ready_called = 0;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
   memset (&args, 0, sizeof (args));
-  args.num_s2m_rings = 2;
-  args.num_m2s_rings = 2;
+  args.buffer_classes[0].size = 256;
+  args.buffer_classes[0].share = 50;
+  args.buffer_classes[1].size = 2048;
+  args.buffer_classes[1].share = 25;
+  args.buffer_classes[2].size = 10240;
 
   libmemif_main_t *lm = &libmemif_main;
 
@@ -959,17 +1329,79 @@ START_TEST (test_connect1)
 
   memif_connection_t *c = (memif_connection_t *) conn;
 
-  c->run_args.num_s2m_rings = 2;
-  c->run_args.num_m2s_rings = 2;
-  c->run_args.log2_ring_size = 10;
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 4;
   c->run_args.buffer_size = 2048;
 
   if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
-
   if ((err = memif_connect1 (c)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
+  c->fd = 69;
+  mq = &c->tx_queues[qid];
+  ring = mq->ring;
+
+  /* 8 x 256 B, 4 x 2 KB, 4 x 10 KB slots */
+  ck_assert_uint_eq (ring->desc[7].buffer_length, 256);
+  ck_assert_uint_eq (ring->desc[8].buffer_length, 2048);
+  ck_assert_uint_eq (ring->desc[8].offset - ring->desc[7].offset, 256);
+  ck_assert_uint_eq (ring->desc[15].buffer_length, 10240);
+  ck_assert_uint_eq (mq->num_pools, 3);
+  ck_assert_uint_eq (mq->pools[0].n_free, 8);
+  ck_assert_uint_eq (mq->pools[2].n_free, 4);
+
+  /* smallest fitting buffer, chained 10 KB buffers for 30000 B */
+  for (i = 0; i < 4; i++)
+    {
+      if ((err =
+	   memif_buffer_alloc (conn, qid, bufs + i, 1, &buf,
+			       sizes[i])) != MEMIF_ERR_SUCCESS)
+	ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+      bufs[i].data_len = sizes[i];
+    }
+  ck_assert_uint_eq (bufs[0].buffer_len, 256);
+  ck_assert_uint_eq (bufs[1].buffer_len, 2048);
+  ck_assert_uint_eq (bufs[2].buffer_len, 10240);
+  ck_assert_uint_eq (bufs[3].buffer_len, 3 * 10240);
+  ck_assert_uint_eq (mq->alloc_bufs, 6);
+  ck_assert_uint_eq (mq->pools[2].n_free, 0);
+
+  if ((err = memif_tx_burst (conn, qid, bufs, 4, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->head, 6);
+  ck_assert_uint_eq (ring->desc[3].flags, MEMIF_DESC_FLAG_NEXT);
+  ck_assert_uint_eq (ring->desc[5].length, 30000 - 2 * 10240);
+
+  /* no 10 KB buffer left, 4000 B packet is chained from 2 KB buffers */
+  if ((err =
+       memif_buffer_alloc (conn, qid, bufs, 1, &buf,
+			   4000)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (bufs[0].buffer_len, 2 * 2048);
+  ck_assert_uint_eq (buf, 1);
+  read_interrupt (mq->int_fd);
+
+  /* peer released slots, buffers return to pools */
+  ring->tail = 6;
+  if ((err =
+       memif_buffer_alloc (conn, qid, bufs + 1, 1, &buf,
+			   9000)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (bufs[1].buffer_len, 10240);
+  ck_assert_uint_eq (mq->pools[2].n_free, 3);
+  ck_assert_uint_eq (mq->pools[0].n_free, 8);
+
+  /* classes not in ascending order (negative) */
+  memif_conn_handle_t conn2 = NULL;
+  args.buffer_classes[1].size = 128;
+  if ((err = memif_create (&conn2, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+
   if (lm->timerfd > 0)
     close (lm->timerfd);
   lm->timerfd = -1;
@@ -979,15 +1411,21 @@ START_TEST (test_connect1)
 }
 
 END_TEST
-START_TEST (test_disconnect_internal)
+START_TEST (test_buffer_headroom)
 {
   int err;
+  uint16_t buf, tx;
+  uint8_t qid = 0;
+  uint64_t offset;
+  memif_buffer_t bufs[16];
+  memif_queue_t *mq;
+  memif_ring_t *ring;
   ready_called = 0;
   memif_conn_handle_t conn = NULL;
   memif_conn_args_t args;
   memset (&args, 0, sizeof (args));
-  args.num_s2m_rings = 2;
-  args.num_m2s_rings = 2;
+  args.headroom = 64;
+  args.tailroom = 32;
 
   libmemif_main_t *lm = &libmemif_main;
 
@@ -1006,29 +1444,1873 @@ START_TEST (test_disconnect_internal)
 
   memif_connection_t *c = (memif_connection_t *) conn;
 
-  c->run_args.num_s2m_rings = 2;
-  c->run_args.num_m2s_rings = 2;
-  c->run_args.log2_ring_size = 10;
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 4;
   c->run_args.buffer_size = 2048;
 
   if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  if ((err = memif_connect1 (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  if ((err = memif_disconnect_internal (c)) != MEMIF_ERR_SUCCESS)
+  c->fd = 69;
+  mq = &c->tx_queues[qid];
+  ring = mq->ring;
+
+  /* every buffer has headroom in front of it and tailroom behind it,
+     slots are cacheline aligned */
+  ck_assert_uint_eq (ring->desc[1].offset - ring->desc[0].offset,
+		     (64 + 2048 + 32 + 63) & ~63);
+  ck_assert_uint_eq (ring->desc[0].buffer_length, 2048);
+  ck_assert_uint_eq (mq->headroom, 64);
+  offset = ring->desc[0].offset;
+
+  if ((err =
+       memif_buffer_alloc (conn, qid, bufs, 2, &buf,
+			   2048)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
-  ck_assert_int_eq (c->fd, -1);
+  /* header pushed in front of first packet, trailer behind second */
+  bufs[0].data -= 50;
+  bufs[0].data_len = 150;
+  bufs[1].data_len = 2048 + 20;
 
-  ck_assert_ptr_eq (c->tx_queues, NULL);
-  ck_assert_ptr_eq (c->rx_queues, NULL);
-  ck_assert_ptr_eq (c->regions, NULL);
-  ck_assert_ptr_eq (c->msg_queue, NULL);
+  if ((err = memif_tx_burst (conn, qid, bufs, 2, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (tx, 2);
+  ck_assert_uint_eq (ring->desc[0].offset, offset - 50);
+  ck_assert_uint_eq (ring->desc[0].length, 150);
+  ck_assert_uint_eq (ring->desc[1].length, 2048 + 20);
+  ck_assert_uint_eq (mq->n_moved, 2);
+  read_interrupt (mq->int_fd);
+
+  /* peer released slots, buffers are restored */
+  ring->tail = 2;
+  memif_buffer_alloc (conn, qid, bufs, 14, &buf, 2048);
+  ck_assert_uint_eq (mq->n_moved, 0);
+  ck_assert_uint_eq (ring->desc[0].offset, offset);
+  ck_assert_uint_eq (ring->desc[0].buffer_length, 2048);
+  ck_assert_uint_eq (ring->desc[1].buffer_length, 2048);
+
+  /* header larger than headroom (negative) */
+  bufs[0].data -= 65;
+  if ((err = memif_tx_burst (conn, qid, bufs, 1, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+
+  /* valid buffer followed by invalid one, nothing is moved (negative) */
+  offset = ring->desc[bufs[0].desc_index].offset;
+  bufs[0].data += 55;
+  bufs[1].data -= 65;
+  if ((err = memif_tx_burst (conn, qid, bufs, 2, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+  ck_assert_uint_eq (mq->n_moved, 0);
+  ck_assert_uint_eq (ring->desc[bufs[0].desc_index].offset, offset);
+  ck_assert_uint_eq (bufs[0].buffer_len, 2048);
 
-  struct itimerspec timer;
-  timerfd_gettime (lm->timerfd, &timer);
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
 
-  ck_assert_msg (timer.it_interval.tv_sec == lm->arm.it_interval.tv_sec,
-		 "timerfd not armed!");
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_tx_burst_copy)
+{
+  int err, i;
+  uint16_t tx, buf;
+  uint8_t qid = 0;
+  uint8_t small[64], large[5000];
+  struct iovec pkts[2];
+  memif_buffer_t b;
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+  mq = &c->tx_queues[qid];
+  ring = mq->ring;
+
+  for (i = 0; i < sizeof (small); i++)
+    small[i] = i;
+  for (i = 0; i < sizeof (large); i++)
+    large[i] = i * 7;
+  pkts[0].iov_base = small;
+  pkts[0].iov_len = sizeof (small);
+  /* unaligned source, non-temporal copy */
+  pkts[1].iov_base = large + 1;
+  pkts[1].iov_len = sizeof (large) - 1;
+
+  if ((err =
+       memif_tx_burst_copy (conn, qid, pkts, 2, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (tx, 2);
+  ck_assert_uint_eq (ring->head, 4);
+  ck_assert_uint_eq (ring->desc[0].length, sizeof (small));
+  ck_assert_uint_eq (ring->desc[0].flags, 0);
+  ck_assert_int_eq (memcmp (memif_get_buffer (c, ring, 0), small,
+			    sizeof (small)), 0);
+  ck_assert_uint_eq (ring->desc[1].flags, MEMIF_DESC_FLAG_NEXT);
+  ck_assert_uint_eq (ring->desc[2].flags, MEMIF_DESC_FLAG_NEXT);
+  ck_assert_uint_eq (ring->desc[3].flags, 0);
+  ck_assert_uint_eq (ring->desc[3].length, sizeof (large) - 1 - 2 * 2048);
+  for (i = 0; i < 3; i++)
+    ck_assert_int_eq (memcmp (memif_get_buffer (c, ring, i + 1),
+			      large + 1 + i * 2048,
+			      ring->desc[i + 1].length), 0);
+
+  /* buffers allocated by memif_buffer_alloc pending (negative) */
+  if ((err =
+       memif_buffer_alloc (conn, qid, &b, 1, &buf,
+			   0)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  if ((err =
+       memif_tx_burst_copy (conn, qid, pkts, 2, &tx)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_rx_burst)
+{
+  int err, i;
+  uint16_t max_buf = 10, buf, rx;
+  uint8_t qid;
+  memif_buffer_t *bufs;
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+
+  /* test receive qid 0 (positive) */
+  qid = 0;
+  mq = &c->rx_queues[qid];
+  ring = mq->ring;
+  ring->head += max_buf;
+
+  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (rx, max_buf);
+  for (i = 0; i < max_buf; i++)
+    ck_assert_ptr_ne (bufs[i].data, NULL);
+
+  /* test receive qid 1 (positive) */
+  qid = 1;
+  mq = &c->rx_queues[qid];
+  ring = mq->ring;
+  ring->head += max_buf;
+
+  free (bufs);
+  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (rx, max_buf);
+  for (i = 0; i < max_buf; i++)
+    ck_assert_ptr_ne (bufs[i].data, NULL);
+
+  /* test receive chained buffer qid 1 (positive) */
+  buf = mq->last_head;
+  ring->desc[buf + 2].flags = MEMIF_DESC_FLAG_NEXT;
+  ring->head += max_buf;
+
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (rx, max_buf - 1);
+  ck_assert_uint_eq (bufs[2].desc_index, buf + 2);
+  ck_assert_uint_eq (bufs[2].buffer_len,
+		     ring->desc[buf + 2].buffer_length +
+		     ring->desc[buf + 3].buffer_length);
+  ck_assert_uint_eq (bufs[3].desc_index, buf + 4);
+  ck_assert_uint_eq (mq->last_head, buf + max_buf);
+
+  /* test receive qid 2 (negative) */
+  free (bufs);
+  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
+		   memif_strerror (err));
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+  free (bufs);
+  bufs = NULL;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_rx_adaptive)
+{
+  int err, i;
+  uint16_t max_buf = 10, rx;
+  uint8_t qid = 0;
+  memif_buffer_t bufs[10];
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.rx_poll_budget = 4;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+  mq = &c->rx_queues[qid];
+  ring = mq->ring;
+
+  if ((err =
+       memif_set_rx_mode (conn, MEMIF_RX_MODE_ADAPTIVE,
+			  qid)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->flags, MEMIF_RING_FLAG_MASK_INT);
+
+  /* interrupts stay masked until poll budget is exhausted */
+  for (i = 0; i < 3; i++)
+    {
+      if ((err =
+	   memif_rx_burst (conn, qid, bufs, max_buf,
+			   &rx)) != MEMIF_ERR_SUCCESS)
+	ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+      ck_assert_uint_eq (rx, 0);
+    }
+  ck_assert_uint_eq (ring->flags, MEMIF_RING_FLAG_MASK_INT);
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->flags, 0);
+
+  /* idle queue, wait times out */
+  if ((err = memif_rx_wait (conn, qid, 1)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* packets pending, wait returns and receive masks interrupts again */
+  ring->head += max_buf;
+  if ((err = memif_rx_wait (conn, qid, -1)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (rx, max_buf);
+  ck_assert_uint_eq (ring->flags, MEMIF_RING_FLAG_MASK_INT);
+  ck_assert_uint_eq (mq->empty_polls, 0);
+
+  /* interrupt pending when switching to polling is consumed */
+  uint64_t b = 1;
+  ck_assert_int_eq (write (mq->int_fd, &b, sizeof (b)), sizeof (b));
+  if ((err =
+       memif_set_rx_mode (conn, MEMIF_RX_MODE_POLLING,
+			  qid)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (rx, 0);
+  ck_assert_uint_eq (read_interrupt (mq->int_fd), 0);
+
+  /* invalid rx mode (negative) */
+  if ((err =
+       memif_set_rx_mode (conn, MEMIF_RX_MODE_ADAPTIVE + 1,
+			  qid)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_packet_burst)
+{
+  int err, i;
+  uint16_t count, segs_num, head;
+  uint8_t qid = 0;
+  memif_packet_t pkts[4];
+  struct iovec segs[16];
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+
+  /* transmit two 5000 byte packets, 3 segments each */
+  mq = &c->tx_queues[qid];
+  ring = mq->ring;
+  if ((err =
+       memif_packet_alloc (conn, qid, pkts, 2, segs, 16, &count,
+			   5000)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (count, 2);
+  ck_assert_uint_eq (pkts[0].num_segs, 3);
+  ck_assert_uint_eq (pkts[1].desc_index, 3);
+  ck_assert_ptr_eq (pkts[1].segs, segs + 3);
+  ck_assert_uint_eq (mq->alloc_bufs, 6);
+  for (i = 0; i < 6; i++)
+    ck_assert_ptr_ne (segs[i].iov_base, NULL);
+  segs[2].iov_len = 5000 - 2 * 2048;
+  segs[5].iov_len = 100;
+
+  if ((err = memif_tx_burst_pkt (conn, qid, pkts, count, &count))
+      != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (count, 2);
+  ck_assert_uint_eq (ring->head, 6);
+  ck_assert_uint_eq (mq->alloc_bufs, 0);
+  ck_assert_uint_eq (ring->desc[0].flags, MEMIF_DESC_FLAG_NEXT);
+  ck_assert_uint_eq (ring->desc[2].flags, 0);
+  ck_assert_uint_eq (ring->desc[2].length, 5000 - 2 * 2048);
+  ck_assert_uint_eq (ring->desc[5].length, 100);
+
+  /* segment array too small (negative) */
+  if ((err =
+       memif_packet_alloc (conn, qid, pkts, 2, segs, 4, &count,
+			   5000)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_NOBUF_RING, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+  ck_assert_uint_eq (count, 1);
+
+  /* receive single buffer packet and 2 segment packet */
+  mq = &c->rx_queues[qid];
+  ring = mq->ring;
+  head = ring->head;
+  ring->desc[head + 1].flags = MEMIF_DESC_FLAG_NEXT;
+  ring->desc[head + 2].flags = 0;
+  ring->desc[head].length = 60;
+  ring->desc[head + 1].length = 2048;
+  ring->desc[head + 2].length = 1000;
+  ring->head += 3;
+
+  if ((err =
+       memif_rx_burst_pkt (conn, qid, pkts, 4, segs, 16, &count,
+			   &segs_num)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (count, 2);
+  ck_assert_uint_eq (segs_num, 3);
+  ck_assert_uint_eq (pkts[0].data_len, 60);
+  ck_assert_uint_eq (pkts[1].num_segs, 2);
+  ck_assert_uint_eq (pkts[1].data_len, 3048);
+  ck_assert_uint_eq (pkts[1].segs[1].iov_len, 1000);
+  ck_assert_ptr_eq (pkts[1].segs[1].iov_base,
+		    c->regions[ring->desc[head + 2].region].shm +
+		    ring->desc[head + 2].offset);
+
+  /* incomplete chain is left in ring */
+  ring->desc[head + 3].flags = MEMIF_DESC_FLAG_NEXT;
+  ring->head += 1;
+  if ((err =
+       memif_rx_burst_pkt (conn, qid, pkts + 2, 2, segs + 3, 13, &count,
+			   &segs_num)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (count, 0);
+  ck_assert_uint_eq (mq->last_head, head + 3);
+
+  if ((err =
+       memif_packet_free (conn, qid, pkts, 2, &count)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (count, 2);
+  ck_assert_uint_eq (ring->tail, head + 3);
+  ck_assert_uint_eq (mq->alloc_bufs, 0);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_buffer_free)
+{
+  int err, i;
+  uint16_t max_buf = 10, buf, rx;
+  uint8_t qid;
+  memif_buffer_t *bufs;
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+
+  /* test buffer free qid 0 (positive) */
+  qid = 0;
+  mq = &c->rx_queues[qid];
+  ring = mq->ring;
+  ring->head += 10;
+
+  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (rx, max_buf);
+  for (i = 0; i < max_buf; i++)
+    ck_assert_ptr_ne (bufs[i].data, NULL);
+
+  if ((err =
+       memif_buffer_free (conn, qid, bufs, max_buf,
+			  &buf)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (buf, max_buf);
+  for (i = 0; i < max_buf; i++)
+    ck_assert_ptr_eq (bufs[i].data, NULL);
+  ck_assert_uint_eq (ring->head, ring->tail);
+
+  /* test buffer free qid 1 (positive) */
+  qid = 1;
+  mq = &c->rx_queues[qid];
+  ring = mq->ring;
+  ring->head += 10;
+
+  free (bufs);
+  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (rx, max_buf);
+  for (i = 0; i < max_buf; i++)
+    ck_assert_ptr_ne (bufs[i].data, NULL);
+
+  if ((err =
+       memif_buffer_free (conn, qid, bufs, max_buf,
+			  &buf)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (buf, max_buf);
+  for (i = 0; i < max_buf; i++)
+    ck_assert_ptr_eq (bufs[i].data, NULL);
+  ck_assert_uint_eq (ring->head, ring->tail);
+
+
+  /* test buffer free qid 2 (negative) */
+  qid = 2;
+  free (bufs);
+  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
+  if ((err =
+       memif_buffer_free (conn, qid, bufs, max_buf,
+			  &buf)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
+		   memif_strerror (err));
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+  free (bufs);
+  bufs = NULL;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_buffer_free_out_of_order)
+{
+  int err;
+  uint16_t max_buf = 6, rx, fb;
+  uint8_t qid = 0;
+  memif_buffer_t bufs[6];
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+  mq = &c->rx_queues[qid];
+  ring = mq->ring;
+  ck_assert_ptr_ne (mq->done, NULL);
+
+  ring->head += max_buf;
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (rx, max_buf);
+
+  /* tail stays until oldest buffer is freed */
+  if ((err =
+       memif_buffer_free (conn, qid, bufs + 2, 2, &fb)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (fb, 2);
+  ck_assert_uint_eq (ring->tail, 0);
+
+  if ((err =
+       memif_buffer_free (conn, qid, bufs, 1, &fb)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->tail, 1);
+
+  /* tail advances over buffers freed earlier */
+  if ((err =
+       memif_buffer_free (conn, qid, bufs + 1, 1, &fb)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->tail, 4);
+
+  if ((err =
+       memif_buffer_free (conn, qid, bufs + 5, 1, &fb)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->tail, 4);
+  if ((err =
+       memif_buffer_free (conn, qid, bufs + 4, 1, &fb)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->tail, 6);
+  ck_assert_uint_eq (mq->done_pending, 0);
+  ck_assert_uint_eq (mq->alloc_bufs, 0);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_forward_burst)
+{
+  int err, i;
+  uint16_t max_buf = 10, rx, fwd;
+  uint8_t qid;
+  memif_buffer_t *bufs;
+  memif_queue_t *rx_mq, *tx_mq;
+  memif_ring_t *rx_ring, *tx_ring;
+  memif_region_offset_t offsets[10];
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+
+  /* test forward rx qid 0 -> tx qid 1 (positive) */
+  qid = 0;
+  rx_mq = &c->rx_queues[qid];
+  rx_ring = rx_mq->ring;
+  tx_mq = &c->tx_queues[1];
+  tx_ring = tx_mq->ring;
+  for (i = 0; i < max_buf; i++)
+    {
+      rx_ring->desc[i].length = 64;
+      offsets[i] = rx_ring->desc[i].offset;
+    }
+  rx_ring->head += max_buf;
+
+  bufs = malloc (sizeof (memif_buffer_t) * max_buf);
+
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (rx, max_buf);
+
+  if ((err =
+       memif_forward_burst (conn, qid, 1, bufs, rx,
+			    &fwd)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_uint_eq (fwd, max_buf);
+  ck_assert_uint_eq (tx_ring->head, max_buf);
+  ck_assert_uint_eq (rx_ring->tail, rx_ring->head);
+  ck_assert_uint_eq (rx_mq->alloc_bufs, 0);
+  for (i = 0; i < max_buf; i++)
+    {
+      ck_assert_ptr_eq (bufs[i].data, NULL);
+      ck_assert_uint_eq (tx_ring->desc[i].offset, offsets[i]);
+      ck_assert_uint_eq (tx_ring->desc[i].length, 64);
+      ck_assert_uint_ne (rx_ring->desc[i].offset, offsets[i]);
+    }
+
+  /* test forward with pending tx allocation (negative) */
+  rx_ring->head += max_buf;
+  if ((err =
+       memif_rx_burst (conn, qid, bufs, max_buf, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  tx_mq->alloc_bufs = 1;
+  if ((err =
+       memif_forward_burst (conn, qid, 1, bufs, rx,
+			    &fwd)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_INVAL_ARG, "err code: %u, err msg: %s",
+		   err, memif_strerror (err));
+  tx_mq->alloc_bufs = 0;
+
+  /* test forward tx qid 2 (negative) */
+  if ((err =
+       memif_forward_burst (conn, qid, 2, bufs, rx,
+			    &fwd)) != MEMIF_ERR_SUCCESS)
+    ck_assert_msg (err == MEMIF_ERR_QID, "err code: %u, err msg: %s", err,
+		   memif_strerror (err));
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+  free (bufs);
+  bufs = NULL;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_get_details)
+{
+  int err, i;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_details_t md;
+  memset (&md, 0, sizeof (md));
+  ssize_t buflen = 2048;
+  char *buf = malloc (buflen);
+  memset (buf, 0, buflen);
+
+  if ((err = memif_get_details (conn, &md, buf, buflen)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_str_eq (md.if_name, c->args.interface_name);
+  ck_assert_str_eq (md.inst_name, c->args.instance_name);
+  ck_assert_str_eq (md.remote_if_name, c->remote_if_name);
+  ck_assert_str_eq (md.remote_inst_name, c->remote_name);
+  ck_assert_str_eq (md.secret, c->args.secret);
+  ck_assert_str_eq (md.socket_filename, c->args.socket_filename);
+
+  ck_assert_uint_eq (md.id, c->args.interface_id);
+  ck_assert_uint_ne (md.role, c->args.is_master);
+  ck_assert_uint_eq (md.mode, c->args.mode);
+  for (i = 0; i < md.rx_queues_num; i++)
+    {
+      ck_assert_uint_eq (md.rx_queues[i].qid, i);
+      ck_assert_uint_eq (md.rx_queues[i].ring_size,
+			 (1 << c->args.log2_ring_size));
+      ck_assert_uint_eq (md.rx_queues[i].buffer_size, c->args.buffer_size);
+    }
+  for (i = 0; i < md.tx_queues_num; i++)
+    {
+      ck_assert_uint_eq (md.tx_queues[i].qid, i);
+      ck_assert_uint_eq (md.tx_queues[i].ring_size,
+			 (1 << c->args.log2_ring_size));
+      ck_assert_uint_eq (md.tx_queues[i].buffer_size, c->args.buffer_size);
+    }
+  ck_assert_uint_eq (md.regions_num, c->regions_num);
+  for (i = 0; i < md.regions_num; i++)
+    {
+      ck_assert_uint_eq (md.regions[i].index, i);
+      ck_assert_uint_eq (md.regions[i].size, c->regions[i].region_size);
+      ck_assert_uint_eq (md.regions[i].log2_page_size,
+			 c->regions[i].log2_page_size);
+    }
+  ck_assert_uint_eq (md.link_up_down, 0);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_and_queues)
+{
+  int err;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_ptr_ne (c->regions, NULL);
+  ck_assert_ptr_ne (c->tx_queues, NULL);
+  ck_assert_ptr_ne (c->rx_queues, NULL);
+
+  ck_assert_ptr_ne (c->regions->shm, NULL);
+  ck_assert_ptr_ne (c->tx_queues->ring, NULL);
+  ck_assert_ptr_ne (c->rx_queues->ring, NULL);
+
+  ck_assert_int_ne (c->regions->fd, -1);
+  ck_assert_uint_eq (c->tx_queues->ring->cookie, MEMIF_COOKIE);
+  ck_assert_uint_eq (c->rx_queues->ring->cookie, MEMIF_COOKIE);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_and_queues_multi)
+{
+  int err, i;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+  c->run_args.max_region = MEMIF_MAX_REGION;
+  c->flags |= MEMIF_CONNECTION_FLAG_MULTI_REGION;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* region 0 for rings + one buffer region per queue */
+  ck_assert_uint_eq (c->regions_num, 5);
+  for (i = 0; i < c->regions_num; i++)
+    {
+      ck_assert_ptr_ne (c->regions[i].shm, NULL);
+      ck_assert_int_ne (c->regions[i].fd, -1);
+    }
+  ck_assert_uint_eq (c->regions[1].region_size, 2048 << 10);
+
+  ring = c->tx_queues[1].ring;
+  ck_assert_uint_eq (ring->desc[0].region, 2);
+  ck_assert_uint_eq (ring->desc[1].offset, 2048);
+  ring = c->rx_queues[0].ring;
+  ck_assert_uint_eq (ring->desc[0].region, 3);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_old_master)
+{
+  int err;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memif_msg_t msg;
+  memif_msg_hello_t *h = &msg.hello;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+  args.log2_ring_size = 10;
+  args.buffer_size = 2048;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  /* older master advertises max_region, but maps region 0 only */
+  memset (&msg, 0, sizeof (msg));
+  msg.type = MEMIF_MSG_TYPE_HELLO;
+  h->min_version = MEMIF_VERSION;
+  h->max_version = MEMIF_VERSION;
+  h->max_s2m_ring = 255;
+  h->max_m2s_ring = 255;
+  h->max_region = 255;
+  h->max_log2_ring_size = 14;
+  h->features = MEMIF_MSG_FEATURE_PIPELINE;
+
+  if ((err = memif_msg_receive_hello (c, &msg)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* rings and buffers share region 0 */
+  ck_assert_uint_eq (c->regions_num, 1);
+  ck_assert_uint_eq (c->tx_queues[1].ring->desc[0].region, 0);
+  ck_assert_uint_eq (c->rx_queues[1].ring->desc[0].region, 0);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_deep_rings)
+{
+  int err, i;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memif_region_t region;
+  memif_ring_t *ring;
+  memif_region_size_t stride;
+  memset (&args, 0, sizeof (args));
+  memset (&region, 0, sizeof (region));
+  args.num_s2m_rings = 8;
+  args.num_m2s_rings = 8;
+  args.log2_ring_size = 25;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  err = memif_create (&conn, &args, on_connect, on_disconnect, on_interrupt,
+		      NULL);
+  ck_assert_int_eq (err, MEMIF_ERR_MAXRING);
+  ck_assert_ptr_eq (conn, NULL);
+
+  args.log2_ring_size = MEMIF_MAX_LOG2_RING_SIZE;
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 8;
+  c->run_args.num_m2s_rings = 8;
+  c->run_args.log2_ring_size = MEMIF_MAX_LOG2_RING_SIZE;
+  c->run_args.buffer_size = 2048;
+
+  /* rings of 16 queues take more than 4GB, reserve address space only */
+  stride = memif_ring_bytes (MEMIF_MAX_LOG2_RING_SIZE);
+  region.region_size = 16 * stride;
+  region.shm = mmap (NULL, region.region_size, PROT_NONE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  ck_assert_ptr_ne (region.shm, MAP_FAILED);
+  c->regions = &region;
+  c->regions_num = 1;
+
+  for (i = 0; i < 8; i++)
+    {
+      ring = memif_get_ring (c, MEMIF_RING_S2M, i);
+      ck_assert_uint_eq ((void *) ring - region.shm, i * stride);
+      ring = memif_get_ring (c, MEMIF_RING_M2S, i);
+      ck_assert_uint_eq ((void *) ring - region.shm, (8 + i) * stride);
+      ck_assert ((void *) ring + stride <= region.shm + region.region_size);
+    }
+
+  munmap (region.shm, region.region_size);
+  c->regions = NULL;
+  c->regions_num = 0;
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_hugepages)
+{
+  int err, i;
+  uint64_t page_size;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+  args.log2_page_size = 21;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+  c->run_args.max_region = MEMIF_MAX_REGION;
+  c->flags |= MEMIF_CONNECTION_FLAG_MULTI_REGION;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* falls back to default page size if no hugepages are reserved */
+  for (i = 0; i < c->regions_num; i++)
+    {
+      ck_assert_ptr_ne (c->regions[i].shm, NULL);
+      if (c->regions[i].log2_page_size != 21)
+	ck_assert_uint_eq (1 << c->regions[i].log2_page_size,
+			   sysconf (_SC_PAGESIZE));
+      page_size = 1ULL << c->regions[i].log2_page_size;
+      ck_assert_uint_eq (c->regions[i].region_size % page_size, 0);
+    }
+  ck_assert_uint_eq (c->tx_queues->ring->cookie, MEMIF_COOKIE);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_coloring)
+{
+  int err, i;
+  uint64_t stride;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 1;
+  args.num_m2s_rings = 1;
+  args.buffer_coloring = 1;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 6;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* 2048 B buffers are 33 cachelines apart, 64 consecutive buffers start
+     at 64 different offsets within 4 KB page */
+  stride = c->tx_queues->ring->desc[1].offset -
+    c->tx_queues->ring->desc[0].offset;
+  ck_assert_uint_eq (stride, 33 * 64);
+  for (i = 1; i < 64; i++)
+    ck_assert_uint_ne ((c->tx_queues->ring->desc[i].offset -
+			c->tx_queues->ring->desc[0].offset) % 4096, 0);
+  ck_assert_uint_eq (c->tx_queues->ring->desc[63].buffer_length, 2048);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_prefault)
+{
+  int err, i;
+  uint64_t page_size, p;
+  unsigned char *vec;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+  args.prefault_regions = 1;
+  args.lock_regions = 1;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 6;
+  c->run_args.buffer_size = 2048;
+  c->run_args.max_region = MEMIF_MAX_REGION;
+  c->flags |= MEMIF_CONNECTION_FLAG_MULTI_REGION;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* every page of every region is resident */
+  for (i = 0; i < c->regions_num; i++)
+    {
+      page_size = 1ULL << c->regions[i].log2_page_size;
+      vec = malloc (c->regions[i].region_size / page_size);
+      ck_assert_ptr_ne (vec, NULL);
+      ck_assert_int_eq (mincore (c->regions[i].shm, c->regions[i].region_size,
+				 vec), 0);
+      for (p = 0; p < c->regions[i].region_size / page_size; p++)
+	ck_assert_uint_eq (vec[p] & 1, 1);
+      free (vec);
+    }
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_init_regions_numa)
+{
+  int err, i;
+  int16_t s2m_nodes[2] = { 0, 0 };
+  int16_t m2s_nodes[2] = { 0, -1 };
+  long page_size = sysconf (_SC_PAGESIZE);
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+  args.s2m_numa_node = s2m_nodes;
+  args.m2s_numa_node = m2s_nodes;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  /* hints are copied */
+  s2m_nodes[1] = 1;
+  ck_assert_int_eq (c->args.s2m_numa_node[1], 0);
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* rings are page aligned so that each can be placed separately */
+  for (i = 0; i < 2; i++)
+    {
+      ck_assert_uint_eq ((uintptr_t) c->tx_queues[i].ring % page_size, 0);
+      ck_assert_uint_eq ((uintptr_t) c->rx_queues[i].ring % page_size, 0);
+      ck_assert_uint_eq (c->tx_queues[i].ring->cookie, MEMIF_COOKIE);
+      ck_assert_uint_eq (c->rx_queues[i].ring->cookie, MEMIF_COOKIE);
+    }
+
+  memif_details_t md;
+  memset (&md, 0, sizeof (md));
+  ssize_t buflen = 2048;
+  char *buf = malloc (buflen);
+  memset (buf, 0, buflen);
+
+  if ((err = memif_get_details (conn, &md, buf, buflen)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* single node topology, -1 if numa policy syscalls are not permitted */
+  for (i = 0; i < md.tx_queues_num; i++)
+    ck_assert (md.tx_queues[i].numa_node == 0
+	       || md.tx_queues[i].numa_node == -1);
+  for (i = 0; i < md.rx_queues_num; i++)
+    ck_assert (md.rx_queues[i].numa_node == 0
+	       || md.rx_queues[i].numa_node == -1);
+
+  free (buf);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_connect1)
+{
+  int err;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  if ((err = memif_connect1 (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_disconnect_internal)
+{
+  int err;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  if ((err = memif_disconnect_internal (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_int_eq (c->fd, -1);
+
+  ck_assert_ptr_eq (c->tx_queues, NULL);
+  ck_assert_ptr_eq (c->rx_queues, NULL);
+  ck_assert_ptr_eq (c->regions, NULL);
+  ck_assert_ptr_eq (c->msg_queue, NULL);
+
+  struct itimerspec timer;
+  timerfd_gettime (lm->timerfd, &timer);
+
+  ck_assert_msg (timer.it_value.tv_sec || timer.it_value.tv_nsec,
+		 "timerfd not armed!");
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_disconnect_keep_regions)
+{
+  int err;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 2;
+  args.num_m2s_rings = 2;
+  args.keep_regions = 1;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  void *shm = c->regions[0].shm;
+  int int_fd = c->rx_queues[0].int_fd;
+  c->tx_queues[1].ring->head = 5;
+  c->tx_queues[1].last_tail = 5;
+
+  if ((err = memif_disconnect_internal (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_int_eq (c->fd, -1);
+  ck_assert_ptr_ne (c->regions, NULL);
+  ck_assert_ptr_ne (c->tx_queues, NULL);
+  ck_assert_ptr_ne (c->rx_queues, NULL);
+  ck_assert_uint_eq (c->run_args.num_s2m_rings, 0);
+
+  /* same layout negotiated: regions and eventfds reused, rings reset */
+  c->run_args.num_s2m_rings = 2;
+  c->run_args.num_m2s_rings = 2;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert_ptr_eq (c->regions[0].shm, shm);
+  ck_assert_int_eq (c->rx_queues[0].int_fd, int_fd);
+  ck_assert_uint_eq (c->tx_queues[1].ring->head, 0);
+  ck_assert_uint_eq (c->tx_queues[1].last_tail, 0);
+  ck_assert_uint_eq (c->tx_queues[1].ring->cookie, MEMIF_COOKIE);
+  ck_assert (c->flags & MEMIF_CONNECTION_FLAG_SHM_REUSED);
+
+  /* different layout: kept memory is released and created again */
+  if ((err = memif_disconnect_internal (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 10;
+  c->run_args.buffer_size = 2048;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  ck_assert (!(c->flags & MEMIF_CONNECTION_FLAG_SHM_REUSED));
+  ck_assert_uint_eq (c->regions_num, 1);
+
+  if ((err = memif_disconnect_internal (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_region_add)
+{
+  int err, i;
+  uint16_t rx, freed;
+  memif_buffer_t bufs[12];
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 1;
+  args.num_m2s_rings = 1;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 4;
+  c->run_args.buffer_size = 2048;
+  c->run_args.max_region = 4;
+  c->flags |= MEMIF_CONNECTION_FLAG_MULTI_REGION;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (c->regions_num, 3);
+
+  /* connection is not up yet */
+  err = memif_region_add (conn, 0, 8);
+  ck_assert_int_eq (err, MEMIF_ERR_DISCONNECTED);
+
+  c->fd = 69;
+  c->flags |= MEMIF_CONNECTION_FLAG_CONNECTED;
+
+  err = memif_region_add (conn, 1, 8);
+  ck_assert_int_eq (err, MEMIF_ERR_QID);
+
+  /* master without multi-region support */
+  c->flags &= ~MEMIF_CONNECTION_FLAG_MULTI_REGION;
+  err = memif_region_add (conn, 0, 8);
+  ck_assert_int_eq (err, MEMIF_ERR_MAXREG);
+  c->flags |= MEMIF_CONNECTION_FLAG_MULTI_REGION;
+
+  if ((err = memif_region_add (conn, 0, 8)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* region is announced to peer, buffers are used once peer acks */
+  ck_assert_uint_eq (c->regions_num, 4);
+  ck_assert_ptr_ne (c->regions[3].shm, NULL);
+  ck_assert_uint_eq (c->regions[3].pending, 1);
+  ck_assert_ptr_ne (c->msg_queue, NULL);
+  ck_assert_uint_eq (c->msg_queue->msg.type, MEMIF_MSG_TYPE_ADD_REGION);
+  ck_assert_uint_eq (c->msg_queue->msg.add_region.index, 3);
+  ck_assert_int_eq (c->msg_queue->fd, c->regions[3].fd);
+
+  mq = &c->rx_queues[0];
+  ring = mq->ring;
+  ck_assert_uint_eq (mq->spare.n_free, 0);
+
+  if ((err = memif_region_ack (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (c->regions[3].pending, 0);
+  ck_assert_uint_eq (mq->spare.n_free, 8);
+
+  /* application holds 12 of 16 slots: ring buffers of 4 oldest packets
+     are exchanged for spare buffers and their slots are released */
+  ring->head += 12;
+  if ((err = memif_rx_burst (conn, 0, bufs, 12, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (rx, 12);
+  for (i = 0; i < 4; i++)
+    {
+      ck_assert_uint_eq (ring->desc[i].region, 3);
+      ck_assert_ptr_ne (bufs[i].data, memif_get_buffer (c, ring, i));
+    }
+  ck_assert_ptr_eq (bufs[4].data, memif_get_buffer (c, ring, 4));
+  ck_assert_uint_eq (ring->tail, 4);
+  ck_assert_uint_eq (mq->alloc_bufs, 8);
+  ck_assert_uint_eq (mq->n_detached, 4);
+  ck_assert_uint_eq (mq->spare.n_free, 4);
+
+  if ((err =
+       memif_buffer_free (conn, 0, bufs, 12, &freed)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (freed, 12);
+  ck_assert_uint_eq (ring->tail, 12);
+  ck_assert_uint_eq (mq->n_detached, 0);
+  ck_assert_uint_eq (mq->spare.n_free, 8);
+  /* spare region buffers are still attached to ring slots */
+  ck_assert_uint_eq (c->regions[3].released, 0);
+
+  ring->head += 4;
+  if ((err = memif_rx_burst (conn, 0, bufs, 4, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  if ((err =
+       memif_buffer_free (conn, 0, bufs, 4, &freed)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  /* spare region buffers leave the ring again */
+  ring->head += 12;
+  if ((err = memif_rx_burst (conn, 0, bufs, 12, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (mq->n_detached, 4);
+  for (i = 0; i < 4; i++)
+    ck_assert_uint_ne (ring->desc[i].region, 3);
+
+  /* pressure dropped, spare region memory is released */
+  if ((err =
+       memif_buffer_free (conn, 0, bufs, 12, &freed)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->tail, 28 & 15);
+  ck_assert_uint_eq (c->regions[3].released, 1);
+  ck_assert_uint_eq (mq->spare.n_free, 0);
+
+  /* and reattached under pressure */
+  ring->head += 12;
+  if ((err = memif_rx_burst (conn, 0, bufs, 12, &rx)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (c->regions[3].released, 0);
+  ck_assert_uint_eq (mq->n_detached, 4);
+  ck_assert_uint_eq (mq->spare.n_free, 4);
+
+  c->fd = -1;
+  if ((err = memif_disconnect_internal (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_ptr_eq (c->regions, NULL);
+
+  if (lm->timerfd > 0)
+    close (lm->timerfd);
+  lm->timerfd = -1;
+
+  memif_delete (&conn);
+  ck_assert_ptr_eq (conn, NULL);
+}
+
+END_TEST
+START_TEST (test_ring_wide)
+{
+  int err, i;
+  uint16_t n;
+  memif_buffer_t bufs[100];
+  memif_queue_t *mq;
+  memif_ring_t *ring;
+  ready_called = 0;
+  memif_conn_handle_t conn = NULL;
+  memif_conn_args_t args;
+  memset (&args, 0, sizeof (args));
+  args.num_s2m_rings = 1;
+  args.num_m2s_rings = 1;
+  args.log2_ring_size = 17;
+  args.buffer_size = 64;
+
+  libmemif_main_t *lm = &libmemif_main;
+
+  if ((err =
+       memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  strncpy ((char *) args.interface_name, TEST_IF_NAME, strlen (TEST_IF_NAME));
+  strncpy ((char *) args.instance_name, TEST_APP_NAME,
+	   strlen (TEST_APP_NAME));
+
+  if ((err = memif_create (&conn, &args, on_connect,
+			   on_disconnect, on_interrupt,
+			   NULL)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  memif_connection_t *c = (memif_connection_t *) conn;
+
+  c->run_args.num_s2m_rings = 1;
+  c->run_args.num_m2s_rings = 1;
+  c->run_args.log2_ring_size = 17;
+  c->run_args.buffer_size = 64;
+
+  if ((err = memif_init_regions_and_queues (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+
+  c->fd = 69;
+
+  /* transmit across ring end, indices above 16 bits */
+  mq = &c->tx_queues[0];
+  ring = mq->ring;
+  mq->last_head = mq->last_tail = ring->tail_wide = 131000;
+
+  if ((err =
+       memif_buffer_alloc (conn, 0, bufs, 100, &n, 0)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (n, 100);
+  ck_assert_uint_eq (bufs[0].desc_index, 131000);
+  ck_assert_uint_eq (bufs[99].desc_index, 27);
+  for (i = 0; i < n; i++)
+    bufs[i].data_len = 64;
+
+  if ((err = memif_tx_burst (conn, 0, bufs, n, &n)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (n, 100);
+  ck_assert_uint_eq (ring->head_wide, 28);
+  ck_assert_uint_eq (ring->head, 0);
+
+  /* receive and release slots beyond 16 bit index */
+  mq = &c->rx_queues[0];
+  ring = mq->ring;
+  mq->last_head = mq->last_tail = mq->cached_head = 70000;
+  ring->head_wide = 70010;
+
+  if ((err = memif_rx_burst (conn, 0, bufs, 100, &n)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (n, 10);
+  ck_assert_uint_eq (bufs[9].desc_index, 70009);
+  ck_assert_ptr_eq (bufs[9].data, memif_get_buffer (c, ring, 70009));
+
+  if ((err = memif_buffer_free (conn, 0, bufs, n, &n)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_uint_eq (ring->tail_wide, 70010);
+  ck_assert_uint_eq (ring->tail, 0);
+
+  c->fd = -1;
+  if ((err = memif_disconnect_internal (c)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
   if (lm->timerfd > 0)
     close (lm->timerfd);
@@ -1053,22 +3335,47 @@ END_TEST Suite * main_suite ()
   /* add tests to test case */
   tcase_add_test (tc_api, test_init);
   tcase_add_test (tc_api, test_init_epoll);
+  tcase_add_test (tc_api, test_poll_events);
   tcase_add_test (tc_api, test_create);
   tcase_add_test (tc_api, test_create_master);
   tcase_add_test (tc_api, test_create_mult);
+  tcase_add_test (tc_api, test_create_master_mult_socket);
   tcase_add_test (tc_api, test_control_fd_handler);
+  tcase_add_test (tc_api, test_fd_dispatch);
+  tcase_add_test (tc_api, test_poll_events_stale);
+  tcase_add_test (tc_api, test_connect_backoff);
   tcase_add_test (tc_api, test_buffer_alloc);
+  tcase_add_test (tc_api, test_buffer_alloc_single);
   tcase_add_test (tc_api, test_tx_burst);
+  tcase_add_test (tc_api, test_tx_ring_full);
+  tcase_add_test (tc_api, test_tx_coalesce);
+  tcase_add_test (tc_api, test_tx_burst_copy);
+  tcase_add_test (tc_api, test_buffer_classes);
+  tcase_add_test (tc_api, test_buffer_headroom);
   tcase_add_test (tc_api, test_rx_burst);
+  tcase_add_test (tc_api, test_rx_adaptive);
+  tcase_add_test (tc_api, test_packet_burst);
   tcase_add_test (tc_api, test_buffer_free);
+  tcase_add_test (tc_api, test_buffer_free_out_of_order);
+  tcase_add_test (tc_api, test_forward_burst);
   tcase_add_test (tc_api, test_get_details);
 
   /* create internal test case */
   tc_internal = tcase_create ("Internal");
   /* add tests to test case */
   tcase_add_test (tc_internal, test_init_regions_and_queues);
+  tcase_add_test (tc_internal, test_init_regions_and_queues_multi);
+  tcase_add_test (tc_internal, test_init_regions_old_master);
+  tcase_add_test (tc_internal, test_init_regions_deep_rings);
+  tcase_add_test (tc_internal, test_init_regions_hugepages);
+  tcase_add_test (tc_internal, test_init_regions_numa);
+  tcase_add_test (tc_internal, test_init_regions_prefault);
+  tcase_add_test (tc_internal, test_init_regions_coloring);
   tcase_add_test (tc_internal, test_connect1);
   tcase_add_test (tc_internal, test_disconnect_internal);
+  tcase_add_test (tc_internal, test_disconnect_keep_regions);
+  tcase_add_test (tc_internal, test_region_add);
+  tcase_add_test (tc_internal, test_ring_wide);
 
   /* add test cases to test suite */
   suite_add_tcase (s, tc_api);
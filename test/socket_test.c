@@ -15,6 +15,9 @@
  *------------------------------------------------------------------
  */
 
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include <socket_test.h>
 
 #include <memif_private.h>
@@ -34,19 +37,20 @@ get_queue_len (memif_msg_queue_elt_t * q)
 }
 
 static void
-queue_free (memif_msg_queue_elt_t ** e)
+queue_free (memif_msg_queue_elt_t ** q)
 {
-  if (*e == NULL)
-    return;
-  queue_free (&(*e)->next);
-  free (*e);
-  *e = NULL;
-  return;
+  memif_msg_queue_elt_t *e;
+  while ((e = *q) != NULL)
+    {
+      *q = e->next;
+      free (e);
+    }
 }
 
 START_TEST (test_msg_queue)
 {
   memif_connection_t conn;
+  memset (&conn, 0, sizeof (conn));
   conn.msg_queue = NULL;
   conn.fd = -1;
 
@@ -80,8 +84,45 @@ START_TEST (test_msg_queue)
     }
 
   ck_assert_int_eq ((len - pop), get_queue_len (conn.msg_queue));
+  ck_assert_int_eq (pop, get_queue_len (conn.msg_pool));
 
   queue_free (&conn.msg_queue);
+  queue_free (&conn.msg_pool);
+}
+
+END_TEST
+START_TEST (test_msg_pool)
+{
+  int err, i, round, sv[2];
+  memif_msg_t msg;
+  memif_connection_t conn;
+  memset (&conn, 0, sizeof (conn));
+
+  ck_assert_int_eq (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sv), 0);
+  conn.fd = sv[0];
+  conn.flags = MEMIF_CONNECTION_FLAG_PIPELINE;
+
+  /* same handshake repeated, as on reconnect */
+  for (round = 0; round < 3; round++)
+    {
+      memif_msg_enq_init (&conn);
+      for (i = 0; i < 8; i++)
+	memif_msg_enq_ack (&conn);
+      memif_msg_enq_connect (&conn);
+
+      if ((err = memif_conn_fd_write_ready (&conn)) != MEMIF_ERR_SUCCESS)
+	ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+      ck_assert_ptr_eq (conn.msg_queue, NULL);
+      for (i = 0; i < 10; i++)
+	ck_assert_int_gt (recv (sv[1], &msg, sizeof (msg), MSG_DONTWAIT), 0);
+
+      /* only first handshake allocates queue elements */
+      ck_assert_uint_eq (conn.msg_pool_allocs, 10);
+    }
+
+  close (sv[0]);
+  close (sv[1]);
+  queue_free (&conn.msg_pool);
 }
 
 END_TEST
@@ -89,7 +130,7 @@ START_TEST (test_enq_ack)
 {
   int err;
   memif_connection_t conn;
-  conn.msg_queue = NULL;
+  memset (&conn, 0, sizeof (conn));
 
   if ((err = memif_msg_enq_ack (&conn)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
@@ -105,7 +146,7 @@ START_TEST (test_enq_init)
 {
   int err;
   memif_connection_t conn;
-  conn.msg_queue = NULL;
+  memset (&conn, 0, sizeof (conn));
 
   conn.args.interface_id = 69;
   conn.args.mode = 0;
@@ -137,7 +178,7 @@ START_TEST (test_enq_add_region)
 {
   int err;
   memif_connection_t conn;
-  conn.msg_queue = NULL;
+  memset (&conn, 0, sizeof (conn));
   conn.regions = (memif_region_t *) malloc (sizeof (memif_region_t));
   memif_region_t *mr = conn.regions;
   mr->fd = 5;
@@ -169,7 +210,7 @@ START_TEST (test_enq_add_ring)
 {
   int err;
   memif_connection_t conn;
-  conn.msg_queue = NULL;
+  memset (&conn, 0, sizeof (conn));
   conn.rx_queues = (memif_queue_t *) malloc (sizeof (memif_queue_t));
   conn.tx_queues = (memif_queue_t *) malloc (sizeof (memif_queue_t));
 
@@ -205,7 +246,7 @@ START_TEST (test_enq_connect)
 {
   int err;
   memif_connection_t conn;
-  conn.msg_queue = NULL;
+  memset (&conn, 0, sizeof (conn));
   memset (conn.args.interface_name, 0, sizeof (conn.args.interface_name));
   strncpy ((char *) conn.args.interface_name, TEST_IF_NAME,
 	   strlen (TEST_IF_NAME));
@@ -226,7 +267,7 @@ START_TEST (test_enq_connected)
 {
   int err;
   memif_connection_t conn;
-  conn.msg_queue = NULL;
+  memset (&conn, 0, sizeof (conn));
   memset (conn.args.interface_name, 0, sizeof (conn.args.interface_name));
   strncpy ((char *) conn.args.interface_name, TEST_IF_NAME,
 	   strlen (TEST_IF_NAME));
@@ -255,6 +296,67 @@ START_TEST (test_send)
 		   "err code: %u, err msg: %s", err, memif_strerror (err));
 }
 
+END_TEST
+START_TEST (test_send_queue)
+{
+  int err, i, sv[2], afd = -1;
+  memif_connection_t conn;
+  memif_msg_t msg;
+  struct msghdr mh;
+  struct iovec iov[1];
+  char ctl[CMSG_SPACE (sizeof (int))];
+  struct cmsghdr *cmsg;
+  memset (&conn, 0, sizeof (conn));
+
+  ck_assert_int_eq (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sv), 0);
+  conn.fd = sv[0];
+  conn.flags = MEMIF_CONNECTION_FLAG_PIPELINE;
+
+  memif_msg_enq_init (&conn);
+  for (i = 0; i < 3; i++)
+    memif_msg_enq_ack (&conn);
+  conn.msg_queue->next->fd = sv[1];
+  memif_msg_enq_connect (&conn);
+
+  /* all messages sent at once, without ack from peer */
+  if ((err = memif_conn_fd_write_ready (&conn)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert_ptr_eq (conn.msg_queue, NULL);
+
+  for (i = 0; i < 5; i++)
+    {
+      memset (&mh, 0, sizeof (mh));
+      iov[0].iov_base = &msg;
+      iov[0].iov_len = sizeof (msg);
+      mh.msg_iov = iov;
+      mh.msg_iovlen = 1;
+      mh.msg_control = ctl;
+      mh.msg_controllen = sizeof (ctl);
+      ck_assert_int_eq (recvmsg (sv[1], &mh, MSG_DONTWAIT), sizeof (msg));
+      if (i == 0)
+	ck_assert_uint_eq (msg.type, MEMIF_MSG_TYPE_INIT);
+      else if (i == 4)
+	ck_assert_uint_eq (msg.type, MEMIF_MSG_TYPE_CONNECT);
+      else
+	ck_assert_uint_eq (msg.type, MEMIF_MSG_TYPE_ACK);
+      cmsg = CMSG_FIRSTHDR (&mh);
+      if (i == 1)
+	{
+	  ck_assert_ptr_ne (cmsg, NULL);
+	  ck_assert_int_eq (cmsg->cmsg_type, SCM_RIGHTS);
+	  memcpy (&afd, CMSG_DATA (cmsg), sizeof (int));
+	}
+      else
+	ck_assert_ptr_eq (cmsg, NULL);
+    }
+  ck_assert_int_gt (afd, -1);
+
+  close (afd);
+  close (sv[0]);
+  close (sv[1]);
+  queue_free (&conn.msg_pool);
+}
+
 END_TEST
 START_TEST (test_send_hello)
 {
@@ -299,6 +401,7 @@ START_TEST (test_recv_hello)
 
   memif_msg_hello_t *h = &msg.hello;
 
+  memset (&msg, 0, sizeof (msg));
   msg.type = MEMIF_MSG_TYPE_HELLO;
 
   h->min_version = MEMIF_VERSION;
@@ -306,8 +409,10 @@ START_TEST (test_recv_hello)
   h->max_s2m_ring = 1;
   h->max_m2s_ring = 1;
   h->max_log2_ring_size = 14;
+  h->features = MEMIF_MSG_FEATURE_PIPELINE;
   strncpy ((char *) h->name, TEST_IF_NAME, strlen (TEST_IF_NAME));
   memset (conn.remote_name, 0, sizeof (conn.remote_name));
+  conn.flags = 0;
 
   conn.args.num_s2m_rings = 4;
   conn.args.num_m2s_rings = 6;
@@ -320,6 +425,20 @@ START_TEST (test_recv_hello)
   ck_assert_uint_eq (conn.run_args.num_m2s_rings, 2);
   ck_assert_uint_eq (conn.run_args.log2_ring_size, 10);
   ck_assert_str_eq (conn.remote_name, TEST_IF_NAME);
+  ck_assert (conn.flags & MEMIF_CONNECTION_FLAG_PIPELINE);
+  ck_assert (!(conn.flags & MEMIF_CONNECTION_FLAG_MULTI_REGION));
+
+  h->features |= MEMIF_MSG_FEATURE_MULTI_REGION;
+  if ((err = memif_msg_receive_hello (&conn, &msg)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert (conn.flags & MEMIF_CONNECTION_FLAG_MULTI_REGION);
+
+  /* older master does not advertise features */
+  h->features = 0;
+  if ((err = memif_msg_receive_hello (&conn, &msg)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
+  ck_assert (!(conn.flags & MEMIF_CONNECTION_FLAG_PIPELINE));
+  ck_assert (!(conn.flags & MEMIF_CONNECTION_FLAG_MULTI_REGION));
 
   h->max_version = 9;
   if ((err = memif_msg_receive_hello (&conn, &msg)) != MEMIF_ERR_SUCCESS)
@@ -355,12 +474,9 @@ START_TEST (test_recv_init)
   strncpy ((char *) i->secret, TEST_SECRET, strlen (TEST_SECRET));
 
   memif_socket_t ms;
-  ms.interface_list_len = 1;
-  ms.interface_list = malloc (sizeof (memif_list_elt_t));
-  memif_list_elt_t elt;
-  elt.key = 69;
-  elt.data_struct = &conn;
-  add_list_elt (&elt, &ms.interface_list, &ms.interface_list_len);
+  memset (&ms, 0, sizeof (ms));
+  if ((err = memif_socket_interface_add (&ms, &conn)) != MEMIF_ERR_SUCCESS)
+    ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
   if ((err =
        memif_init (control_fd_update, TEST_APP_NAME)) != MEMIF_ERR_SUCCESS)
@@ -411,6 +527,7 @@ START_TEST (test_recv_add_region)
   int err;
   memif_connection_t conn;
   conn.regions = NULL;
+  conn.regions_num = 0;
   memif_msg_t msg;
   msg.type = MEMIF_MSG_TYPE_ADD_REGION;
   msg.add_region.size = 2048;
@@ -436,6 +553,9 @@ START_TEST (test_recv_add_ring)
   memif_connection_t conn;
   int fd = 5;
   memif_msg_t msg;
+  memif_region_t region;
+  memset (&conn, 0, sizeof (conn));
+  memset (&region, 0, sizeof (region));
   conn.args.num_s2m_rings = 2;
   conn.args.num_m2s_rings = 2;
   conn.rx_queues = NULL;
@@ -451,6 +571,14 @@ START_TEST (test_recv_add_ring)
   ar->flags |= MEMIF_MSG_ADD_RING_FLAG_S2M;
   ar->index = 1;
 
+  /* region not announced */
+  err = memif_msg_receive_add_ring (&conn, &msg, fd);
+  ck_assert_int_eq (err, MEMIF_ERR_MAXREG);
+
+  region.region_size = 1 << 16;
+  conn.regions = &region;
+  conn.regions_num = 1;
+
   if ((err =
        memif_msg_receive_add_ring (&conn, &msg, fd)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
@@ -463,6 +591,18 @@ START_TEST (test_recv_add_ring)
        memif_msg_receive_add_ring (&conn, &msg, fd)) != MEMIF_ERR_SUCCESS)
     ck_abort_msg ("err code: %u, err msg: %s", err, memif_strerror (err));
 
+  /* ring past end of region, offset must not wrap around */
+  ar->offset = region.region_size - 2048;
+  err = memif_msg_receive_add_ring (&conn, &msg, fd);
+  ck_assert_int_eq (err, MEMIF_ERR_MAXRING);
+  ar->offset = UINT64_MAX - 2048;
+  err = memif_msg_receive_add_ring (&conn, &msg, fd);
+  ck_assert_int_eq (err, MEMIF_ERR_MAXRING);
+  ar->offset = 0;
+  ar->log2_ring_size = 14;
+  err = memif_msg_receive_add_ring (&conn, &msg, fd);
+  ck_assert_int_eq (err, MEMIF_ERR_MAXRING);
+
 }
 
 END_TEST
@@ -585,6 +725,7 @@ END_TEST Suite * socket_suite ()
   tc_msg_queue = tcase_create ("Message queue");
   /* add tests to test case */
   tcase_add_test (tc_msg_queue, test_msg_queue);
+  tcase_add_test (tc_msg_queue, test_msg_pool);
 
   /* create msg enq test case */
   tc_msg_enq = tcase_create ("Message enqueue");
@@ -600,6 +741,7 @@ END_TEST Suite * socket_suite ()
   tc_msg_send = tcase_create ("Message send");
   /* add tests to test case */
   tcase_add_test (tc_msg_send, test_send);
+  tcase_add_test (tc_msg_send, test_send_queue);
   tcase_add_test (tc_msg_send, test_send_hello);
   tcase_add_test (tc_msg_send, test_send_disconnect);
 